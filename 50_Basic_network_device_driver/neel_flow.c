@@ -0,0 +1,299 @@
+/*
+ * Userspace control of the neel_netif flow table over generic netlink.
+ *
+ *     insmod network_device_driver.ko nr_ifs=2
+ *     ./neel_flow add <iif> <tcp|udp|proto> <src> <sport> <dst> <dport> <oif> <rx|tx>
+ *     ./neel_flow del <iif> <tcp|udp|proto> <src> <sport> <dst> <dport>
+ *     ./neel_flow show
+ *     ./neel_flow flush
+ *
+ * Addresses are IPv4 or IPv6, interfaces are names. See neel_flow.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "neel_flow.h"
+
+#define BUF_SIZE    8192
+
+static char buf[BUF_SIZE];
+static int nl_seq;
+
+struct req {
+    struct nlmsghdr nlh;
+    struct genlmsghdr genl;
+    char attrs[512];
+};
+
+static void add_attr(struct nlmsghdr *nlh, int type, const void *data, int len)
+{
+    struct nlattr *nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy((char *)nla + NLA_HDRLEN, data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+static void init_req(struct req *req, int family, int cmd, int flags)
+{
+    memset(req, 0, sizeof(*req));
+    req->nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    req->nlh.nlmsg_type = family;
+    req->nlh.nlmsg_flags = NLM_F_REQUEST | flags;
+    req->nlh.nlmsg_seq = ++nl_seq;
+    req->genl.cmd = cmd;
+    req->genl.version = NEEL_FLOW_GENL_VERSION;
+}
+
+/*
+ * Send a request and read the replies until the ACK or NLMSG_DONE.
+ * "cb" is called for every other message. Returns 0 or -errno.
+ */
+static int talk(int fd, struct req *req, void (*cb)(struct nlmsghdr *, void *),
+                void *arg)
+{
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+    if (sendto(fd, req, req->nlh.nlmsg_len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) < 0)
+        return -errno;
+
+    while (1) {
+        int len = recv(fd, buf, sizeof(buf), 0);
+        struct nlmsghdr *nlh;
+
+        if (len < 0)
+            return -errno;
+
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE)
+                return 0;
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+                return e->error;
+            }
+            if (cb)
+                cb(nlh, arg);
+        }
+    }
+}
+
+static struct nlattr *next_attr(struct nlattr *nla, int *rem)
+{
+    *rem -= NLA_ALIGN(nla->nla_len);
+    return (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+}
+
+#define for_each_attr(nla, start, len, rem) \
+    for (nla = (struct nlattr *)(start), rem = (len); \
+         rem >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= rem; \
+         nla = next_attr(nla, &rem))
+
+#define ATTR_DATA(nla)  ((void *)((char *)(nla) + NLA_HDRLEN))
+
+static void family_cb(struct nlmsghdr *nlh, void *arg)
+{
+    struct genlmsghdr *genl = NLMSG_DATA(nlh);
+    struct nlattr *nla;
+    int rem;
+
+    for_each_attr(nla, (char *)genl + GENL_HDRLEN,
+                  nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), rem)
+        if (nla->nla_type == CTRL_ATTR_FAMILY_ID)
+            *(int *)arg = *(__u16 *)ATTR_DATA(nla);
+}
+
+static int resolve_family(int fd)
+{
+    struct req req;
+    int id = 0;
+
+    init_req(&req, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0);
+    req.genl.version = 1;
+    add_attr(&req.nlh, CTRL_ATTR_FAMILY_NAME, NEEL_FLOW_GENL_NAME,
+             strlen(NEEL_FLOW_GENL_NAME) + 1);
+
+    if (talk(fd, &req, family_cb, &id) < 0 || !id)
+        return -1;
+    return id;
+}
+
+static void show_cb(struct nlmsghdr *nlh, void *arg)
+{
+    struct genlmsghdr *genl = NLMSG_DATA(nlh);
+    char src[INET6_ADDRSTRLEN] = "?", dst[INET6_ADDRSTRLEN] = "?";
+    char iif[IF_NAMESIZE] = "?", oif[IF_NAMESIZE] = "?";
+    unsigned long long packets = 0, bytes = 0;
+    unsigned int sport = 0, dport = 0, proto = 0, action = 0;
+    struct nlattr *nla;
+    int rem;
+
+    (void)arg;
+    for_each_attr(nla, (char *)genl + GENL_HDRLEN,
+                  nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), rem) {
+        void *data = ATTR_DATA(nla);
+        int af = nla->nla_len - NLA_HDRLEN == 4 ? AF_INET : AF_INET6;
+
+        switch (nla->nla_type) {
+        case NEEL_FLOW_A_IIF:
+            if_indextoname(*(__u32 *)data, iif);
+            break;
+        case NEEL_FLOW_A_OIF:
+            if_indextoname(*(__u32 *)data, oif);
+            break;
+        case NEEL_FLOW_A_PROTO:
+            proto = *(__u8 *)data;
+            break;
+        case NEEL_FLOW_A_ACTION:
+            action = *(__u8 *)data;
+            break;
+        case NEEL_FLOW_A_SRC:
+            inet_ntop(af, data, src, sizeof(src));
+            break;
+        case NEEL_FLOW_A_DST:
+            inet_ntop(af, data, dst, sizeof(dst));
+            break;
+        case NEEL_FLOW_A_SPORT:
+            sport = ntohs(*(__u16 *)data);
+            break;
+        case NEEL_FLOW_A_DPORT:
+            dport = ntohs(*(__u16 *)data);
+            break;
+        case NEEL_FLOW_A_PACKETS:
+            memcpy(&packets, data, sizeof(packets));
+            break;
+        case NEEL_FLOW_A_BYTES:
+            memcpy(&bytes, data, sizeof(bytes));
+            break;
+        }
+    }
+
+    printf("%s proto %u %s:%u -> %s:%u => %s %s  packets %llu bytes %llu\n",
+           iif, proto, src, sport, dst, dport, oif,
+           action == NEEL_FLOW_ACT_TX ? "tx" : "rx", packets, bytes);
+}
+
+static int parse_proto(const char *s)
+{
+    if (!strcmp(s, "tcp"))
+        return IPPROTO_TCP;
+    if (!strcmp(s, "udp"))
+        return IPPROTO_UDP;
+    return atoi(s);
+}
+
+static int add_addr(struct nlmsghdr *nlh, int type, const char *s)
+{
+    unsigned char addr[16];
+
+    if (inet_pton(AF_INET, s, addr) == 1)
+        add_attr(nlh, type, addr, 4);
+    else if (inet_pton(AF_INET6, s, addr) == 1)
+        add_attr(nlh, type, addr, 16);
+    else
+        return -1;
+    return 0;
+}
+
+/* argv: iif proto src sport dst dport */
+static int add_key(struct nlmsghdr *nlh, char **argv)
+{
+    __u32 iif = if_nametoindex(argv[0]);
+    __u8 proto = parse_proto(argv[1]);
+    __u16 sport = htons(atoi(argv[3]));
+    __u16 dport = htons(atoi(argv[5]));
+
+    if (!iif) {
+        printf("unknown interface %s\n", argv[0]);
+        return -1;
+    }
+    if (add_addr(nlh, NEEL_FLOW_A_SRC, argv[2]) ||
+        add_addr(nlh, NEEL_FLOW_A_DST, argv[4])) {
+        printf("bad address\n");
+        return -1;
+    }
+    add_attr(nlh, NEEL_FLOW_A_IIF, &iif, sizeof(iif));
+    add_attr(nlh, NEEL_FLOW_A_PROTO, &proto, sizeof(proto));
+    add_attr(nlh, NEEL_FLOW_A_SPORT, &sport, sizeof(sport));
+    add_attr(nlh, NEEL_FLOW_A_DPORT, &dport, sizeof(dport));
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("usage: neel_flow add <iif> <tcp|udp|proto> <src> <sport> <dst> <dport> <oif> <rx|tx>\n"
+           "       neel_flow del <iif> <tcp|udp|proto> <src> <sport> <dst> <dport>\n"
+           "       neel_flow show\n"
+           "       neel_flow flush\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_nl self = { .nl_family = AF_NETLINK };
+    struct req req;
+    int fd, family, err;
+
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&self, sizeof(self)) < 0) {
+        printf("netlink socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    family = resolve_family(fd);
+    if (family < 0) {
+        printf("generic netlink family %s not found, is the driver loaded?\n",
+               NEEL_FLOW_GENL_NAME);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "add") && argc == 10) {
+        __u32 oif = if_nametoindex(argv[8]);
+        __u8 action = strcmp(argv[9], "tx") ? NEEL_FLOW_ACT_RX : NEEL_FLOW_ACT_TX;
+
+        init_req(&req, family, NEEL_FLOW_CMD_ADD, NLM_F_ACK);
+        if (add_key(&req.nlh, argv + 2))
+            return 1;
+        add_attr(&req.nlh, NEEL_FLOW_A_OIF, &oif, sizeof(oif));
+        add_attr(&req.nlh, NEEL_FLOW_A_ACTION, &action, sizeof(action));
+        err = talk(fd, &req, NULL, NULL);
+    } else if (!strcmp(argv[1], "del") && argc == 8) {
+        init_req(&req, family, NEEL_FLOW_CMD_DEL, NLM_F_ACK);
+        if (add_key(&req.nlh, argv + 2))
+            return 1;
+        err = talk(fd, &req, NULL, NULL);
+    } else if (!strcmp(argv[1], "show")) {
+        init_req(&req, family, NEEL_FLOW_CMD_GET, NLM_F_DUMP);
+        err = talk(fd, &req, show_cb, NULL);
+    } else if (!strcmp(argv[1], "flush")) {
+        init_req(&req, family, NEEL_FLOW_CMD_FLUSH, NLM_F_ACK);
+        err = talk(fd, &req, NULL, NULL);
+    } else {
+        usage();
+        return 1;
+    }
+
+    if (err) {
+        printf("%s: %s\n", argv[1], strerror(-err));
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
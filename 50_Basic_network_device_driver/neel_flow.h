@@ -0,0 +1,53 @@
+/*
+ * Generic netlink interface of the neel_netif flow table, shared between
+ * network_device_driver.c and userspace (neel_flow.c).
+ *
+ * A flow is an exact match on
+ *
+ *     ingress neel_netif, L4 protocol, source and destination address,
+ *     source and destination port (TCP and UDP only, 0 otherwise)
+ *
+ * and forwards matching frames to another neel_netif, either into its
+ * receive path (NEEL_FLOW_ACT_RX) or out of one of its TX queues
+ * (NEEL_FLOW_ACT_TX), without going through the IP stack.
+ *
+ * Addresses are 4 (IPv4) or 16 (IPv6) bytes in network byte order, as
+ * are the ports.
+ */
+#ifndef NEEL_FLOW_H
+#define NEEL_FLOW_H
+
+#define NEEL_FLOW_GENL_NAME     "neel_flow"
+#define NEEL_FLOW_GENL_VERSION  1
+
+enum {
+    NEEL_FLOW_CMD_UNSPEC,
+    NEEL_FLOW_CMD_ADD,          /* all keys, OIF and ACTION */
+    NEEL_FLOW_CMD_DEL,          /* all keys */
+    NEEL_FLOW_CMD_GET,          /* dump only */
+    NEEL_FLOW_CMD_FLUSH,        /* no attributes */
+    __NEEL_FLOW_CMD_MAX,
+};
+#define NEEL_FLOW_CMD_MAX       (__NEEL_FLOW_CMD_MAX - 1)
+
+enum {
+    NEEL_FLOW_A_UNSPEC,
+    NEEL_FLOW_A_IIF,            /* u32, ifindex the frames arrive on */
+    NEEL_FLOW_A_PROTO,          /* u8, IPPROTO_* */
+    NEEL_FLOW_A_SRC,            /* binary, 4 or 16 bytes */
+    NEEL_FLOW_A_DST,            /* binary, 4 or 16 bytes */
+    NEEL_FLOW_A_SPORT,          /* be16 */
+    NEEL_FLOW_A_DPORT,          /* be16 */
+    NEEL_FLOW_A_OIF,            /* u32, ifindex of the target neel_netif */
+    NEEL_FLOW_A_ACTION,         /* u8, NEEL_FLOW_ACT_* */
+    NEEL_FLOW_A_PACKETS,        /* u64, frames forwarded (dump) */
+    NEEL_FLOW_A_BYTES,          /* u64, bytes forwarded (dump) */
+    NEEL_FLOW_A_PAD,
+    __NEEL_FLOW_A_MAX,
+};
+#define NEEL_FLOW_A_MAX         (__NEEL_FLOW_A_MAX - 1)
+
+#define NEEL_FLOW_ACT_RX        0   /* into the target's receive path */
+#define NEEL_FLOW_ACT_TX        1   /* out of the target's TX queue */
+
+#endif /* NEEL_FLOW_H */
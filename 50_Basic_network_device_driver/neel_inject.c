@@ -0,0 +1,115 @@
+/*
+ * Userspace injector for neel_netif.
+ *
+ *     insmod network_device_driver.ko
+ *     ifconfig neel_netif0 up 192.168.3.197
+ *     ./neel_inject [count] [batch]
+ *
+ * Builds "count" UDP frames addressed to neel_netif0 and pushes them
+ * into its receive path through /dev/neel_inject, "batch" frames per
+ * writev() call. Source ports vary, so RSS spreads the frames over all
+ * RX queues.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#define FRAME_LEN   128
+#define MAX_BATCH   1024
+
+static unsigned char frames[MAX_BATCH][FRAME_LEN];
+static struct iovec iov[MAX_BATCH];
+
+static unsigned short ip_checksum(const void *data, int len)
+{
+    const unsigned short *p = data;
+    unsigned int sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *p++;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static void build_frame(unsigned char *frame, unsigned short sport)
+{
+    static const unsigned char dst[ETH_ALEN] = { 0, 1, 2, 3, 4, 5 };
+    static const unsigned char src[ETH_ALEN] = { 2, 0, 0, 0, 0, 1 };
+    struct ether_header *eth = (struct ether_header *)frame;
+    struct iphdr *ip = (struct iphdr *)(eth + 1);
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+    memset(frame, 0, FRAME_LEN);
+    memcpy(eth->ether_dhost, dst, ETH_ALEN);
+    memcpy(eth->ether_shost, src, ETH_ALEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->tot_len = htons(FRAME_LEN - sizeof(*eth));
+    ip->saddr = inet_addr("192.168.3.1");
+    ip->daddr = inet_addr("192.168.3.197");
+    ip->check = ip_checksum(ip, sizeof(*ip));
+
+    udp->source = htons(sport);
+    udp->dest = htons(9);       /* discard */
+    udp->len = htons(FRAME_LEN - sizeof(*eth) - sizeof(*ip));
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    int batch = argc > 2 ? atoi(argv[2]) : 64;
+    unsigned long sent = 0;
+    int fd, i;
+
+    if (batch < 1 || batch > MAX_BATCH) {
+        printf("batch must be between 1 and %d\n", MAX_BATCH);
+        return 1;
+    }
+
+    fd = open("/dev/neel_inject", O_WRONLY);
+    if (fd < 0) {
+        printf("open(/dev/neel_inject): %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < MAX_BATCH; i++) {
+        build_frame(frames[i], 10000 + i);
+        iov[i].iov_base = frames[i];
+        iov[i].iov_len = FRAME_LEN;
+    }
+
+    while (sent < count) {
+        int n = batch;
+        ssize_t rc;
+
+        if (count - sent < (unsigned long)batch)
+            n = count - sent;
+
+        rc = writev(fd, iov, n);
+
+        if (rc < 0) {
+            printf("writev(): %s\n", strerror(errno));
+            close(fd);
+            return 1;
+        }
+        sent += rc / FRAME_LEN;
+    }
+
+    printf("Injected %lu frames\n", sent);
+    close(fd);
+
+    return 0;
+}
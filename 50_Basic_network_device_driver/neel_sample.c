@@ -0,0 +1,275 @@
+/*
+ * Collector for the neel_netif packet sampler.
+ *
+ *     insmod network_device_driver.ko
+ *     ./neel_sample [rate] [hdr_len]
+ *
+ * Sets the sampling rate (1 in "rate" frames, 0 stops sampling) and
+ * header length when given, joins the "samples" multicast group of the
+ * "neel_sample" generic netlink family and prints every sample, plus
+ * the estimated number of frames per CPU scaled from the samples as an
+ * sFlow collector would. See neel_sample.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "neel_sample.h"
+
+#define BUF_SIZE    65536
+#define MAX_CPUS    1024
+
+static char buf[BUF_SIZE];
+static unsigned long long received[MAX_CPUS];
+
+struct req {
+    struct nlmsghdr nlh;
+    struct genlmsghdr genl;
+    char attrs[256];
+};
+
+static void add_attr(struct nlmsghdr *nlh, int type, const void *data, int len)
+{
+    struct nlattr *nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy((char *)nla + NLA_HDRLEN, data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+static struct nlattr *next_attr(struct nlattr *nla, int *rem)
+{
+    *rem -= NLA_ALIGN(nla->nla_len);
+    return (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+}
+
+#define for_each_attr(nla, start, len, rem) \
+    for (nla = (struct nlattr *)(start), rem = (len); \
+         rem >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= rem; \
+         nla = next_attr(nla, &rem))
+
+#define ATTR_DATA(nla)  ((void *)((char *)(nla) + NLA_HDRLEN))
+#define ATTR_LEN(nla)   ((int)(nla)->nla_len - NLA_HDRLEN)
+
+static int request(int fd, int type, int cmd, struct req *req)
+{
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+    req->nlh.nlmsg_type = type;
+    req->nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req->genl.cmd = cmd;
+    req->genl.version = 1;
+
+    if (sendto(fd, req, req->nlh.nlmsg_len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) < 0)
+        return -errno;
+    return 0;
+}
+
+/* Read the replies to a request until the ACK; returns the ACK's error */
+static int reply(int fd, int *family, int *group)
+{
+    while (1) {
+        int len = recv(fd, buf, sizeof(buf), 0);
+        struct nlmsghdr *nlh;
+
+        if (len < 0)
+            return -errno;
+
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            struct genlmsghdr *genl = NLMSG_DATA(nlh);
+            struct nlattr *nla, *grp, *ga;
+            int rem, grem, arem;
+
+            if (nlh->nlmsg_type == NLMSG_ERROR)
+                return ((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+            if (!family)
+                continue;
+
+            for_each_attr(nla, (char *)genl + GENL_HDRLEN,
+                          nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), rem) {
+                if (nla->nla_type == CTRL_ATTR_FAMILY_ID)
+                    *family = *(__u16 *)ATTR_DATA(nla);
+                if (nla->nla_type != CTRL_ATTR_MCAST_GROUPS)
+                    continue;
+                for_each_attr(grp, ATTR_DATA(nla), ATTR_LEN(nla), grem) {
+                    int id = 0, match = 0;
+
+                    for_each_attr(ga, ATTR_DATA(grp), ATTR_LEN(grp), arem) {
+                        if (ga->nla_type == CTRL_ATTR_MCAST_GRP_ID)
+                            id = *(__u32 *)ATTR_DATA(ga);
+                        if (ga->nla_type == CTRL_ATTR_MCAST_GRP_NAME &&
+                            !strcmp(ATTR_DATA(ga), NEEL_SAMPLE_MCGRP_NAME))
+                            match = 1;
+                    }
+                    if (match)
+                        *group = id;
+                }
+            }
+        }
+    }
+}
+
+static void print_sample(struct nlattr *sample)
+{
+    char ifname[IF_NAMESIZE] = "?";
+    unsigned int dir = 0, queue = 0, len = 0;
+    unsigned char *hdr = NULL;
+    struct nlattr *nla;
+    int rem, hdr_len = 0;
+
+    for_each_attr(nla, ATTR_DATA(sample), ATTR_LEN(sample), rem) {
+        switch (nla->nla_type) {
+        case NEEL_SAMPLE_S_IFINDEX:
+            if_indextoname(*(__u32 *)ATTR_DATA(nla), ifname);
+            break;
+        case NEEL_SAMPLE_S_DIR:
+            dir = *(__u8 *)ATTR_DATA(nla);
+            break;
+        case NEEL_SAMPLE_S_QUEUE:
+            queue = *(__u16 *)ATTR_DATA(nla);
+            break;
+        case NEEL_SAMPLE_S_LEN:
+            len = *(__u32 *)ATTR_DATA(nla);
+            break;
+        case NEEL_SAMPLE_S_HEADER:
+            hdr = ATTR_DATA(nla);
+            hdr_len = ATTR_LEN(nla);
+            break;
+        }
+    }
+
+    printf("  %s %s q%u len %u", ifname, dir == NEEL_SAMPLE_DIR_TX ? "TX" : "RX",
+           queue, len);
+    if (hdr && hdr_len >= 14)
+        printf(" ethertype 0x%02x%02x", hdr[12], hdr[13]);
+    printf("\n");
+}
+
+static void print_samples(struct nlmsghdr *nlh)
+{
+    struct genlmsghdr *genl = NLMSG_DATA(nlh);
+    unsigned long long pool = 0, taken = 0, drops = 0;
+    unsigned int cpu = 0, rate = 0, n = 0;
+    struct nlattr *nla;
+    int rem;
+
+    for_each_attr(nla, (char *)genl + GENL_HDRLEN,
+                  nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), rem) {
+        switch (nla->nla_type) {
+        case NEEL_SAMPLE_A_SAMPLE:
+            print_sample(nla);
+            n++;
+            break;
+        case NEEL_SAMPLE_A_CPU:
+            cpu = *(__u32 *)ATTR_DATA(nla);
+            break;
+        case NEEL_SAMPLE_A_RATE:
+            rate = *(__u32 *)ATTR_DATA(nla);
+            break;
+        case NEEL_SAMPLE_A_POOL:
+            memcpy(&pool, ATTR_DATA(nla), sizeof(pool));
+            break;
+        case NEEL_SAMPLE_A_TAKEN:
+            memcpy(&taken, ATTR_DATA(nla), sizeof(taken));
+            break;
+        case NEEL_SAMPLE_A_DROPS:
+            memcpy(&drops, ATTR_DATA(nla), sizeof(drops));
+            break;
+        }
+    }
+
+    if (cpu >= MAX_CPUS)
+        return;
+    received[cpu] += n;
+
+    /* every sample stands for pool / (taken - drops) frames */
+    printf("cpu %u: %u samples, 1 in %u, pool %llu taken %llu drops %llu",
+           cpu, n, rate, pool, taken, drops);
+    if (taken > drops)
+        printf(", estimated %llu frames",
+               received[cpu] * pool / (taken - drops));
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_nl self = { .nl_family = AF_NETLINK };
+    int fd, family = 0, group = 0, err;
+    struct req req;
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&self, sizeof(self)) < 0) {
+        printf("netlink socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    add_attr(&req.nlh, CTRL_ATTR_FAMILY_NAME, NEEL_SAMPLE_GENL_NAME,
+             strlen(NEEL_SAMPLE_GENL_NAME) + 1);
+    err = request(fd, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, &req);
+    if (!err)
+        err = reply(fd, &family, &group);
+    if (err || !family || !group) {
+        printf("generic netlink family %s not found, is the driver loaded?\n",
+               NEEL_SAMPLE_GENL_NAME);
+        return 1;
+    }
+
+    if (argc > 1) {
+        __u32 rate = strtoul(argv[1], NULL, 0);
+
+        memset(&req, 0, sizeof(req));
+        req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+        add_attr(&req.nlh, NEEL_SAMPLE_A_RATE, &rate, sizeof(rate));
+        if (argc > 2) {
+            __u32 hdr_len = strtoul(argv[2], NULL, 0);
+
+            add_attr(&req.nlh, NEEL_SAMPLE_A_HDR_LEN, &hdr_len, sizeof(hdr_len));
+        }
+        err = request(fd, family, NEEL_SAMPLE_CMD_SET, &req);
+        if (!err)
+            err = reply(fd, NULL, NULL);
+        if (err) {
+            printf("NEEL_SAMPLE_CMD_SET: %s\n", strerror(-err));
+            return 1;
+        }
+    }
+
+    if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+                   sizeof(group)) < 0) {
+        printf("NETLINK_ADD_MEMBERSHIP: %s\n", strerror(errno));
+        return 1;
+    }
+
+    while (1) {
+        int len = recv(fd, buf, sizeof(buf), 0);
+        struct nlmsghdr *nlh;
+
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                printf("collector too slow, messages lost\n");
+                continue;
+            }
+            printf("recv(): %s\n", strerror(errno));
+            break;
+        }
+
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len))
+            if (nlh->nlmsg_type == family)
+                print_samples(nlh);
+    }
+
+    close(fd);
+    return 0;
+}
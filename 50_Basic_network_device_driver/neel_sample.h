@@ -0,0 +1,62 @@
+/*
+ * Generic netlink interface of the neel_netif packet sampler, shared
+ * between network_device_driver.c and userspace (neel_sample.c).
+ *
+ * The driver samples 1 in "rate" frames on every CPU, in both the TX and
+ * the RX path, and multicasts the sampled headers to the "samples"
+ * group, many per message. Every message carries the counters of the
+ * CPU it comes from:
+ *
+ *     NEEL_SAMPLE_A_POOL       frames seen by this CPU while sampling
+ *     NEEL_SAMPLE_A_TAKEN      frames this CPU sampled
+ *     NEEL_SAMPLE_A_DROPS      samples lost (no memory, no room)
+ *
+ * so a collector scales what it received by POOL / (TAKEN - DROPS), per
+ * CPU, exactly like an sFlow collector uses sample_pool.
+ */
+#ifndef NEEL_SAMPLE_H
+#define NEEL_SAMPLE_H
+
+#define NEEL_SAMPLE_GENL_NAME       "neel_sample"
+#define NEEL_SAMPLE_GENL_VERSION    1
+#define NEEL_SAMPLE_MCGRP_NAME      "samples"
+/* largest RATE, the driver draws gaps of up to 2 * rate - 1 frames in a u32 */
+#define NEEL_SAMPLE_RATE_MAX        (1U << 31)
+
+enum {
+    NEEL_SAMPLE_CMD_UNSPEC,
+    NEEL_SAMPLE_CMD_SET,        /* RATE and/or HDR_LEN */
+    NEEL_SAMPLE_CMD_SAMPLES,    /* multicast, kernel to userspace */
+    __NEEL_SAMPLE_CMD_MAX,
+};
+#define NEEL_SAMPLE_CMD_MAX         (__NEEL_SAMPLE_CMD_MAX - 1)
+
+enum {
+    NEEL_SAMPLE_A_UNSPEC,
+    NEEL_SAMPLE_A_RATE,         /* u32, 1 in N, 0 switches sampling off */
+    NEEL_SAMPLE_A_HDR_LEN,      /* u32, bytes of each frame to export */
+    NEEL_SAMPLE_A_CPU,          /* u32 */
+    NEEL_SAMPLE_A_POOL,         /* u64 */
+    NEEL_SAMPLE_A_TAKEN,        /* u64 */
+    NEEL_SAMPLE_A_DROPS,        /* u64 */
+    NEEL_SAMPLE_A_SAMPLE,       /* nested NEEL_SAMPLE_S_*, repeated */
+    NEEL_SAMPLE_A_PAD,
+    __NEEL_SAMPLE_A_MAX,
+};
+#define NEEL_SAMPLE_A_MAX           (__NEEL_SAMPLE_A_MAX - 1)
+
+enum {
+    NEEL_SAMPLE_S_UNSPEC,
+    NEEL_SAMPLE_S_IFINDEX,      /* u32 */
+    NEEL_SAMPLE_S_DIR,          /* u8, NEEL_SAMPLE_DIR_* */
+    NEEL_SAMPLE_S_QUEUE,        /* u16 */
+    NEEL_SAMPLE_S_LEN,          /* u32, length of the whole frame */
+    NEEL_SAMPLE_S_HEADER,       /* binary, frame from the MAC header on */
+    __NEEL_SAMPLE_S_MAX,
+};
+#define NEEL_SAMPLE_S_MAX           (__NEEL_SAMPLE_S_MAX - 1)
+
+#define NEEL_SAMPLE_DIR_RX          0
+#define NEEL_SAMPLE_DIR_TX          1
+
+#endif /* NEEL_SAMPLE_H */
@@ -0,0 +1,61 @@
+/*
+ * Layout of the neel_netif capture ring shared between
+ * network_device_driver.c and userspace readers (/dev/neel_tap).
+ *
+ * The mmap'd area starts with one page holding struct neel_tap_ring,
+ * followed by nr_slots slots of slot_size bytes. Each slot holds a
+ * struct neel_tap_desc immediately followed by caplen bytes of frame.
+ *
+ * The driver produces at "head", the reader consumes at "tail":
+ *
+ *     while (tail != head) {
+ *         slot = area + page_size + (tail % nr_slots) * slot_size;
+ *         ...
+ *         tail++;
+ *     }
+ *
+ * Only "tail" is written by userspace, everything else is read only
+ * information maintained by the driver. The driver keeps its own copy
+ * of the rest and never reads it back from the page; a "tail" that is
+ * ahead of "head" or more than nr_slots behind makes it drop frames as
+ * if the ring were full.
+ */
+#ifndef NEEL_TAP_H
+#define NEEL_TAP_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define NEEL_TAP_DIR_RX     0
+#define NEEL_TAP_DIR_TX     1
+
+struct neel_tap_desc {
+    __u64 tstamp_ns;    /* CLOCK_REALTIME when the frame was captured */
+    __u32 len;          /* length of the frame on the wire */
+    __u32 caplen;       /* bytes captured after this descriptor */
+    __u16 queue;        /* TX or RX queue of the frame */
+    __u8  dir;          /* NEEL_TAP_DIR_RX or NEEL_TAP_DIR_TX */
+    __u8  pad[5];
+};
+
+struct neel_tap_ring {
+    __u64 head;         /* written by the driver */
+    __u64 pad0[7];
+    __u64 tail;         /* written by the reader */
+    __u64 pad1[7];
+    __u32 nr_slots;
+    __u32 slot_size;
+    __u32 snaplen;
+    __u32 sample;
+    __u64 captured;
+    __u64 drops;        /* frames lost because the ring was full */
+};
+
+/* Bytes to capture per frame, at most slot_size - sizeof(neel_tap_desc) */
+#define NEEL_TAP_SET_SNAPLEN    _IOW('n', 1, __u32)
+/* Capture one frame out of N (per CPU), 1 captures every frame */
+#define NEEL_TAP_SET_SAMPLE     _IOW('n', 2, __u32)
+/* Total size of the area to mmap */
+#define NEEL_TAP_GET_RING_SIZE  _IOR('n', 3, __u64)
+
+#endif /* NEEL_TAP_H */
@@ -0,0 +1,102 @@
+/*
+ * Userspace reader for the neel_netif capture tap.
+ *
+ *     insmod network_device_driver.ko
+ *     ./neel_tap_reader [snaplen] [sample]
+ *
+ * Maps the ring exported by /dev/neel_tap and prints one line per
+ * captured frame. See neel_tap.h for the ring layout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "neel_tap.h"
+
+int main(int argc, char **argv)
+{
+    struct neel_tap_ring *ring;
+    struct pollfd pfd;
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    __u64 size, tail;
+    __u32 val;
+    int fd;
+
+    fd = open("/dev/neel_tap", O_RDWR);
+    if (fd < 0) {
+        printf("open(/dev/neel_tap): %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (argc > 1) {
+        val = strtoul(argv[1], NULL, 0);
+        if (ioctl(fd, NEEL_TAP_SET_SNAPLEN, &val) < 0) {
+            printf("NEEL_TAP_SET_SNAPLEN: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    if (argc > 2) {
+        val = strtoul(argv[2], NULL, 0);
+        if (ioctl(fd, NEEL_TAP_SET_SAMPLE, &val) < 0) {
+            printf("NEEL_TAP_SET_SAMPLE: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    if (ioctl(fd, NEEL_TAP_GET_RING_SIZE, &size) < 0) {
+        printf("NEEL_TAP_GET_RING_SIZE: %s\n", strerror(errno));
+        return 1;
+    }
+
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        printf("mmap(): %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("Ring: %u slots of %u bytes, snaplen %u, sampling 1/%u\n",
+           ring->nr_slots, ring->slot_size, ring->snaplen, ring->sample);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    tail = ring->tail;
+
+    while (1) {
+        __u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (tail == head) {
+            poll(&pfd, 1, 1000);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            struct neel_tap_desc *desc = (void *)((char *)ring + page_size +
+                    (tail % ring->nr_slots) * ring->slot_size);
+            unsigned char *frame = (unsigned char *)(desc + 1);
+
+            printf("%llu.%09llu %s q%u len %u caplen %u",
+                   desc->tstamp_ns / 1000000000ULL,
+                   desc->tstamp_ns % 1000000000ULL,
+                   desc->dir == NEEL_TAP_DIR_TX ? "TX" : "RX",
+                   desc->queue, desc->len, desc->caplen);
+            if (desc->caplen >= 14)
+                printf(" ethertype 0x%02x%02x", frame[12], frame[13]);
+            printf("\n");
+        }
+
+        /* hand the slots back to the driver */
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        printf("captured %llu dropped %llu\n", ring->captured, ring->drops);
+    }
+
+    munmap(ring, size);
+    close(fd);
+
+    return 0;
+}
@@ -28,70 +28,3559 @@
  * this should avoid the problems.
  *
  */
+
+/*
+ **************************************************************************
+ *    Receive path and RSS (Receive Side Scaling) emulation               *
+ **************************************************************************
+ * 1. neel_netif is a multi-queue device with NEEL_NUM_QUEUES TX and RX
+ *    queues. Every frame handed to ndo_start_xmit is looped back into
+ *    the receive path of the same interface, like a cable plugged from
+ *    the TX port into the RX port. This gives the driver a real receive
+ *    path which can be watched with tcpdump or loaded with pktgen.
+ *
+ * 2. On entry to the receive path the "hardware" computes a Toeplitz
+ *    hash over the 5-tuple (IPv4/IPv6 addresses, and TCP/UDP ports when
+ *    present) using a 40 byte secret key, exactly as described by the
+ *    Microsoft RSS specification that real NICs implement.
+ *
+ * 3. The low bits of the hash index an indirection table whose entries
+ *    are RX queue numbers. The frame is queued on that RX queue and the
+ *    queue's NAPI context is scheduled. skb->hash carries the RSS hash
+ *    up the stack, so RPS/RFS and socket steering reuse it for free.
+ *
+ * 4. The key and the indirection table are exposed through ethtool:
+ *
+ *     ethtool -x neel_netif0                  <== show key and table
+ *     ethtool -X neel_netif0 equal 2          <== spread over queues 0-1
+ *     ethtool -X neel_netif0 weight 1 2 1 0   <== weighted spreading
+ *     ethtool -X neel_netif0 hkey 6d:5a:...   <== change the key
+ *
+ *    Each RX queue raises its emulated interrupt on a CPU of its own,
+ *    the i-th CPU from cpumask_local_spread(), as a NIC's per-queue
+ *    MSI-X vectors do with their default affinity. The queue's NAPI is
+ *    scheduled there, through irq_work_queue_on(), whichever CPU
+ *    transmitted the frame, so flows land on different cores just as
+ *    they do with a real RSS NIC. For another placement, switch to
+ *    threaded NAPI and pin the napi/neel_netif0-* threads instead.
+ *
+ **************************************************************************
+ *    Hardware timestamp emulation                                        *
+ **************************************************************************
+ * 1. neel_netif has no PTP clock, but it can still stamp frames the way
+ *    a timestamping NIC does: at the very edge of the driver. TX frames
+ *    are stamped when ndo_start_xmit accepts them, RX frames when they
+ *    enter the receive path, both from ktime_get_real(), so the stamps
+ *    share the CLOCK_REALTIME domain with the software stamps.
+ *
+ * 2. Stamping is switched on through SIOCSHWTSTAMP, e.g.
+ *
+ *     hwstamp_ctl -i neel_netif0 -t 1 -r 1
+ *
+ *    Any RX filter other than HWTSTAMP_FILTER_NONE is upgraded to
+ *    HWTSTAMP_FILTER_ALL, which is what the driver reports back.
+ *
+ * 3. Applications then ask for SOF_TIMESTAMPING_TX_HARDWARE,
+ *    SOF_TIMESTAMPING_RX_HARDWARE and SOF_TIMESTAMPING_RAW_HARDWARE on
+ *    their sockets. Comparing the driver stamps with the software stamps
+ *    taken by the stack shows where the host adds latency.
+ *    "ethtool -T neel_netif0" lists the capabilities (PHC index -1).
+ *
+ **************************************************************************
+ *    Earliest Departure Time (EDT) pacing                                *
+ **************************************************************************
+ * 1. A non zero skb->tstamp on transmit is a departure time. TCP
+ *    pacing and the fq qdisc set it in CLOCK_MONOTONIC and flag it with
+ *    skb->mono_delivery_time. SO_TXTIME sets it in the clock of the
+ *    socket (often CLOCK_TAI). Monotonic departure times still in the
+ *    future are parked on a per TX queue timer wheel instead of going
+ *    out immediately; any other stamp goes straight through.
+ *
+ * 2. The wheel has NEEL_EDT_SLOTS slots of 2^NEEL_EDT_SLOT_SHIFT ns
+ *    (about 1us each, about 4ms). A bitmap of occupied slots lets the
+ *    hrtimer jump straight to the next slot holding frames. Frames
+ *    further away wait in an overflow rbtree sorted by departure time
+ *    and move into the wheel once their slot is within its span; the
+ *    hrtimer is armed for whichever comes first. Only frames more than
+ *    NEEL_EDT_HORIZON_NS (10s, as fq) away are dropped, like fq's
+ *    horizon_drop.
+ *
+ * 3. Frames are released from the hrtimer (softirq context) and only
+ *    then are they accounted, timestamped and put on the "wire". Holding
+ *    the frame keeps it charged to the sending socket, so a paced sender
+ *    feels back pressure. When a wheel holds NEEL_EDT_LIMIT frames its
+ *    TX queue is stopped until half of them have left.
+ *
+ * 4. How late each frame left is visible per queue in "ethtool -S".
+ *    With hardware timestamps on (see above), the TX stamp of every
+ *    frame is its real release time.
+ *
+ **************************************************************************
+ *    Capture tap through a companion char device (/dev/neel_tap)         *
+ **************************************************************************
+ * 1. The driver registers a misc device next to the interface. A reader
+ *    opens it, sizes its mapping with NEEL_TAP_GET_RING_SIZE and mmaps
+ *    the ring described in neel_tap.h: a header page followed by fixed
+ *    size slots holding a descriptor and the first snaplen bytes.
+ *
+ * 2. TX frames are captured when they go on the wire, RX frames when
+ *    they are queued to their RX queue. The driver copies straight from
+ *    the skb into the mapped ring: no clone, no socket, no extra copy to
+ *    userspace as with AF_PACKET.
+ *
+ * 3. NEEL_TAP_SET_SNAPLEN and NEEL_TAP_SET_SAMPLE (capture 1 frame in N
+ *    on every CPU) tune the cost at run time. When the reader falls
+ *    behind, frames are counted in ring->drops instead of waiting.
+ *
+ *     ./neel_tap_reader 128 10    <== 128 byte snaplen, 1 in 10 frames
+ *
+ **************************************************************************
+ *    Bulk packet injection through /dev/neel_inject                      *
+ **************************************************************************
+ * 1. A second misc device feeds frames from userspace into the receive
+ *    path of neel_netif, as if they had arrived on the wire. Each iovec
+ *    of a writev() call is one complete ethernet frame, so a replay tool
+ *    pushes a whole batch with a single system call where TUN needs one
+ *    write() per packet.
+ *
+ * 2. The driver builds an skb per frame, steers the whole batch through
+ *    RSS, then splices each queue's share onto the RX queue in one go
+ *    and schedules every NAPI context once per batch.
+ *
+ * 3. write() returns the number of bytes consumed. A malformed frame
+ *    stops the batch there; the frames before it are delivered.
+ *
+ *     ./neel_inject 100000 64     <== 100000 UDP frames, 64 per writev
+ *
+ **************************************************************************
+ *    Jumbo frames and page fragment receive buffers                      *
+ **************************************************************************
+ * 1. The MTU can be raised anywhere up to 64 KiB:
+ *
+ *     ip link set neel_netif0 mtu 9000
+ *
+ * 2. Like a real NIC, the receive side never allocates one big linear
+ *    buffer for a big frame. Only the first NEEL_RX_HDR_LEN bytes (the
+ *    headers the stack parses) are copied into the skb's linear area,
+ *    the rest goes into NEEL_RX_BUF_SIZE buffers carved out of pages by
+ *    the page fragment allocator and attached with skb_add_rx_frag().
+ *    A 9000 byte frame is one small skb head plus three fragments.
+ *
+ * 3. The device advertises scatter/gather and checksum offload, so on
+ *    transmit the stack hands over fragmented skbs as well instead of
+ *    linearising jumbo frames first.
+ *
+ **************************************************************************
+ *    Interrupt moderation with net DIM                                   *
+ **************************************************************************
+ * 1. Each RX queue has an emulated interrupt line: an hrtimer firing in
+ *    hardirq context, which schedules the queue's NAPI context exactly
+ *    where a real driver's interrupt handler would, on the queue's
+ *    interrupt CPU (see the RSS section). Like a real NIC the
+ *    "interrupt" is masked while NAPI runs and unmasked by
+ *    napi_complete_done().
+ *
+ * 2. Frames are coalesced: the interrupt fires when rx_max_frames frames
+ *    are pending or rx_usecs after the first pending frame, whichever
+ *    comes first.
+ *
+ * 3. With adaptive moderation on (the default), every completed NAPI run
+ *    feeds a sample (interrupts, packets, bytes) to the kernel's DIM
+ *    library. DIM walks its table of profiles: short intervals when the
+ *    rate is low, for latency, long intervals and big batches when the
+ *    rate is high, for throughput. The current values show up per queue
+ *    in "ethtool -S"; static values can still be forced:
+ *
+ *     ethtool -C neel_netif0 adaptive-rx off rx-usecs 50 rx-frames 64
+ *
+ *    The kernel must be built with CONFIG_DIMLIB.
+ *
+ **************************************************************************
+ *    Busy polling and threaded NAPI                                      *
+ **************************************************************************
+ * 1. Every RX queue has its own NAPI context and every received skb is
+ *    tagged with that context's NAPI ID (napi_gro_receive does this), so
+ *    SO_INCOMING_NAPI_ID, SO_BUSY_POLL, SO_PREFER_BUSY_POLL and epoll
+ *    based busy polling find the right queue. The queue to NAPI mapping
+ *    is published with netif_queue_set_napi() and can be read back with
+ *
+ *     ynl --family netdev --dump queue-get
+ *
+ * 2. While a socket busy polls, napi_complete_done() refuses to complete
+ *    and the emulated interrupt stays masked, exactly as with a real NIC.
+ *    With SO_PREFER_BUSY_POLL plus napi_defer_hard_irqs and
+ *    gro_flush_timeout the application owns the queue and no interrupt
+ *    or softirq gets into its request path.
+ *
+ * 3. Threaded NAPI runs each poll in its own kthread, so the poll can be
+ *    pinned and prioritised like any task. Switch it on at run time
+ *
+ *     echo 1 > /sys/class/net/neel_netif0/threaded
+ *
+ *    or at load time with "insmod network_device_driver.ko threaded=1".
+ *
+ **************************************************************************
+ *    DMA descriptor rings (insmod network_device_driver.ko dma_ring=1)   *
+ **************************************************************************
+ * 1. By default frames travel between TX and RX as skbs. With dma_ring=1
+ *    every TX and RX queue gets a descriptor ring in coherent memory
+ *    (dma_alloc_coherent) and the driver pays what a real NIC driver
+ *    pays for every frame:
+ *
+ *    TX: skb head mapped with dma_map_single, each fragment with
+ *        skb_frag_dma_map, one descriptor per buffer, next_to_use is the
+ *        tail "doorbell". The TX clean routine in NAPI unmaps the buffers
+ *        of completed descriptors and frees the skb.
+ *
+ *    RX: pages mapped with dma_map_page are posted to the ring. NAPI
+ *        does dma_sync_single_for_cpu on filled buffers, copies small
+ *        frames into a fresh skb and hands the page straight back to
+ *        the ring after dma_sync_single_for_device (no remap), and
+ *        attaches bigger frames' pages as fragments, unmapping them.
+ *
+ * 2. The mappings are made against a platform device which parents the
+ *    interface, so they go through the platform's DMA ops (dma-direct,
+ *    and swiotlb bounce buffering when booted with swiotlb=force).
+ *
+ * 3. The emulated device has no bus to write through. It fills an RX
+ *    buffer through the CPU mapping of the page and then pushes it to
+ *    the DMA side with dma_sync_single_for_device(). swiotlb only copies
+ *    into the bounce buffer on that sync for DMA_TO_DEVICE or
+ *    DMA_BIDIRECTIONAL mappings; with DMA_FROM_DEVICE it copies nothing
+ *    and the driver's dma_sync_single_for_cpu() would overwrite the frame
+ *    with the stale bounce buffer. RX pages are therefore mapped, synced
+ *    and unmapped DMA_BIDIRECTIONAL (NEEL_RX_DMA_DIR), which a real NIC
+ *    would map DMA_FROM_DEVICE.
+ *    It has no checksum engine either: checksums are finished with
+ *    skb_checksum_help() before mapping.
+ *
+ **************************************************************************
+ *    Flow table fast path between neel_netif instances                   *
+ **************************************************************************
+ * 1. "insmod network_device_driver.ko nr_ifs=2" creates neel_netif0 and
+ *    neel_netif1 (up to NEEL_MAX_IFS). Only the first one gets the tap
+ *    and injection devices.
+ *
+ * 2. The receive path of every neel_netif looks frames up in an exact
+ *    match flow table (an rhashtable) keyed on the ingress interface and
+ *    the 5-tuple, which the RSS stage has already dissected. A hit sends
+ *    the frame straight to another neel_netif, the way a flow offload
+ *    in a NIC's embedded switch does:
+ *
+ *     rx   into the target's receive path, destination MAC rewritten
+ *          to the target's address
+ *     tx   out of one of the target's TX queues, source MAC rewritten
+ *
+ *    Forwarded frames never reach the IP stack of the ingress interface:
+ *    no GRO, routing, netfilter or socket lookup. Per flow packet and
+ *    byte counters show what took the fast path.
+ *
+ * 3. Flows are managed over generic netlink (family "neel_flow", see
+ *    neel_flow.h) with the companion tool:
+ *
+ *     ./neel_flow add neel_netif0 udp 10.0.0.1 5000 10.0.0.2 6000 neel_netif1 rx
+ *     ./neel_flow del neel_netif0 udp 10.0.0.1 5000 10.0.0.2 6000
+ *     ./neel_flow show
+ *     ./neel_flow flush
+ *
+ * 4. Chains of flows are followed up to NEEL_FLOW_MAX_DEPTH hops, and a
+ *    "tx" flow back into a TX queue this CPU is already transmitting on
+ *    is dropped, so a forwarding loop cannot recurse or deadlock.
+ *
+ **************************************************************************
+ *    Link emulation: delay, jitter, loss and rate per TX queue           *
+ **************************************************************************
+ * 1. Between the TX queue and the receive path sits an emulated link,
+ *    one per TX queue, configured through sysfs:
+ *
+ *     cd /sys/class/net/neel_netif0/link/txq0
+ *     echo 20000 > delay_us       <== 20ms one way
+ *     echo 2000 > jitter_us       <== +-2ms, uniformly distributed
+ *     echo 1000 > loss_ppm        <== 0.1% random loss
+ *     echo 100000 > rate_kbit     <== 100 Mbit/s token bucket ...
+ *     echo 30000 > burst_bytes    <== ... with a 30000 byte bucket
+ *     echo 10000 > limit          <== frames the link can hold
+ *
+ *    All zero (the default) means no link: frames go straight through.
+ *
+ * 2. The shaper is a token bucket counted in nanoseconds of line time.
+ *    A frame which finds the bucket empty leaves when its last bit would
+ *    have been serialised; the delay and jitter are added to that. The
+ *    resulting arrival time is exact to the hrtimer: frames sit on a
+ *    FIFO and one hrtimer per queue (softirq mode) fires at the arrival
+ *    time of the head. Frames are never reordered, so a frame whose
+ *    jitter would let it overtake the previous one arrives right after
+ *    it instead.
+ *
+ * 3. Frames are charged to the link only after they left the TX queue
+ *    (the socket is already released), as on a real WAN. Drops because
+ *    of loss or a full link are counted per queue in "ethtool -S".
+ *
+ * 4. The link sits on the skb loopback path. With dma_ring=1 frames go
+ *    straight from the TX ring to the RX ring and the link is bypassed.
+ *
+ **************************************************************************
+ *    mqprio traffic classes with strict priority (ndo_setup_tc)          *
+ **************************************************************************
+ * 1. The mqprio qdisc can hand its traffic class layout to the driver:
+ *
+ *     tc qdisc add dev neel_netif0 root mqprio num_tc 2 \
+ *         map 0 0 0 0 0 0 1 1 0 0 0 0 0 0 0 0 queues 3@0 1@3 hw 1
+ *
+ *    Priorities 6 and 7 (e.g. SO_PRIORITY 6 on control sockets) map to
+ *    TC 1 on queue 3, everything else to TC 0 on queues 0-2. The driver
+ *    accepts any layout of non-overlapping queue ranges in DCB mode,
+ *    without rate limits.
+ *
+ * 2. With traffic classes set up, ndo_start_xmit no longer puts frames
+ *    on the wire itself. Each TX queue feeds a small hardware FIFO
+ *    (NEEL_TC_FIFO_LEN frames, the queue is stopped when it is full, so
+ *    bulk traffic backs up in its own qdisc) and a TX NAPI context plays
+ *    the port's TX arbiter: it serves the FIFOs in strict priority,
+ *    highest numbered TC first as in 802.1Q, round robin between the
+ *    queues of one TC, at most NEEL_TC_QUANTUM frames at a time. A
+ *    control frame therefore waits for one quantum of bulk traffic at
+ *    most, never for the bulk backlog.
+ *
+ * 3. "tc qdisc del dev neel_netif0 root" goes back to direct transmit.
+ *    Frames paced by EDT leave at their departure time, outside the
+ *    arbiter.
+ *
+ **************************************************************************
+ *    sFlow style packet sampling over netlink multicast                  *
+ **************************************************************************
+ * 1. Next to the capture tap, which copies every frame (or 1 in N per
+ *    CPU) to one reader, the driver can sample frames for telemetry:
+ *    1 in "rate" frames of the TX and RX paths of every neel_netif, with
+ *    a random skip between samples so periodic traffic cannot alias
+ *    with the sampling, as sFlow agents do.
+ *
+ * 2. Each CPU collects its samples (ifindex, direction, queue, frame
+ *    length and the first hdr_len bytes) in a generic netlink message of
+ *    its own, without sharing a cache line with the other CPUs. The
+ *    message is multicast to the "samples" group of the "neel_sample"
+ *    family once it holds NEEL_SAMPLE_BATCH samples or is full, and
+ *    every NEEL_SAMPLE_FLUSH_MS at the latest. It also carries the
+ *    CPU's frame pool and sample counters, which is what a collector
+ *    needs to scale the samples back to totals (see neel_sample.h).
+ *
+ * 3. Nothing is built while nobody listens to the group.
+ *
+ *     ./neel_sample 1000 128      <== 1 in 1000 frames, 128 byte headers
+ *
+ * This file follows the v6.8 kernel networking API.
+ **************************************************************************
+ */
 #include <linux/module.h>
 #include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/ethtool.h>
+#include <linux/if_vlan.h>
+#include <linux/rtnetlink.h>
+#include <linux/skbuff.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/hrtimer.h>
+#include <linux/irq_work.h>
+#include <linux/dim.h>
+#include <linux/bitmap.h>
+#include <linux/mm.h>
 #include <linux/init.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/rhashtable.h>
+#include <linux/in6.h>
+#include <linux/net_tstamp.h>
+#include <linux/uaccess.h>
+#include <net/flow_dissector.h>
+#include <net/genetlink.h>
+#include <net/pkt_sched.h>
+#include <net/sock.h>
+#include <net/ipv6.h>
+#include <asm/unaligned.h>
+
+#include "neel_tap.h"
+#include "neel_flow.h"
+#include "neel_sample.h"
+
+#define NEEL_MAX_IFS            8
+#define NEEL_NUM_QUEUES         4
+#define NEEL_RX_RING_SIZE       1024
+#define NEEL_RSS_KEY_SIZE       40
+#define NEEL_RSS_INDIR_SIZE     128
+
+#define NEEL_EDT_SLOT_SHIFT     10
+#define NEEL_EDT_SLOTS          4096
+#define NEEL_EDT_LIMIT          8192
+#define NEEL_EDT_HORIZON_NS     (10ULL * NSEC_PER_SEC)
+
+#define NEEL_INJECT_BATCH       64
+
+#define NEEL_RX_HDR_LEN         256
+#define NEEL_RX_BUF_SIZE        4096
+
+#define NEEL_FLOW_MAX           65536
+#define NEEL_FLOW_MAX_DEPTH     4
+
+#define NEEL_SAMPLE_BATCH       32
+#define NEEL_SAMPLE_FLUSH_MS    100
+#define NEEL_SAMPLE_HDR_MAX     256
+
+#define NEEL_TC_FIFO_LEN        64
+#define NEEL_TC_QUANTUM         16
+
+#define NEEL_LINK_LIMIT         1000
+#define NEEL_LINK_BURST         (10 * 1514)
+
+#define NEEL_DMA_RING_SIZE      256
+#define NEEL_DMA_RING_MASK      (NEEL_DMA_RING_SIZE - 1)
+/* RX buffers are also written by the CPU, see neel_dev_rx_write() */
+#define NEEL_RX_DMA_DIR         DMA_BIDIRECTIONAL
+
+/* neel_dma_desc::flags */
+#define NEEL_DESC_DONE          BIT(0)
+#define NEEL_DESC_EOP           BIT(1)
+#define NEEL_DESC_L4_HASH       BIT(2)
+#define NEEL_DESC_HASH          BIT(3)
+#define NEEL_DESC_TSTAMP        BIT(4)
+
+/*
+ * Descriptor as the emulated device sees it, shared by TX and RX rings.
+ * The device writes back len (RX), the RSS hash and the RX timestamp.
+ */
+struct neel_dma_desc {
+    __le64 addr;
+    __le32 len;
+    __le32 flags;
+    __le32 hash;
+    __le32 reserved;
+    __le64 tstamp;
+};
+
+/* Driver side shadow of a descriptor */
+struct neel_dma_buf {
+    struct sk_buff *skb;        /* TX: on the last descriptor of a frame */
+    struct page *page;          /* RX: posted page */
+    dma_addr_t dma;
+    u32 len;
+    bool is_page;               /* TX: mapped with skb_frag_dma_map */
+};
+
+/*
+ * Ring indices are free running and masked on use. The driver owns
+ * next_to_use and next_to_clean, the emulated device dev_head.
+ */
+struct neel_dma_ring {
+    struct neel_dma_desc *desc;
+    dma_addr_t desc_dma;
+    struct neel_dma_buf *bufs;
+    u32 next_to_use;
+    u32 next_to_clean;
+    u32 dev_head;
+    spinlock_t dev_lock;        /* RX: the device is fed by all TX queues */
+    struct sk_buff *skb;        /* RX: frame being assembled */
+};
+
+/*
+ * Per RX queue state: the frames waiting to be received, the NAPI
+ * context which drains them and the queue's statistics.
+ */
+struct neel_rx_queue {
+    struct napi_struct napi;
+    struct sk_buff_head skbs;
+    struct net_device *dev;
+    unsigned int index;
+
+    /* emulated interrupt line and its moderation */
+    struct hrtimer irq_timer;
+    struct irq_work irq_work;   /* delivers the interrupt to irq_cpu */
+    unsigned int irq_cpu;
+    unsigned long irq_flags;
+    atomic_t pending;
+    u32 coal_usecs;
+    u32 coal_frames;
+    u64 irqs;
+    struct dim dim;
+
+    struct neel_dma_ring ring;
+
+    struct u64_stats_sync syncp;
+    u64_stats_t packets;
+    u64_stats_t bytes;
+};
+
+/* neel_rx_queue::irq_flags */
+#define NEEL_RXQ_IRQ_MASKED     0
+#define NEEL_RXQ_TIMER_ARMED    1
+
+/* One slot of the EDT timer wheel: a singly linked list of frames */
+struct neel_edt_slot {
+    struct sk_buff *head;
+    struct sk_buff *tail;
+};
+
+/*
+ * EDT timer wheel of a TX queue. "cursor" is the absolute slot number
+ * (departure time >> NEEL_EDT_SLOT_SHIFT) of the earliest frame in the
+ * wheel. "count" frames are in the wheel, "overflow_count" in the
+ * overflow tree.
+ */
+struct neel_edt_wheel {
+    spinlock_t lock;
+    struct hrtimer timer;
+    struct neel_edt_slot *slots;
+    unsigned long *occupied;
+    struct rb_root_cached overflow;
+    u64 cursor;
+    u64 armed_ns;
+    unsigned int count;
+    unsigned int overflow_count;
+
+    /* ethtool -S, updated under lock */
+    u64 held;
+    u64 horizon_drops;
+    u64 late_ns_total;
+    u64 late_ns_max;
+};
+
+/*
+ * Emulated link behind a TX queue. The parameters are written from
+ * sysfs and read locklessly by the datapath, the shaper state and the
+ * held frames are under lock.
+ */
+struct neel_link {
+    struct kobject kobj;
+    spinlock_t lock;
+    struct hrtimer timer;
+    struct sk_buff_head frames;     /* skb->tstamp is the arrival time */
+
+    bool active;
+    u32 delay_us;
+    u32 jitter_us;
+    u32 loss_ppm;
+    u32 limit;
+    u32 burst_bytes;
+    u64 rate_kbit;
+
+    s64 tokens_ns;
+    u64 t_last;
+    u64 last_arrival;
+
+    /* ethtool -S, updated under lock */
+    u64 held;
+    u64 loss_drops;
+    u64 limit_drops;
+};
+
+struct neel_tx_queue {
+    struct net_device *dev;
+    unsigned int index;
+    struct neel_edt_wheel edt;
+    struct neel_link link;
+    struct neel_dma_ring ring;
+    struct sk_buff_head tc_fifo;    /* under the TX queue lock */
+
+    struct u64_stats_sync syncp;
+    u64_stats_t packets;
+    u64_stats_t bytes;
+};
+
+/*
+ * Companion char device exposing the capture ring. "ring" is published
+ * with RCU while a reader has the device open, "area" is the vmalloc'd
+ * memory behind it and lives as long as the open file.
+ *
+ * The header page is mapped writable by the reader, so the driver keeps
+ * its own copy of everything it needs (geometry, head, counters) and
+ * only publishes them there. "tail" is the one field it reads back.
+ */
+struct neel_tap {
+    struct miscdevice misc;
+    unsigned long busy;
+    spinlock_t lock;
+    wait_queue_head_t wq;
+    struct neel_tap_ring __rcu *ring;
+    struct neel_tap_ring *area;
+    size_t area_size;
+    u64 head;
+    u64 captured;
+    u64 drops;
+    u32 nr_slots;
+    u32 slot_size;
+    u32 snaplen;
+    u32 sample;
+};
+
+/* Private area allocated along with the net_device by alloc_netdev_mqs */
+struct neel_priv {
+    struct net_device *dev;
+    struct device *dmadev;
+    struct neel_rx_queue rxq[NEEL_NUM_QUEUES];
+    struct neel_tx_queue txq[NEEL_NUM_QUEUES];
+
+    u8 rss_key[NEEL_RSS_KEY_SIZE];
+    u32 rss_indir[NEEL_RSS_INDIR_SIZE];
+
+    /* SIOCSHWTSTAMP state, written under RTNL, read by the datapath */
+    struct hwtstamp_config tstamp_config;
+    bool tx_tstamp;
+    bool rx_tstamp;
+
+    bool adaptive_rx;
+
+    /* TX arbiter serving the TX queues when mqprio is offloaded */
+    struct napi_struct tc_napi;
+    u8 tc_cursor[TC_MAX_QUEUE];
+
+    struct kobject *link_kobj;      /* /sys/class/net/<dev>/link */
+
+    struct neel_tap tap;
+    struct miscdevice inject;
+};
+
+/*
+ * Exact match key of the flow table. IPv4 addresses are stored IPv4
+ * mapped. Ports are only set for TCP and UDP, as for RSS.
+ */
+struct neel_flow_key {
+    struct in6_addr src;
+    struct in6_addr dst;
+    int iif;
+    __be16 sport;
+    __be16 dport;
+    u8 proto;
+    u8 pad[3];
+};
+
+struct neel_flow {
+    struct rhash_head node;
+    struct neel_flow_key key;
+    struct net_device *to;
+    u8 action;
+    atomic64_t packets;
+    atomic64_t bytes;
+    struct rcu_head rcu;
+};
+
+/* Where neel_rx_steer() wants a frame forwarded, "to" NULL if nowhere */
+struct neel_flow_hit {
+    struct net_device *to;
+    u8 action;
+};
+
+static const struct rhashtable_params neel_flow_params = {
+    .head_offset        = offsetof(struct neel_flow, node),
+    .key_offset         = offsetof(struct neel_flow, key),
+    .key_len            = sizeof(struct neel_flow_key),
+    .automatic_shrinking = true,
+};
+
+/*
+ * Flows of all interfaces. "to" needs no reference: a neel_netif can
+ * only go away with the module, and the table is flushed before that.
+ */
+static struct rhashtable neel_flows;
+static DEFINE_PER_CPU(unsigned int, neel_flow_depth);
+
+/*
+ * Per CPU sampler state. The datapath only touches its own CPU's copy;
+ * "lock" is there for the flush work, which collects the messages of
+ * all CPUs.
+ */
+struct neel_sampler {
+    spinlock_t lock;
+    struct sk_buff *msg;        /* samples not sent yet */
+    void *hdr;
+    u32 nr;
+    u32 skip;                   /* frames to let through before the next sample */
+    u64 pool;
+    u64 taken;
+    u64 drops;
+};
+
+static DEFINE_PER_CPU(struct neel_sampler, neel_sampler);
+static u32 neel_sample_rate;
+static bool neel_sample_stopped;   /* module going away, under genl_lock */
+static u32 neel_sample_hdr_len = 128;
+
+static struct net_device *devs[NEEL_MAX_IFS];
+
+static unsigned int nr_ifs = 1;
+module_param(nr_ifs, uint, 0444);
+MODULE_PARM_DESC(nr_ifs, "Number of neel_netif interfaces to create");
+
+static unsigned int tap_slots = 4096;
+module_param(tap_slots, uint, 0444);
+MODULE_PARM_DESC(tap_slots, "Number of slots in the /dev/neel_tap ring");
+
+static unsigned int tap_slot_size = 2048;
+module_param(tap_slot_size, uint, 0444);
+MODULE_PARM_DESC(tap_slot_size, "Bytes per /dev/neel_tap slot, descriptor included");
+
+static DEFINE_PER_CPU(u32, neel_tap_seen);
+
+static struct platform_device *neel_pdev;
+
+static bool dma_ring;
+module_param(dma_ring, bool, 0444);
+MODULE_PARM_DESC(dma_ring, "Move frames through DMA mapped descriptor rings");
+
+static bool threaded;
+module_param(threaded, bool, 0444);
+MODULE_PARM_DESC(threaded, "Run the NAPI polls in kthreads (threaded NAPI)");
+
+/*
+ * Copy the head of a frame into the capture ring, if a reader is
+ * attached. Called from the datapath with BH disabled.
+ */
+static void neel_tap_capture(struct neel_priv *priv, struct sk_buff *skb,
+                             unsigned int queue, u8 dir)
+{
+    struct neel_tap *tap = &priv->tap;
+    struct neel_tap_ring *ring;
+    struct neel_tap_desc *desc;
+    u32 sample, caplen;
+
+    rcu_read_lock();
+    ring = rcu_dereference(tap->ring);
+    if (!ring)
+        goto out;
+
+    sample = READ_ONCE(tap->sample);
+    if (sample > 1 && this_cpu_inc_return(neel_tap_seen) % sample)
+        goto out;
+
+    caplen = min(skb->len, READ_ONCE(tap->snaplen));
+
+    spin_lock(&tap->lock);
+    /*
+     * A tail ahead of head, or more than the ring behind it, wraps or
+     * exceeds nr_slots here: whatever the reader writes, it reads as a
+     * full ring.
+     */
+    if (tap->head - smp_load_acquire(&ring->tail) >= tap->nr_slots) {
+        WRITE_ONCE(ring->drops, ++tap->drops);
+        spin_unlock(&tap->lock);
+        goto out;
+    }
+
+    desc = (void *)ring + PAGE_SIZE +
+           (size_t)(tap->head % tap->nr_slots) * tap->slot_size;
+    desc->tstamp_ns = ktime_get_real_ns();
+    desc->len = skb->len;
+    desc->caplen = caplen;
+    desc->queue = queue;
+    desc->dir = dir;
+    skb_copy_bits(skb, 0, desc + 1, caplen);
+
+    WRITE_ONCE(ring->captured, ++tap->captured);
+    smp_store_release(&ring->head, ++tap->head);
+    spin_unlock(&tap->lock);
+
+    if (wq_has_sleeper(&tap->wq))
+        wake_up_interruptible(&tap->wq);
+out:
+    rcu_read_unlock();
+}
+
+static struct genl_family neel_sample_family;
+
+/* Close a sampler's message and multicast it to the collectors */
+static void neel_sample_send(struct neel_sampler *s, struct sk_buff *msg,
+                             void *hdr, unsigned int cpu, gfp_t gfp)
+{
+    if (nla_put_u32(msg, NEEL_SAMPLE_A_CPU, cpu) ||
+        nla_put_u32(msg, NEEL_SAMPLE_A_RATE, READ_ONCE(neel_sample_rate)) ||
+        nla_put_u64_64bit(msg, NEEL_SAMPLE_A_POOL, READ_ONCE(s->pool),
+                          NEEL_SAMPLE_A_PAD) ||
+        nla_put_u64_64bit(msg, NEEL_SAMPLE_A_TAKEN, READ_ONCE(s->taken),
+                          NEEL_SAMPLE_A_PAD) ||
+        nla_put_u64_64bit(msg, NEEL_SAMPLE_A_DROPS, READ_ONCE(s->drops),
+                          NEEL_SAMPLE_A_PAD)) {
+        /* room for these is kept free, see neel_sample_add */
+        nlmsg_free(msg);
+        return;
+    }
+
+    genlmsg_end(msg, hdr);
+    genlmsg_multicast(&neel_sample_family, msg, 0, 0, gfp);
+}
+
+/* Append one sample to the sampler's message. Caller holds s->lock. */
+static int neel_sample_add(struct neel_sampler *s, struct net_device *dev,
+                           struct sk_buff *skb, unsigned int queue, u8 dir)
+{
+    u32 caplen = min_t(u32, skb->len, READ_ONCE(neel_sample_hdr_len));
+    struct nlattr *nest, *data;
+
+    if (!s->msg) {
+        s->msg = genlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+        if (!s->msg)
+            return -ENOMEM;
+        s->hdr = genlmsg_put(s->msg, 0, 0, &neel_sample_family, 0,
+                             NEEL_SAMPLE_CMD_SAMPLES);
+        if (!s->hdr) {
+            nlmsg_free(s->msg);
+            s->msg = NULL;
+            return -EMSGSIZE;
+        }
+        s->nr = 0;
+    }
+
+    /* keep room for the counters neel_sample_send adds */
+    if (skb_tailroom(s->msg) < nla_total_size(caplen) + 64 + 4 * 16)
+        return -EMSGSIZE;
+
+    nest = nla_nest_start(s->msg, NEEL_SAMPLE_A_SAMPLE);
+    if (!nest ||
+        nla_put_u32(s->msg, NEEL_SAMPLE_S_IFINDEX, dev->ifindex) ||
+        nla_put_u8(s->msg, NEEL_SAMPLE_S_DIR, dir) ||
+        nla_put_u16(s->msg, NEEL_SAMPLE_S_QUEUE, queue) ||
+        nla_put_u32(s->msg, NEEL_SAMPLE_S_LEN, skb->len))
+        goto cancel;
+
+    data = nla_reserve(s->msg, NEEL_SAMPLE_S_HEADER, caplen);
+    if (!data || skb_copy_bits(skb, 0, nla_data(data), caplen))
+        goto cancel;
+
+    nla_nest_end(s->msg, nest);
+    s->nr++;
+    return 0;
+
+cancel:
+    nla_nest_cancel(s->msg, nest);
+    return -EMSGSIZE;
+}
+
+/*
+ * Sample 1 in neel_sample_rate frames. skb->data is at the MAC header.
+ * Called from the datapath with BH disabled.
+ */
+static void neel_sample(struct net_device *dev, struct sk_buff *skb,
+                        unsigned int queue, u8 dir)
+{
+    u32 rate = READ_ONCE(neel_sample_rate);
+    struct sk_buff *msg = NULL;
+    struct neel_sampler *s;
+    void *hdr = NULL;
+    int err;
+
+    if (!rate)
+        return;
+
+    s = this_cpu_ptr(&neel_sampler);
+    s->pool++;
+    if (s->skip > 1) {
+        s->skip--;
+        return;
+    }
+    /* next sample in 1 to 2*rate-1 frames, rate on average */
+    s->skip = 1 + get_random_u32_below(2 * rate - 1);
+
+    if (!genl_has_listeners(&neel_sample_family, dev_net(dev), 0))
+        return;
+
+    s->taken++;
+    spin_lock(&s->lock);
+    err = neel_sample_add(s, dev, skb, queue, dir);
+    if (err == -EMSGSIZE && s->msg && s->nr) {
+        /* full: send what we have and start a new message */
+        neel_sample_send(s, s->msg, s->hdr, smp_processor_id(), GFP_ATOMIC);
+        s->msg = NULL;
+        err = neel_sample_add(s, dev, skb, queue, dir);
+    }
+    if (err)
+        s->drops++;
+    if (s->msg && s->nr >= NEEL_SAMPLE_BATCH) {
+        msg = s->msg;
+        hdr = s->hdr;
+        s->msg = NULL;
+    }
+    spin_unlock(&s->lock);
+
+    if (msg)
+        neel_sample_send(s, msg, hdr, smp_processor_id(), GFP_ATOMIC);
+}
+
+/* Send the partial messages of all CPUs every NEEL_SAMPLE_FLUSH_MS */
+static void neel_sample_flush(struct work_struct *work)
+{
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct neel_sampler *s = per_cpu_ptr(&neel_sampler, cpu);
+        struct sk_buff *msg;
+        void *hdr;
+
+        spin_lock_bh(&s->lock);
+        msg = s->msg;
+        hdr = s->hdr;
+        s->msg = NULL;
+        spin_unlock_bh(&s->lock);
+
+        if (msg)
+            neel_sample_send(s, msg, hdr, cpu, GFP_KERNEL);
+    }
+
+    if (READ_ONCE(neel_sample_rate))
+        schedule_delayed_work(to_delayed_work(work),
+                              msecs_to_jiffies(NEEL_SAMPLE_FLUSH_MS));
+}
+
+static DECLARE_DELAYED_WORK(neel_sample_work, neel_sample_flush);
+
+/*
+ * Toeplitz hash as computed by RSS capable NICs. For every set bit of
+ * the input, the 32 bit window of the key starting at that bit position
+ * is XORed into the result. The key must be at least 4 bytes longer
+ * than the input.
+ */
+static u32 neel_toeplitz_hash(const u8 *key, const u8 *data, unsigned int len)
+{
+    u32 window = get_unaligned_be32(key);
+    u32 hash = 0;
+    unsigned int i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            if (data[i] & BIT(bit))
+                hash ^= window;
+            window <<= 1;
+            if (key[i + 4] & BIT(bit))
+                window |= 1;
+        }
+    }
+    return hash;
+}
+
+static bool neel_flow_has_ports(const struct flow_keys *keys)
+{
+    return (keys->basic.ip_proto == IPPROTO_TCP ||
+            keys->basic.ip_proto == IPPROTO_UDP) &&
+           !(keys->control.flags & FLOW_DIS_IS_FRAGMENT);
+}
+
+/*
+ * Build the RSS input (source address, destination address, source
+ * port, destination port - all in network byte order) and hash it.
+ * Returns false when the frame is not IP, in which case it goes to
+ * RX queue 0 without a hash, as on real hardware.
+ */
+static bool neel_rss_hash(struct neel_priv *priv, const struct flow_keys *keys,
+                          u32 *hash, enum pkt_hash_types *type)
+{
+    u8 input[36];
+    unsigned int len;
+
+    switch (keys->control.addr_type) {
+    case FLOW_DISSECTOR_KEY_IPV4_ADDRS:
+        memcpy(input, &keys->addrs.v4addrs.src, 4);
+        memcpy(input + 4, &keys->addrs.v4addrs.dst, 4);
+        len = 8;
+        break;
+    case FLOW_DISSECTOR_KEY_IPV6_ADDRS:
+        memcpy(input, &keys->addrs.v6addrs.src, 16);
+        memcpy(input + 16, &keys->addrs.v6addrs.dst, 16);
+        len = 32;
+        break;
+    default:
+        return false;
+    }
+
+    *type = PKT_HASH_TYPE_L3;
+    if (neel_flow_has_ports(keys)) {
+        memcpy(input + len, &keys->ports.src, 2);
+        memcpy(input + len + 2, &keys->ports.dst, 2);
+        len += 4;
+        *type = PKT_HASH_TYPE_L4;
+    }
+
+    *hash = neel_toeplitz_hash(priv->rss_key, input, len);
+    return true;
+}
+
+/*
+ * Look the dissected frame up in the flow table and account the hit.
+ * Called with BH disabled.
+ */
+static void neel_flow_lookup(struct neel_priv *priv, struct sk_buff *skb,
+                             const struct flow_keys *keys,
+                             struct neel_flow_hit *hit)
+{
+    struct neel_flow_key key;
+    struct neel_flow *flow;
+
+    memset(&key, 0, sizeof(key));
+    switch (keys->control.addr_type) {
+    case FLOW_DISSECTOR_KEY_IPV4_ADDRS:
+        ipv6_addr_set_v4mapped(keys->addrs.v4addrs.src, &key.src);
+        ipv6_addr_set_v4mapped(keys->addrs.v4addrs.dst, &key.dst);
+        break;
+    case FLOW_DISSECTOR_KEY_IPV6_ADDRS:
+        key.src = keys->addrs.v6addrs.src;
+        key.dst = keys->addrs.v6addrs.dst;
+        break;
+    default:
+        return;
+    }
+    key.iif = priv->dev->ifindex;
+    key.proto = keys->basic.ip_proto;
+    if (neel_flow_has_ports(keys)) {
+        key.sport = keys->ports.src;
+        key.dport = keys->ports.dst;
+    }
+
+    rcu_read_lock();
+    flow = rhashtable_lookup(&neel_flows, &key, neel_flow_params);
+    if (flow) {
+        atomic64_inc(&flow->packets);
+        atomic64_add(skb->len + ETH_HLEN, &flow->bytes);
+        hit->to = flow->to;
+        hit->action = flow->action;
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * "Hardware" front end of the receive path: stamp the frame, pull the
+ * ethernet header, hash the frame and pick the RX queue through the
+ * indirection table. Returns the RX queue. If the frame matches a flow,
+ * "hit" says where to forward it instead.
+ */
+static unsigned int neel_rx_steer(struct neel_priv *priv, struct sk_buff *skb,
+                                  struct neel_flow_hit *hit)
+{
+    enum pkt_hash_types type;
+    struct flow_keys keys;
+    unsigned int qid = 0;
+    bool dissected;
+    u32 hash;
+
+    if (READ_ONCE(priv->rx_tstamp))
+        skb_hwtstamps(skb)->hwtstamp = ktime_get_real();
+
+    skb->protocol = eth_type_trans(skb, priv->dev);
+    skb_reset_network_header(skb);
+
+    dissected = skb_flow_dissect_flow_keys(skb, &keys, 0);
+    if (dissected && neel_rss_hash(priv, &keys, &hash, &type)) {
+        qid = READ_ONCE(priv->rss_indir[hash % NEEL_RSS_INDIR_SIZE]);
+        skb_set_hash(skb, hash, type);
+    } else {
+        skb_clear_hash(skb);
+    }
+
+    /* capture the frame as received, ethernet header included */
+    __skb_push(skb, ETH_HLEN);
+    neel_tap_capture(priv, skb, qid, NEEL_TAP_DIR_RX);
+    neel_sample(priv->dev, skb, qid, NEEL_SAMPLE_DIR_RX);
+    __skb_pull(skb, ETH_HLEN);
+
+    hit->to = NULL;
+    if (dissected && atomic_read(&neel_flows.nelems))
+        neel_flow_lookup(priv, skb, &keys, hit);
+
+    return qid;
+}
+
+/* The emulated interrupt, arriving on the queue's interrupt CPU */
+static void neel_rx_irq_work(struct irq_work *work)
+{
+    struct neel_rx_queue *rxq = container_of(work, struct neel_rx_queue,
+                                             irq_work);
+
+    napi_schedule(&rxq->napi);
+}
+
+/*
+ * Raise the emulated RX interrupt: mask it and schedule NAPI on the
+ * queue's interrupt CPU, which unmasks it once the queue has been
+ * drained. Masking keeps irq_work from being queued twice.
+ */
+static void neel_rx_irq(struct neel_rx_queue *rxq)
+{
+    unsigned int cpu = READ_ONCE(rxq->irq_cpu);
+
+    if (test_and_set_bit(NEEL_RXQ_IRQ_MASKED, &rxq->irq_flags))
+        return;
+
+    if (hrtimer_try_to_cancel(&rxq->irq_timer) == 1)
+        clear_bit(NEEL_RXQ_TIMER_ARMED, &rxq->irq_flags);
+    atomic_set(&rxq->pending, 0);
+
+    /* an offline interrupt CPU is left alone, as the kernel migrates IRQs */
+    if (cpu == raw_smp_processor_id() || !cpu_online(cpu))
+        napi_schedule(&rxq->napi);
+    else
+        irq_work_queue_on(&rxq->irq_work, cpu);
+}
+
+static enum hrtimer_restart neel_rx_irq_timer(struct hrtimer *timer)
+{
+    struct neel_rx_queue *rxq = container_of(timer, struct neel_rx_queue,
+                                             irq_timer);
+
+    clear_bit(NEEL_RXQ_TIMER_ARMED, &rxq->irq_flags);
+    neel_rx_irq(rxq);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * "n" frames were just queued: raise the interrupt once enough frames
+ * are pending, otherwise make sure the coalescing timer is running.
+ */
+static void neel_rx_kick(struct neel_rx_queue *rxq, unsigned int n)
+{
+    u32 usecs = READ_ONCE(rxq->coal_usecs);
+
+    /* pairs with the barrier after unmasking in neel_napi_poll */
+    smp_mb();
+    if (test_bit(NEEL_RXQ_IRQ_MASKED, &rxq->irq_flags))
+        return;
+
+    if (!usecs ||
+        atomic_add_return(n, &rxq->pending) >= READ_ONCE(rxq->coal_frames)) {
+        neel_rx_irq(rxq);
+        return;
+    }
+
+    if (!test_and_set_bit(NEEL_RXQ_TIMER_ARMED, &rxq->irq_flags))
+        hrtimer_start(&rxq->irq_timer, us_to_ktime(usecs), HRTIMER_MODE_REL);
+}
+
+/*
+ * Entry point of the emulated receive path for a single frame: steer it
+ * and hand it to its RX queue's NAPI context.
+ */
+static void neel_flow_forward(const struct neel_flow_hit *hit,
+                              struct sk_buff *skb);
+
+static void neel_rx(struct neel_priv *priv, struct sk_buff *skb)
+{
+    struct neel_flow_hit hit;
+    struct neel_rx_queue *rxq = &priv->rxq[neel_rx_steer(priv, skb, &hit)];
+
+    if (hit.to) {
+        neel_flow_forward(&hit, skb);
+        return;
+    }
+
+    if (skb_queue_len(&rxq->skbs) >= NEEL_RX_RING_SIZE) {
+        /* ring full: any CPU can get here, so use the per-cpu counter */
+        dev_core_stats_rx_dropped_inc(priv->dev);
+        dev_kfree_skb_any(skb);
+        return;
+    }
+
+    skb_queue_tail(&rxq->skbs, skb);
+    neel_rx_kick(rxq, 1);
+}
+
+/*
+ * Receive a batch of frames: sort them per RX queue, then take each RX
+ * queue lock and schedule each NAPI context once for the whole batch.
+ * Called with BH disabled.
+ */
+static void neel_rx_bulk(struct neel_priv *priv, struct sk_buff_head *frames)
+{
+    struct sk_buff_head lists[NEEL_NUM_QUEUES];
+    struct neel_flow_hit hit;
+    struct sk_buff *skb;
+    unsigned int qid;
+    int i;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++)
+        __skb_queue_head_init(&lists[i]);
+
+    while ((skb = __skb_dequeue(frames))) {
+        qid = neel_rx_steer(priv, skb, &hit);
+        if (hit.to)
+            neel_flow_forward(&hit, skb);
+        else
+            __skb_queue_tail(&lists[qid], skb);
+    }
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        struct neel_rx_queue *rxq = &priv->rxq[i];
+        unsigned int room, n;
+
+        if (skb_queue_empty(&lists[i]))
+            continue;
+
+        spin_lock(&rxq->skbs.lock);
+        room = NEEL_RX_RING_SIZE - min_t(u32, skb_queue_len(&rxq->skbs),
+                                         NEEL_RX_RING_SIZE);
+        while (skb_queue_len(&lists[i]) > room) {
+            dev_core_stats_rx_dropped_inc(priv->dev);
+            dev_kfree_skb_any(__skb_dequeue_tail(&lists[i]));
+        }
+        n = skb_queue_len(&lists[i]);
+        skb_queue_splice_tail_init(&lists[i], &rxq->skbs);
+        spin_unlock(&rxq->skbs.lock);
+
+        neel_rx_kick(rxq, n);
+    }
+}
+
+static u32 neel_tx_ring_room(struct neel_dma_ring *r)
+{
+    return NEEL_DMA_RING_SIZE - (r->next_to_use - READ_ONCE(r->next_to_clean));
+}
+
+/*
+ * A TX queue is stopped when its DMA ring, its EDT wheel or its tc FIFO
+ * fills up. Whoever frees room in one of them wakes the queue only if
+ * none of the three is still full: waking on its own condition alone
+ * would, for one, hand frames to a full ring, which can only drop them.
+ */
+static bool neel_tx_can_wake(struct neel_tx_queue *txq)
+{
+    return (!dma_ring || neel_tx_ring_room(&txq->ring) >= MAX_SKB_FRAGS + 1) &&
+           READ_ONCE(txq->edt.count) + READ_ONCE(txq->edt.overflow_count) <
+           NEEL_EDT_LIMIT &&
+           skb_queue_len_lockless(&txq->tc_fifo) < NEEL_TC_FIFO_LEN;
+}
+
+/*
+ * Map the head and every fragment of a frame onto TX descriptors and
+ * move the tail. Called with the TX queue lock held.
+ */
+static bool neel_tx_dma_map(struct neel_priv *priv, struct neel_dma_ring *r,
+                            struct sk_buff *skb)
+{
+    unsigned int nr_frags = skb_shinfo(skb)->nr_frags;
+    u32 first = r->next_to_use, ntu = first;
+    struct neel_dma_buf *buf;
+    dma_addr_t dma;
+    unsigned int i;
+
+    if (neel_tx_ring_room(r) < nr_frags + 1)
+        return false;
+
+    dma = dma_map_single(priv->dmadev, skb->data, skb_headlen(skb),
+                         DMA_TO_DEVICE);
+    if (dma_mapping_error(priv->dmadev, dma))
+        return false;
+
+    for (i = 0; ; i++) {
+        buf = &r->bufs[ntu & NEEL_DMA_RING_MASK];
+        buf->dma = dma;
+        buf->len = i ? skb_frag_size(&skb_shinfo(skb)->frags[i - 1])
+                     : skb_headlen(skb);
+        buf->is_page = i;
+        r->desc[ntu & NEEL_DMA_RING_MASK].addr = cpu_to_le64(dma);
+        r->desc[ntu & NEEL_DMA_RING_MASK].len = cpu_to_le32(buf->len);
+        r->desc[ntu & NEEL_DMA_RING_MASK].flags = 0;
+        ntu++;
+
+        if (i == nr_frags)
+            break;
+
+        dma = skb_frag_dma_map(priv->dmadev, &skb_shinfo(skb)->frags[i], 0,
+                               skb_frag_size(&skb_shinfo(skb)->frags[i]),
+                               DMA_TO_DEVICE);
+        if (dma_mapping_error(priv->dmadev, dma))
+            goto unwind;
+    }
+
+    buf->skb = skb;
+    r->desc[(ntu - 1) & NEEL_DMA_RING_MASK].flags = cpu_to_le32(NEEL_DESC_EOP);
+
+    /* descriptors before the doorbell */
+    dma_wmb();
+    WRITE_ONCE(r->next_to_use, ntu);
+    return true;
+
+unwind:
+    while (ntu != first) {
+        buf = &r->bufs[--ntu & NEEL_DMA_RING_MASK];
+        if (buf->is_page)
+            dma_unmap_page(priv->dmadev, buf->dma, buf->len, DMA_TO_DEVICE);
+        else
+            dma_unmap_single(priv->dmadev, buf->dma, buf->len, DMA_TO_DEVICE);
+    }
+    return false;
+}
+
+/*
+ * Emulated device, RX side: write a frame into the posted buffers of an
+ * RX ring and write back the descriptors. Any TX queue can feed any RX
+ * queue, hence dev_lock.
+ */
+static void neel_dev_rx_write(struct neel_priv *priv, struct neel_rx_queue *rxq,
+                              struct sk_buff *skb)
+{
+    struct neel_dma_ring *r = &rxq->ring;
+    u32 needed = DIV_ROUND_UP(skb->len, PAGE_SIZE);
+    u32 off = 0, head, flags = 0;
+
+    if (skb->hash)
+        flags |= NEEL_DESC_HASH | (skb->l4_hash ? NEEL_DESC_L4_HASH : 0);
+    if (READ_ONCE(priv->rx_tstamp))
+        flags |= NEEL_DESC_TSTAMP;
+
+    spin_lock(&r->dev_lock);
+    head = r->dev_head;
+    if (READ_ONCE(r->next_to_use) - head < needed) {
+        /* no buffers posted: the frame is missed */
+        spin_unlock(&r->dev_lock);
+        dev_core_stats_rx_dropped_inc(priv->dev);
+        return;
+    }
+
+    while (off < skb->len) {
+        struct neel_dma_desc *desc = &r->desc[head & NEEL_DMA_RING_MASK];
+        struct neel_dma_buf *buf = &r->bufs[head & NEEL_DMA_RING_MASK];
+        u32 chunk = min_t(u32, skb->len - off, PAGE_SIZE);
+
+        skb_copy_bits(skb, off, page_address(buf->page), chunk);
+        dma_sync_single_for_device(priv->dmadev, buf->dma, chunk,
+                                   NEEL_RX_DMA_DIR);
+        off += chunk;
+
+        desc->len = cpu_to_le32(chunk);
+        desc->hash = cpu_to_le32(skb->hash);
+        desc->tstamp = cpu_to_le64(ktime_to_ns(skb_hwtstamps(skb)->hwtstamp));
+        dma_wmb();
+        desc->flags = cpu_to_le32(flags | NEEL_DESC_DONE |
+                                  (off == skb->len ? NEEL_DESC_EOP : 0));
+        head++;
+    }
+    r->dev_head = head;
+    spin_unlock(&r->dev_lock);
+
+    neel_rx_kick(rxq, 1);
+}
+
+/*
+ * Transmit through the DMA rings: map the frame, let the device fetch
+ * it and loop it into the RX ring RSS picks, then raise the TX
+ * completion on the NAPI context paired with this TX queue. The skb
+ * stays charged to its socket until the TX clean routine frees it.
+ */
+static void neel_dma_xmit(struct neel_priv *priv, struct neel_tx_queue *txq,
+                          struct sk_buff *skb)
+{
+    struct neel_dma_ring *r = &txq->ring;
+    struct neel_flow_hit hit;
+    struct sk_buff *fwd;
+    unsigned int qid;
+    u32 i;
+
+    if ((skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) ||
+        !neel_tx_dma_map(priv, r, skb)) {
+        dev_core_stats_tx_dropped_inc(priv->dev);
+        dev_kfree_skb_any(skb);
+        return;
+    }
+
+    /* the device: RSS, copy to the RX ring, write back TX descriptors */
+    qid = neel_rx_steer(priv, skb, &hit);
+    if (hit.to) {
+        /* the mapped skb belongs to the TX ring, forward a clone */
+        fwd = skb_clone(skb, GFP_ATOMIC);
+        if (fwd)
+            neel_flow_forward(&hit, fwd);
+        else
+            dev_core_stats_rx_dropped_inc(priv->dev);
+        __skb_push(skb, ETH_HLEN);
+    } else {
+        __skb_push(skb, ETH_HLEN);
+        neel_dev_rx_write(priv, &priv->rxq[qid], skb);
+    }
+
+    for (i = r->dev_head; i != r->next_to_use; i++)
+        r->desc[i & NEEL_DMA_RING_MASK].flags |= cpu_to_le32(NEEL_DESC_DONE);
+    r->dev_head = i;
+    neel_rx_kick(&priv->rxq[txq->index], 0);
+
+    if (neel_tx_ring_room(r) < MAX_SKB_FRAGS + 1)
+        netif_tx_stop_queue(netdev_get_tx_queue(priv->dev, txq->index));
+}
+
+/* TX clean routine: unmap completed descriptors and free their skbs */
+static void neel_tx_dma_clean(struct neel_priv *priv, struct neel_tx_queue *txq,
+                              int budget)
+{
+    struct netdev_queue *nq = netdev_get_tx_queue(priv->dev, txq->index);
+    struct neel_dma_ring *r = &txq->ring;
+    u32 ntc = r->next_to_clean;
+
+    while (ntc != READ_ONCE(r->next_to_use)) {
+        struct neel_dma_desc *desc = &r->desc[ntc & NEEL_DMA_RING_MASK];
+        struct neel_dma_buf *buf = &r->bufs[ntc & NEEL_DMA_RING_MASK];
+
+        if (!(le32_to_cpu(READ_ONCE(desc->flags)) & NEEL_DESC_DONE))
+            break;
+        dma_rmb();
+
+        if (buf->is_page)
+            dma_unmap_page(priv->dmadev, buf->dma, buf->len, DMA_TO_DEVICE);
+        else
+            dma_unmap_single(priv->dmadev, buf->dma, buf->len, DMA_TO_DEVICE);
+        if (buf->skb) {
+            napi_consume_skb(buf->skb, budget);
+            buf->skb = NULL;
+        }
+        ntc++;
+    }
+    smp_store_release(&r->next_to_clean, ntc);
+
+    /* pairs with netif_tx_stop_queue in neel_dma_xmit */
+    smp_mb();
+    if (netif_tx_queue_stopped(nq) && neel_tx_can_wake(txq))
+        netif_tx_wake_queue(nq);
+
+    /* the arbiter may have been waiting for ring space */
+    if (!skb_queue_empty_lockless(&txq->tc_fifo))
+        napi_schedule(&priv->tc_napi);
+}
+
+/* Post pages to every free RX descriptor, recycling pages left mapped */
+static void neel_rx_dma_refill(struct neel_priv *priv, struct neel_dma_ring *r)
+{
+    while (r->next_to_use - r->next_to_clean < NEEL_DMA_RING_SIZE) {
+        u32 ntu = r->next_to_use & NEEL_DMA_RING_MASK;
+        struct neel_dma_buf *buf = &r->bufs[ntu];
+
+        if (!buf->page) {
+            struct page *page = dev_alloc_page();
+            dma_addr_t dma;
+
+            if (!page)
+                break;
+            dma = dma_map_page(priv->dmadev, page, 0, PAGE_SIZE,
+                               NEEL_RX_DMA_DIR);
+            if (dma_mapping_error(priv->dmadev, dma)) {
+                __free_page(page);
+                break;
+            }
+            buf->page = page;
+            buf->dma = dma;
+        }
+
+        r->desc[ntu].addr = cpu_to_le64(buf->dma);
+        r->desc[ntu].flags = 0;
+        dma_wmb();
+        WRITE_ONCE(r->next_to_use, r->next_to_use + 1);
+    }
+}
+
+/*
+ * RX clean routine: turn written back descriptors into skbs. Frames up
+ * to NEEL_RX_HDR_LEN are copied and their page is recycled, the pages of
+ * bigger frames become skb fragments.
+ */
+static int neel_rx_dma_poll(struct neel_priv *priv, struct neel_rx_queue *rxq,
+                            int budget, u64 *bytes)
+{
+    struct neel_dma_ring *r = &rxq->ring;
+    int done = 0;
+
+    while (done < budget) {
+        struct neel_dma_desc *desc = &r->desc[r->next_to_clean & NEEL_DMA_RING_MASK];
+        struct neel_dma_buf *buf = &r->bufs[r->next_to_clean & NEEL_DMA_RING_MASK];
+        struct sk_buff *skb = r->skb;
+        u32 flags, len;
+
+        flags = le32_to_cpu(READ_ONCE(desc->flags));
+        if (!(flags & NEEL_DESC_DONE))
+            break;
+        dma_rmb();
+
+        len = le32_to_cpu(desc->len);
+        dma_sync_single_for_cpu(priv->dmadev, buf->dma, len, NEEL_RX_DMA_DIR);
+
+        if (!skb) {
+            u32 hlen = min_t(u32, len, NEEL_RX_HDR_LEN);
+
+            skb = napi_alloc_skb(&rxq->napi, hlen);
+            if (!skb)
+                break;
+            skb_put_data(skb, page_address(buf->page), hlen);
+
+            if (flags & NEEL_DESC_HASH)
+                skb_set_hash(skb, le32_to_cpu(desc->hash),
+                             flags & NEEL_DESC_L4_HASH ? PKT_HASH_TYPE_L4
+                                                       : PKT_HASH_TYPE_L3);
+            if (flags & NEEL_DESC_TSTAMP)
+                skb_hwtstamps(skb)->hwtstamp = le64_to_cpu(desc->tstamp);
+
+            if (hlen == len) {
+                dma_sync_single_for_device(priv->dmadev, buf->dma, len,
+                                           NEEL_RX_DMA_DIR);
+            } else {
+                dma_unmap_page(priv->dmadev, buf->dma, PAGE_SIZE,
+                               NEEL_RX_DMA_DIR);
+                skb_add_rx_frag(skb, 0, buf->page, hlen, len - hlen, PAGE_SIZE);
+                buf->page = NULL;
+            }
+            r->skb = skb;
+        } else {
+            dma_unmap_page(priv->dmadev, buf->dma, PAGE_SIZE, NEEL_RX_DMA_DIR);
+            skb_add_rx_frag(skb, skb_shinfo(skb)->nr_frags, buf->page, 0, len,
+                            PAGE_SIZE);
+            buf->page = NULL;
+        }
+
+        desc->flags = 0;
+        r->next_to_clean++;
+
+        if (flags & NEEL_DESC_EOP) {
+            r->skb = NULL;
+            skb->protocol = eth_type_trans(skb, priv->dev);
+            *bytes += skb->len;
+            skb_record_rx_queue(skb, rxq->index);
+            napi_gro_receive(&rxq->napi, skb);
+            done++;
+        }
+    }
+
+    neel_rx_dma_refill(priv, r);
+    return done;
+}
+
+/* Is there anything for this queue's NAPI context to do? */
+static bool neel_rx_pending(struct neel_priv *priv, struct neel_rx_queue *rxq)
+{
+    struct neel_dma_ring *tx = &priv->txq[rxq->index].ring;
+    struct neel_dma_ring *rx = &rxq->ring;
+
+    if (!skb_queue_empty(&rxq->skbs))
+        return true;
+    if (!priv->dmadev || !dma_ring)
+        return false;
+
+    return le32_to_cpu(READ_ONCE(rx->desc[rx->next_to_clean & NEEL_DMA_RING_MASK].flags)) &
+           NEEL_DESC_DONE ||
+           (tx->next_to_clean != READ_ONCE(tx->next_to_use) &&
+            le32_to_cpu(READ_ONCE(tx->desc[tx->next_to_clean & NEEL_DMA_RING_MASK].flags)) &
+            NEEL_DESC_DONE);
+}
+
+static int neel_dma_ring_alloc(struct neel_priv *priv, struct neel_dma_ring *r)
+{
+    r->desc = dma_alloc_coherent(priv->dmadev,
+                                 NEEL_DMA_RING_SIZE * sizeof(*r->desc),
+                                 &r->desc_dma, GFP_KERNEL);
+    r->bufs = kcalloc(NEEL_DMA_RING_SIZE, sizeof(*r->bufs), GFP_KERNEL);
+    if (!r->desc || !r->bufs) {
+        kfree(r->bufs);
+        if (r->desc)
+            dma_free_coherent(priv->dmadev,
+                              NEEL_DMA_RING_SIZE * sizeof(*r->desc),
+                              r->desc, r->desc_dma);
+        r->desc = NULL;
+        r->bufs = NULL;
+        return -ENOMEM;
+    }
+    r->next_to_use = 0;
+    r->next_to_clean = 0;
+    r->dev_head = 0;
+    r->skb = NULL;
+    return 0;
+}
+
+/* Unmap and free whatever is still on a ring, then the ring itself */
+static void neel_dma_ring_free(struct neel_priv *priv, struct neel_dma_ring *r,
+                               bool rx)
+{
+    u32 i;
+
+    if (!r->desc)
+        return;
+
+    for (i = 0; i < NEEL_DMA_RING_SIZE; i++) {
+        struct neel_dma_buf *buf = &r->bufs[i];
+
+        if (rx && buf->page) {
+            dma_unmap_page(priv->dmadev, buf->dma, PAGE_SIZE, NEEL_RX_DMA_DIR);
+            __free_page(buf->page);
+        }
+    }
+    for (i = r->next_to_clean; !rx && i != r->next_to_use; i++) {
+        struct neel_dma_buf *buf = &r->bufs[i & NEEL_DMA_RING_MASK];
+
+        if (buf->is_page)
+            dma_unmap_page(priv->dmadev, buf->dma, buf->len, DMA_TO_DEVICE);
+        else
+            dma_unmap_single(priv->dmadev, buf->dma, buf->len, DMA_TO_DEVICE);
+        if (buf->skb)
+            dev_kfree_skb_any(buf->skb);
+    }
+    if (r->skb)
+        dev_kfree_skb_any(r->skb);
+
+    dma_free_coherent(priv->dmadev, NEEL_DMA_RING_SIZE * sizeof(*r->desc),
+                      r->desc, r->desc_dma);
+    kfree(r->bufs);
+    memset(r, 0, sizeof(*r));
+}
+
+static void neel_dma_rings_free(struct neel_priv *priv)
+{
+    int i;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        neel_dma_ring_free(priv, &priv->txq[i].ring, false);
+        neel_dma_ring_free(priv, &priv->rxq[i].ring, true);
+    }
+}
+
+static int neel_dma_rings_alloc(struct neel_priv *priv)
+{
+    int i;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        struct neel_dma_ring *rx = &priv->rxq[i].ring;
+
+        if (neel_dma_ring_alloc(priv, &priv->txq[i].ring) ||
+            neel_dma_ring_alloc(priv, rx))
+            goto err;
+        spin_lock_init(&rx->dev_lock);
+        neel_rx_dma_refill(priv, rx);
+    }
+    return 0;
+
+err:
+    neel_dma_rings_free(priv);
+    return -ENOMEM;
+}
+
+static int neel_napi_poll(struct napi_struct *napi, int budget)
+{
+    struct neel_rx_queue *rxq = container_of(napi, struct neel_rx_queue, napi);
+    struct neel_priv *priv = netdev_priv(rxq->dev);
+    struct sk_buff *skb;
+    u64 bytes = 0;
+    int done = 0;
+
+    if (dma_ring) {
+        neel_tx_dma_clean(priv, &priv->txq[rxq->index], budget);
+        done = neel_rx_dma_poll(priv, rxq, budget, &bytes);
+    }
+
+    /* frames injected from userspace come in as skbs */
+    while (done < budget && (skb = skb_dequeue(&rxq->skbs))) {
+        bytes += skb->len;
+        skb_record_rx_queue(skb, rxq->index);
+        napi_gro_receive(napi, skb);
+        done++;
+    }
+
+    u64_stats_update_begin(&rxq->syncp);
+    u64_stats_add(&rxq->packets, done);
+    u64_stats_add(&rxq->bytes, bytes);
+    u64_stats_update_end(&rxq->syncp);
+
+    if (done < budget && napi_complete_done(napi, done)) {
+        /* one interrupt served, tell DIM what it carried */
+        rxq->irqs++;
+        if (READ_ONCE(priv->adaptive_rx)) {
+            struct dim_sample sample;
+
+            dim_update_sample(rxq->irqs, u64_stats_read(&rxq->packets),
+                              u64_stats_read(&rxq->bytes), &sample);
+            net_dim(&rxq->dim, sample);
+        }
+
+        /* unmask, then catch frames queued while we were masked */
+        clear_bit(NEEL_RXQ_IRQ_MASKED, &rxq->irq_flags);
+        smp_mb__after_atomic();
+        if (neel_rx_pending(priv, rxq))
+            neel_rx_kick(rxq, max_t(u32, skb_queue_len(&rxq->skbs), 1));
+    }
+    return done;
+}
+
+/* DIM picked a new profile for this queue: apply it */
+static void neel_rx_dim_work(struct work_struct *work)
+{
+    struct dim *dim = container_of(work, struct dim, work);
+    struct neel_rx_queue *rxq = container_of(dim, struct neel_rx_queue, dim);
+    struct dim_cq_moder moder;
+
+    moder = net_dim_get_rx_moderation(dim->mode, dim->profile_ix);
+    WRITE_ONCE(rxq->coal_usecs, moder.usec);
+    WRITE_ONCE(rxq->coal_frames, max_t(u32, moder.pkts, 1));
+
+    dim->state = DIM_START_MEASURE;
+}
+
+/* Reset the shaper; the link is idle from now. Caller holds the lock. */
+static void neel_link_reset(struct neel_link *l)
+{
+    l->tokens_ns = div64_u64((u64)l->burst_bytes * 8 * NSEC_PER_MSEC,
+                             max_t(u64, l->rate_kbit, 1));
+    l->t_last = ktime_get_ns();
+    l->last_arrival = 0;
+}
+
+/* Drop whatever is on the link */
+static void neel_link_stop(struct neel_link *l)
+{
+    hrtimer_cancel(&l->timer);
+    spin_lock_bh(&l->lock);
+    __skb_queue_purge(&l->frames);
+    neel_link_reset(l);
+    spin_unlock_bh(&l->lock);
+}
+
+/* The frames at the head of the link have arrived: receive them */
+static enum hrtimer_restart neel_link_timer(struct hrtimer *timer)
+{
+    struct neel_link *l = container_of(timer, struct neel_link, timer);
+    struct neel_tx_queue *txq = container_of(l, struct neel_tx_queue, link);
+    struct neel_priv *priv = netdev_priv(txq->dev);
+    struct sk_buff_head arrived;
+    u64 now = ktime_get_ns();
+    struct sk_buff *skb;
+    bool more;
+
+    __skb_queue_head_init(&arrived);
+
+    spin_lock(&l->lock);
+    while ((skb = skb_peek(&l->frames)) && skb->tstamp <= now)
+        __skb_queue_tail(&arrived, __skb_dequeue(&l->frames));
+    more = skb;
+    if (more)
+        hrtimer_set_expires(timer, ns_to_ktime(skb->tstamp));
+    spin_unlock(&l->lock);
+
+    while ((skb = __skb_dequeue(&arrived))) {
+        skb_clear_tstamp(skb);
+        neel_rx(priv, skb);
+    }
+
+    return more ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+/*
+ * Put a frame on the emulated link: maybe lose it, shape it, compute
+ * when it arrives and hold it until then. Returns false when the link
+ * is not configured. Called with the TX queue lock held.
+ */
+static bool neel_link_xmit(struct neel_tx_queue *txq, struct sk_buff *skb)
+{
+    struct neel_link *l = &txq->link;
+    u32 loss_ppm, jitter_us;
+    u64 rate, now, arrive;
+    bool first;
+
+    if (!READ_ONCE(l->active))
+        return false;
+
+    spin_lock(&l->lock);
+
+    loss_ppm = READ_ONCE(l->loss_ppm);
+    if (loss_ppm && get_random_u32_below(1000000) < loss_ppm) {
+        l->loss_drops++;
+        goto drop;
+    }
+    if (skb_queue_len(&l->frames) >= READ_ONCE(l->limit)) {
+        l->limit_drops++;
+        goto drop;
+    }
+
+    now = ktime_get_ns();
+    arrive = now;
+
+    rate = READ_ONCE(l->rate_kbit);
+    if (rate) {
+        s64 burst_ns = div64_u64((u64)READ_ONCE(l->burst_bytes) * 8 * NSEC_PER_MSEC,
+                                 rate);
+
+        /* refill with the time elapsed, spend the frame's line time */
+        l->tokens_ns = min_t(s64, l->tokens_ns + (now - l->t_last), burst_ns);
+        l->t_last = now;
+        l->tokens_ns -= div64_u64((u64)(skb->len + ETH_FCS_LEN) * 8 * NSEC_PER_MSEC,
+                                  rate);
+        if (l->tokens_ns < 0)
+            arrive += -l->tokens_ns;
+    }
+
+    arrive += (u64)READ_ONCE(l->delay_us) * NSEC_PER_USEC;
+    jitter_us = READ_ONCE(l->jitter_us);
+    if (jitter_us) {
+        u64 jitter = (u64)jitter_us * NSEC_PER_USEC;
+
+        arrive += get_random_u32_below(2 * jitter + 1);
+        arrive = arrive > jitter ? arrive - jitter : 0;
+    }
+
+    /* no reordering */
+    arrive = max(arrive, l->last_arrival);
+    l->last_arrival = arrive;
+
+    skb->tstamp = arrive;
+    first = skb_queue_empty(&l->frames);
+    __skb_queue_tail(&l->frames, skb);
+    l->held++;
+    spin_unlock(&l->lock);
+
+    if (first)
+        hrtimer_start(&l->timer, ns_to_ktime(arrive), HRTIMER_MODE_ABS_SOFT);
+    return true;
+
+drop:
+    spin_unlock(&l->lock);
+    dev_kfree_skb_any(skb);
+    return true;
+}
+
+static int my_open(struct net_device *dev)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    int i;
+
+    pr_info("Hit: my_open(%s)\n", dev->name);
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        if (neel_edt_init(&priv->txq[i])) {
+            while (i--)
+                neel_edt_destroy(&priv->txq[i]);
+            return -ENOMEM;
+        }
+    }
+
+    if (dma_ring && neel_dma_rings_alloc(priv)) {
+        for (i = 0; i < NEEL_NUM_QUEUES; i++)
+            neel_edt_destroy(&priv->txq[i]);
+        return -ENOMEM;
+    }
+
+    napi_enable(&priv->tc_napi);
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        napi_enable(&priv->rxq[i].napi);
+        netif_queue_set_napi(dev, i, NETDEV_QUEUE_TYPE_RX, &priv->rxq[i].napi);
+        netif_queue_set_napi(dev, i, NETDEV_QUEUE_TYPE_TX, &priv->rxq[i].napi);
+    }
+
+    /* start up the transmission queues */
+
+    netif_tx_start_all_queues(dev);
+    return 0;
+}
+
+static int my_close(struct net_device *dev)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    int i;
+
+    pr_info("Hit: my_close(%s)\n", dev->name);
+
+    /* shutdown the transmission queues */
+
+    netif_tx_stop_all_queues(dev);
+
+    napi_disable(&priv->tc_napi);
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        neel_edt_destroy(&priv->txq[i]);
+        neel_link_stop(&priv->txq[i].link);
+        __skb_queue_purge(&priv->txq[i].tc_fifo);
+    }
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        struct neel_rx_queue *rxq = &priv->rxq[i];
+
+        netif_queue_set_napi(dev, i, NETDEV_QUEUE_TYPE_RX, NULL);
+        netif_queue_set_napi(dev, i, NETDEV_QUEUE_TYPE_TX, NULL);
+        hrtimer_cancel(&rxq->irq_timer);
+        napi_disable(&rxq->napi);
+        irq_work_sync(&rxq->irq_work);
+        cancel_work_sync(&rxq->dim.work);
+        skb_queue_purge(&rxq->skbs);
+        rxq->irq_flags = 0;
+        atomic_set(&rxq->pending, 0);
+    }
+
+    if (dma_ring)
+        neel_dma_rings_free(priv);
+    return 0;
+}
+
+/*
+ * Put a frame on the "wire": account it on its TX queue and loop it back
+ * into the receive path. Called with the TX queue lock held.
+ */
+static void neel_wire_xmit(struct neel_priv *priv, struct sk_buff *skb)
+{
+    struct neel_tx_queue *txq = &priv->txq[skb_get_queue_mapping(skb)];
+
+    u64_stats_update_begin(&txq->syncp);
+    u64_stats_inc(&txq->packets);
+    u64_stats_add(&txq->bytes, skb->len);
+    u64_stats_update_end(&txq->syncp);
+
+    /* The stamps are queued on the sending socket, so before skb_orphan */
+    if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) &&
+        READ_ONCE(priv->tx_tstamp)) {
+        struct skb_shared_hwtstamps hwts = {
+            .hwtstamp = ktime_get_real(),
+        };
+
+        skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+        skb_tstamp_tx(skb, &hwts);
+    }
+    skb_tx_timestamp(skb);
+
+    neel_tap_capture(priv, skb, txq->index, NEEL_TAP_DIR_TX);
+    neel_sample(priv->dev, skb, txq->index, NEEL_SAMPLE_DIR_TX);
+
+    if (dma_ring) {
+        neel_dma_xmit(priv, txq, skb);
+        return;
+    }
+
+    skb_orphan(skb);
+    skb_dst_drop(skb);
+    nf_reset_ct(skb);
+    skb_clear_tstamp(skb);
+
+    if (neel_link_xmit(txq, skb))
+        return;
+    neel_rx(priv, skb);
+}
+
+/*
+ * Fast path: hand a frame which hit a flow straight to the target
+ * neel_netif. skb->data is past the ethernet header, as neel_rx_steer()
+ * left it. Called with BH disabled.
+ */
+static void neel_flow_forward(const struct neel_flow_hit *hit,
+                              struct sk_buff *skb)
+{
+    struct neel_priv *tpriv = netdev_priv(hit->to);
+    unsigned int cpu = smp_processor_id();
+    struct netdev_queue *nq;
+    struct ethhdr *eth;
+
+    __skb_push(skb, ETH_HLEN);
+    if (!netif_running(hit->to) ||
+        __this_cpu_read(neel_flow_depth) >= NEEL_FLOW_MAX_DEPTH ||
+        skb_ensure_writable(skb, ETH_HLEN))
+        goto drop;
+
+    eth = (struct ethhdr *)skb->data;
+    skb->dev = hit->to;
+    __this_cpu_inc(neel_flow_depth);
+
+    if (hit->action == NEEL_FLOW_ACT_RX) {
+        ether_addr_copy(eth->h_dest, hit->to->dev_addr);
+        neel_rx(tpriv, skb);
+        __this_cpu_dec(neel_flow_depth);
+        return;
+    }
+
+    ether_addr_copy(eth->h_source, hit->to->dev_addr);
+    skb_set_queue_mapping(skb, reciprocal_scale(skb_get_hash(skb),
+                                                NEEL_NUM_QUEUES));
+    nq = netdev_get_tx_queue(hit->to, skb_get_queue_mapping(skb));
+
+    /* a flow loop back into the queue we are transmitting on */
+    if (READ_ONCE(nq->xmit_lock_owner) == cpu) {
+        __this_cpu_dec(neel_flow_depth);
+        goto drop;
+    }
+
+    __netif_tx_lock(nq, cpu);
+    if (netif_xmit_frozen_or_stopped(nq)) {
+        __netif_tx_unlock(nq);
+        __this_cpu_dec(neel_flow_depth);
+        goto drop;
+    }
+    neel_wire_xmit(tpriv, skb);
+    __netif_tx_unlock(nq);
+    __this_cpu_dec(neel_flow_depth);
+    return;
+
+drop:
+    dev_core_stats_tx_dropped_inc(hit->to);
+    dev_kfree_skb_any(skb);
+}
+
+/* Move the cursor to the next occupied slot. Caller holds the lock. */
+static void neel_edt_advance(struct neel_edt_wheel *w)
+{
+    unsigned int idx = w->cursor & (NEEL_EDT_SLOTS - 1);
+    unsigned int bit;
+
+    bit = find_next_bit(w->occupied, NEEL_EDT_SLOTS, idx);
+    if (bit >= NEEL_EDT_SLOTS)
+        bit = find_first_bit(w->occupied, NEEL_EDT_SLOTS);
+    w->cursor += (bit - idx) & (NEEL_EDT_SLOTS - 1);
+}
+
+/*
+ * Departure time of a frame in CLOCK_MONOTONIC, 0 when it has none the
+ * wheel can use. A SO_TXTIME stamp is in the clock of its socket.
+ */
+static u64 neel_edt_departure(const struct sk_buff *skb)
+{
+    const struct sock *sk = skb->sk;
+
+    if (!skb->tstamp)
+        return 0;
+    if (skb->mono_delivery_time)
+        return ktime_to_ns(skb->tstamp);
+    if (sk && sk_fullsock(sk) && sock_flag(sk, SOCK_TXTIME) &&
+        sk->sk_clockid == CLOCK_MONOTONIC)
+        return ktime_to_ns(skb->tstamp);
+    return 0;
+}
+
+/*
+ * First slot the wheel cannot take yet: every frame in it must map to
+ * a distinct turn of the wheel. Caller holds the lock.
+ */
+static u64 neel_edt_wheel_end(struct neel_edt_wheel *w, u64 now)
+{
+    u64 base = now >> NEEL_EDT_SLOT_SHIFT;
+
+    if (w->count)
+        base = min(base, w->cursor);
+    return base + NEEL_EDT_SLOTS;
+}
+
+static void neel_edt_slot_add(struct neel_edt_wheel *w, struct sk_buff *skb,
+                              u64 slot)
+{
+    struct neel_edt_slot *s = &w->slots[slot & (NEEL_EDT_SLOTS - 1)];
+
+    skb->next = NULL;
+    if (s->tail)
+        s->tail->next = skb;
+    else
+        s->head = skb;
+    s->tail = skb;
+    __set_bit(slot & (NEEL_EDT_SLOTS - 1), w->occupied);
+
+    if (!w->count++ || slot < w->cursor)
+        w->cursor = slot;
+}
+
+static void neel_edt_overflow_add(struct neel_edt_wheel *w, struct sk_buff *skb)
+{
+    struct rb_node **p = &w->overflow.rb_root.rb_node, *parent = NULL;
+    bool leftmost = true;
+
+    while (*p) {
+        parent = *p;
+        if (skb->tstamp < rb_to_skb(parent)->tstamp) {
+            p = &parent->rb_left;
+        } else {
+            p = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+    rb_link_node(&skb->rbnode, parent, p);
+    rb_insert_color_cached(&skb->rbnode, &w->overflow, leftmost);
+    w->overflow_count++;
+}
+
+/*
+ * Move the overflow frames that now fit into the wheel. skb->rbnode
+ * shares its storage with skb->dev, which is set back as in sch_fq.
+ */
+static void neel_edt_overflow_pull(struct neel_edt_wheel *w,
+                                   struct net_device *dev, u64 now)
+{
+    struct rb_node *node;
+
+    while ((node = rb_first_cached(&w->overflow))) {
+        struct sk_buff *skb = rb_to_skb(node);
+        u64 slot = ktime_to_ns(skb->tstamp) >> NEEL_EDT_SLOT_SHIFT;
+
+        if (slot >= neel_edt_wheel_end(w, now))
+            break;
+        rb_erase_cached(node, &w->overflow);
+        w->overflow_count--;
+        skb->dev = dev;
+        neel_edt_slot_add(w, skb, slot);
+    }
+}
+
+/*
+ * Arm the hrtimer for the next slot of the wheel holding frames, or for
+ * when the first overflow frame fits in the wheel, if that is earlier
+ * than what the timer is armed for. Caller holds the lock.
+ */
+static void neel_edt_arm(struct neel_edt_wheel *w)
+{
+    struct rb_node *node = rb_first_cached(&w->overflow);
+    u64 next = U64_MAX;
+
+    if (w->count) {
+        neel_edt_advance(w);
+        next = w->cursor << NEEL_EDT_SLOT_SHIFT;
+    }
+    if (node) {
+        u64 slot = ktime_to_ns(rb_to_skb(node)->tstamp) >> NEEL_EDT_SLOT_SHIFT;
+
+        next = min(next, (slot - NEEL_EDT_SLOTS + 1) << NEEL_EDT_SLOT_SHIFT);
+    }
+    if (next >= w->armed_ns)
+        return;
+
+    w->armed_ns = next;
+    hrtimer_start(&w->timer, ns_to_ktime(next), HRTIMER_MODE_ABS_SOFT);
+}
+
+/*
+ * Park a frame until its departure time 'tstamp'. Returns false when
+ * the frame is due already and should be sent right away.
+ */
+static bool neel_edt_enqueue(struct neel_tx_queue *txq, struct sk_buff *skb,
+                             u64 tstamp)
+{
+    struct neel_edt_wheel *w = &txq->edt;
+    u64 now = ktime_get_ns();
+    u64 slot = tstamp >> NEEL_EDT_SLOT_SHIFT;
+
+    if (tstamp <= now)
+        return false;
+
+    if (tstamp - now > NEEL_EDT_HORIZON_NS) {
+        spin_lock(&w->lock);
+        w->horizon_drops++;
+        spin_unlock(&w->lock);
+        dev_core_stats_tx_dropped_inc(txq->dev);
+        dev_kfree_skb_any(skb);
+        return true;
+    }
+
+    spin_lock(&w->lock);
+
+    /*
+     * Overflow frames that fit go first, so that the wheel never holds
+     * a frame later than one still in the overflow.
+     */
+    neel_edt_overflow_pull(w, txq->dev, now);
+    if (slot < neel_edt_wheel_end(w, now))
+        neel_edt_slot_add(w, skb, slot);
+    else
+        neel_edt_overflow_add(w, skb);
+    neel_edt_arm(w);
+
+    w->held++;
+    if (w->count + w->overflow_count >= NEEL_EDT_LIMIT)
+        netif_tx_stop_queue(netdev_get_tx_queue(txq->dev, txq->index));
+
+    spin_unlock(&w->lock);
+    return true;
+}
+
+/*
+ * hrtimer (softirq) handler: unlink every slot that is due, then put
+ * the frames on the wire under the TX queue lock.
+ */
+static enum hrtimer_restart neel_edt_timer(struct hrtimer *timer)
+{
+    struct neel_tx_queue *txq = container_of(timer, struct neel_tx_queue,
+                                             edt.timer);
+    struct netdev_queue *nq = netdev_get_tx_queue(txq->dev, txq->index);
+    struct neel_priv *priv = netdev_priv(txq->dev);
+    struct neel_edt_wheel *w = &txq->edt;
+    struct sk_buff *head = NULL, **tail = &head, *skb;
+    u64 now = ktime_get_ns();
+
+    spin_lock(&w->lock);
+
+    w->armed_ns = U64_MAX;
+    while (w->count) {
+        struct neel_edt_slot *s;
+
+        neel_edt_advance(w);
+        if ((w->cursor << NEEL_EDT_SLOT_SHIFT) > now)
+            break;
+
+        s = &w->slots[w->cursor & (NEEL_EDT_SLOTS - 1)];
+        for (skb = s->head; skb; skb = skb->next) {
+            u64 late = now - min_t(u64, now, ktime_to_ns(skb->tstamp));
+
+            w->late_ns_total += late;
+            w->late_ns_max = max(w->late_ns_max, late);
+            w->count--;
+        }
+        *tail = s->head;
+        tail = &s->tail->next;
+        s->head = s->tail = NULL;
+        __clear_bit(w->cursor & (NEEL_EDT_SLOTS - 1), w->occupied);
+    }
+
+    /* the wheel moved on, frames of the overflow may fit now */
+    neel_edt_overflow_pull(w, txq->dev, now);
+    neel_edt_arm(w);
+
+    if (netif_tx_queue_stopped(nq) &&
+        w->count + w->overflow_count < NEEL_EDT_LIMIT / 2 &&
+        neel_tx_can_wake(txq))
+        netif_tx_wake_queue(nq);
+
+    spin_unlock(&w->lock);
+
+    __netif_tx_lock(nq, smp_processor_id());
+    while (head) {
+        skb = head;
+        head = skb->next;
+        skb_mark_not_on_list(skb);
+        neel_wire_xmit(priv, skb);
+    }
+    __netif_tx_unlock(nq);
+
+    return HRTIMER_NORESTART;
+}
+
+static int neel_edt_init(struct neel_tx_queue *txq)
+{
+    struct neel_edt_wheel *w = &txq->edt;
+
+    w->slots = kvcalloc(NEEL_EDT_SLOTS, sizeof(*w->slots), GFP_KERNEL);
+    w->occupied = bitmap_zalloc(NEEL_EDT_SLOTS, GFP_KERNEL);
+    if (!w->slots || !w->occupied) {
+        kvfree(w->slots);
+        bitmap_free(w->occupied);
+        w->slots = NULL;
+        w->occupied = NULL;
+        return -ENOMEM;
+    }
+    w->overflow = RB_ROOT_CACHED;
+    w->count = 0;
+    w->overflow_count = 0;
+    w->armed_ns = U64_MAX;
+    return 0;
+}
+
+/* Drop whatever is still parked on the wheel and release the wheel */
+static void neel_edt_destroy(struct neel_tx_queue *txq)
+{
+    struct neel_edt_wheel *w = &txq->edt;
+    unsigned int i;
+
+    if (!w->slots)
+        return;
+
+    hrtimer_cancel(&w->timer);
+    for (i = 0; i < NEEL_EDT_SLOTS; i++) {
+        struct sk_buff *skb = w->slots[i].head;
+
+        while (skb) {
+            struct sk_buff *next = skb->next;
+
+            skb_mark_not_on_list(skb);
+            dev_kfree_skb_any(skb);
+            skb = next;
+        }
+    }
+    skb_rbtree_purge(&w->overflow.rb_root);
+    w->overflow = RB_ROOT_CACHED;
+    kvfree(w->slots);
+    bitmap_free(w->occupied);
+    w->slots = NULL;
+    w->occupied = NULL;
+}
+
+/*
+ * Move up to "budget" frames of one TX queue's FIFO to the wire.
+ * Returns the number of frames sent.
+ */
+static int neel_tc_serve_queue(struct neel_priv *priv, unsigned int q, int budget)
+{
+    struct netdev_queue *nq = netdev_get_tx_queue(priv->dev, q);
+    struct neel_tx_queue *txq = &priv->txq[q];
+    struct sk_buff *skb;
+    int sent = 0;
+
+    __netif_tx_lock(nq, smp_processor_id());
+    while (sent < budget) {
+        /* with DMA rings the device can only take what fits */
+        if (dma_ring && neel_tx_ring_room(&txq->ring) < MAX_SKB_FRAGS + 1)
+            break;
+        skb = __skb_dequeue(&txq->tc_fifo);
+        if (!skb)
+            break;
+        neel_wire_xmit(priv, skb);
+        sent++;
+    }
+    if (netif_tx_queue_stopped(nq) &&
+        skb_queue_len(&txq->tc_fifo) <= NEEL_TC_FIFO_LEN / 2 &&
+        neel_tx_can_wake(txq))
+        netif_tx_wake_queue(nq);
+    __netif_tx_unlock(nq);
+
+    return sent;
+}
+
+/*
+ * One arbitration round: the highest traffic class with frames waiting
+ * sends one quantum from its next queue. Without traffic classes (after
+ * mqprio was removed) all queues are one class, to drain the FIFOs.
+ */
+static int neel_tc_arbitrate(struct neel_priv *priv, int budget)
+{
+    struct net_device *dev = priv->dev;
+    int num_tc = netdev_get_num_tc(dev);
+    unsigned int k;
+    int tc;
+
+    for (tc = max(num_tc, 1) - 1; tc >= 0; tc--) {
+        unsigned int count = num_tc ? dev->tc_to_txq[tc].count : NEEL_NUM_QUEUES;
+        unsigned int offset = num_tc ? dev->tc_to_txq[tc].offset : 0;
+
+        for (k = 0; k < count; k++) {
+            unsigned int q = offset + (priv->tc_cursor[tc] + k) % count;
+            int sent;
+
+            if (skb_queue_empty_lockless(&priv->txq[q].tc_fifo))
+                continue;
+
+            sent = neel_tc_serve_queue(priv, q,
+                                       min_t(int, budget, NEEL_TC_QUANTUM));
+            priv->tc_cursor[tc] = (q - offset + 1) % count;
+            if (sent)
+                return sent;
+        }
+    }
+    return 0;
+}
+
+/* TX NAPI poll: the port's TX arbiter */
+static int neel_tc_poll(struct napi_struct *napi, int budget)
+{
+    struct neel_priv *priv = container_of(napi, struct neel_priv, tc_napi);
+    int done = 0, sent;
+
+    while (done < budget) {
+        sent = neel_tc_arbitrate(priv, budget - done);
+        if (!sent)
+            break;
+        done += sent;
+    }
+
+    /* frames queued meanwhile have rescheduled us (NAPI_STATE_MISSED) */
+    if (done < budget)
+        napi_complete_done(napi, done);
+    return done;
+}
+
+/* Hand a frame to its queue's FIFO and wake the arbiter */
+static void neel_tc_enqueue(struct neel_priv *priv, struct neel_tx_queue *txq,
+                            struct sk_buff *skb)
+{
+    __skb_queue_tail(&txq->tc_fifo, skb);
+    if (skb_queue_len(&txq->tc_fifo) >= NEEL_TC_FIFO_LEN)
+        netif_tx_stop_queue(netdev_get_tx_queue(priv->dev, txq->index));
+    napi_schedule(&priv->tc_napi);
+}
+
+/*
+ * Transmit: frames with a departure time in the future wait on the
+ * queue's EDT wheel. With traffic classes the TX arbiter decides when
+ * the rest goes out, otherwise it goes on the wire right away.
+ */
+static netdev_tx_t neel_start_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    struct neel_tx_queue *txq = &priv->txq[skb_get_queue_mapping(skb)];
+
+    u64 departure = neel_edt_departure(skb);
+
+    if (departure && neel_edt_enqueue(txq, skb, departure))
+        return NETDEV_TX_OK;
+
+    if (netdev_get_num_tc(dev))
+        neel_tc_enqueue(priv, txq, skb);
+    else
+        neel_wire_xmit(priv, skb);
+    return NETDEV_TX_OK;
+}
+
+static void neel_get_stats64(struct net_device *dev,
+                             struct rtnl_link_stats64 *stats)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    unsigned int start;
+    int i;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        struct neel_rx_queue *rxq = &priv->rxq[i];
+        struct neel_tx_queue *txq = &priv->txq[i];
+        u64 packets, bytes;
+
+        do {
+            start = u64_stats_fetch_begin(&rxq->syncp);
+            packets = u64_stats_read(&rxq->packets);
+            bytes = u64_stats_read(&rxq->bytes);
+        } while (u64_stats_fetch_retry(&rxq->syncp, start));
+        stats->rx_packets += packets;
+        stats->rx_bytes += bytes;
+
+        do {
+            start = u64_stats_fetch_begin(&txq->syncp);
+            packets = u64_stats_read(&txq->packets);
+            bytes = u64_stats_read(&txq->bytes);
+        } while (u64_stats_fetch_retry(&txq->syncp, start));
+        stats->tx_packets += packets;
+        stats->tx_bytes += bytes;
+    }
+}
+
+static int neel_hwtstamp_set(struct net_device *dev, struct ifreq *ifr)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    struct hwtstamp_config config;
+
+    if (copy_from_user(&config, ifr->ifr_data, sizeof(config)))
+        return -EFAULT;
+
+    switch (config.tx_type) {
+    case HWTSTAMP_TX_OFF:
+    case HWTSTAMP_TX_ON:
+        break;
+    default:
+        return -ERANGE;
+    }
+
+    switch (config.rx_filter) {
+    case HWTSTAMP_FILTER_NONE:
+        break;
+    case HWTSTAMP_FILTER_NTP_ALL:
+    case HWTSTAMP_FILTER_ALL:
+    case HWTSTAMP_FILTER_SOME:
+    case HWTSTAMP_FILTER_PTP_V1_L4_EVENT ... HWTSTAMP_FILTER_PTP_V2_DELAY_REQ:
+        config.rx_filter = HWTSTAMP_FILTER_ALL;
+        break;
+    default:
+        return -ERANGE;
+    }
+
+    priv->tstamp_config = config;
+    WRITE_ONCE(priv->tx_tstamp, config.tx_type == HWTSTAMP_TX_ON);
+    WRITE_ONCE(priv->rx_tstamp, config.rx_filter != HWTSTAMP_FILTER_NONE);
+
+    return copy_to_user(ifr->ifr_data, &config, sizeof(config)) ? -EFAULT : 0;
+}
+
+static int neel_eth_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+
+    switch (cmd) {
+    case SIOCSHWTSTAMP:
+        return neel_hwtstamp_set(dev, ifr);
+    case SIOCGHWTSTAMP:
+        return copy_to_user(ifr->ifr_data, &priv->tstamp_config,
+                            sizeof(priv->tstamp_config)) ? -EFAULT : 0;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+/*
+ * The core has already checked new_mtu against min_mtu/max_mtu. Frames
+ * in flight keep the size they were built with.
+ */
+static int neel_change_mtu(struct net_device *dev, int new_mtu)
+{
+    netdev_info(dev, "MTU %u -> %d\n", dev->mtu, new_mtu);
+    WRITE_ONCE(dev->mtu, new_mtu);
+    return 0;
+}
+
+/*
+ * Offloaded mqprio: traffic class to TX queue ranges and priority to
+ * traffic class maps. Strict priority is all the arbiter does, so only
+ * DCB mode without rate limits is accepted.
+ */
+static int neel_setup_mqprio(struct net_device *dev,
+                             struct tc_mqprio_qopt_offload *mqprio)
+{
+    struct tc_mqprio_qopt *qopt = &mqprio->qopt;
+    unsigned long used = 0;
+    int tc, prio;
+
+    if (!qopt->num_tc) {
+        netdev_reset_tc(dev);
+        return 0;
+    }
+
+    if (mqprio->mode != TC_MQPRIO_MODE_DCB ||
+        mqprio->shaper != TC_MQPRIO_SHAPER_DCB ||
+        (mqprio->flags & (TC_MQPRIO_F_MIN_RATE | TC_MQPRIO_F_MAX_RATE)) ||
+        mqprio->preemptible_tcs) {
+        NL_SET_ERR_MSG_MOD(mqprio->extack, "only strict priority (dcb mode) is supported");
+        return -EOPNOTSUPP;
+    }
+
+    for (tc = 0; tc < qopt->num_tc; tc++) {
+        unsigned long range;
+
+        if (!qopt->count[tc] ||
+            qopt->offset[tc] + qopt->count[tc] > dev->real_num_tx_queues)
+            return -EINVAL;
+
+        range = GENMASK(qopt->offset[tc] + qopt->count[tc] - 1, qopt->offset[tc]);
+        if (used & range) {
+            NL_SET_ERR_MSG_MOD(mqprio->extack, "queue ranges overlap");
+            return -EINVAL;
+        }
+        used |= range;
+    }
+
+    netdev_set_num_tc(dev, qopt->num_tc);
+    for (tc = 0; tc < qopt->num_tc; tc++)
+        netdev_set_tc_queue(dev, tc, qopt->count[tc], qopt->offset[tc]);
+    for (prio = 0; prio <= TC_BITMASK; prio++)
+        netdev_set_prio_tc_map(dev, prio, qopt->prio_tc_map[prio]);
+
+    qopt->hw = TC_MQPRIO_HW_OFFLOAD_TCS;
+    return 0;
+}
+
+static int neel_setup_tc(struct net_device *dev, enum tc_setup_type type,
+                         void *type_data)
+{
+    switch (type) {
+    case TC_SETUP_QDISC_MQPRIO:
+        return neel_setup_mqprio(dev, type_data);
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static struct net_device_ops ndo = {
+    .ndo_open = my_open,
+    .ndo_stop = my_close,
+    .ndo_start_xmit = neel_start_xmit,
+    .ndo_get_stats64 = neel_get_stats64,
+    .ndo_eth_ioctl = neel_eth_ioctl,
+    .ndo_change_mtu = neel_change_mtu,
+    .ndo_setup_tc = neel_setup_tc,
+};
+
+/*
+ * ethtool -l: every RX queue is paired with a TX queue.
+ */
+static void neel_get_channels(struct net_device *dev,
+                              struct ethtool_channels *ch)
+{
+    ch->max_combined = NEEL_NUM_QUEUES;
+    ch->combined_count = NEEL_NUM_QUEUES;
+}
+
+/*
+ * ethtool needs the number of RX rings to validate "ethtool -X".
+ */
+static int neel_get_rxnfc(struct net_device *dev, struct ethtool_rxnfc *info,
+                          u32 *rule_locs)
+{
+    switch (info->cmd) {
+    case ETHTOOL_GRXRINGS:
+        info->data = NEEL_NUM_QUEUES;
+        return 0;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static u32 neel_get_rxfh_key_size(struct net_device *dev)
+{
+    return NEEL_RSS_KEY_SIZE;
+}
+
+static u32 neel_get_rxfh_indir_size(struct net_device *dev)
+{
+    return NEEL_RSS_INDIR_SIZE;
+}
+
+static int neel_get_rxfh(struct net_device *dev, struct ethtool_rxfh_param *rxfh)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+
+    rxfh->hfunc = ETH_RSS_HASH_TOP;
+    if (rxfh->indir)
+        memcpy(rxfh->indir, priv->rss_indir, sizeof(priv->rss_indir));
+    if (rxfh->key)
+        memcpy(rxfh->key, priv->rss_key, sizeof(priv->rss_key));
+    return 0;
+}
+
+/*
+ * ethtool -X: the core has already checked every table entry against
+ * the ring count reported by neel_get_rxnfc.
+ */
+static int neel_set_rxfh(struct net_device *dev, struct ethtool_rxfh_param *rxfh,
+                         struct netlink_ext_ack *extack)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    int i;
+
+    if (rxfh->hfunc != ETH_RSS_HASH_NO_CHANGE &&
+        rxfh->hfunc != ETH_RSS_HASH_TOP)
+        return -EOPNOTSUPP;
+
+    if (rxfh->key)
+        memcpy(priv->rss_key, rxfh->key, sizeof(priv->rss_key));
+    if (rxfh->indir)
+        for (i = 0; i < NEEL_RSS_INDIR_SIZE; i++)
+            WRITE_ONCE(priv->rss_indir[i], rxfh->indir[i]);
+    return 0;
+}
+
+/*
+ * ethtool -T: driver stamps in both directions, but no PHC to steer.
+ */
+static int neel_get_ts_info(struct net_device *dev, struct ethtool_ts_info *info)
+{
+    info->so_timestamping = SOF_TIMESTAMPING_TX_SOFTWARE |
+                            SOF_TIMESTAMPING_RX_SOFTWARE |
+                            SOF_TIMESTAMPING_SOFTWARE |
+                            SOF_TIMESTAMPING_TX_HARDWARE |
+                            SOF_TIMESTAMPING_RX_HARDWARE |
+                            SOF_TIMESTAMPING_RAW_HARDWARE;
+    info->phc_index = -1;
+    info->tx_types = BIT(HWTSTAMP_TX_OFF) | BIT(HWTSTAMP_TX_ON);
+    info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) | BIT(HWTSTAMP_FILTER_ALL);
+    return 0;
+}
+
+static int neel_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+                             struct kernel_ethtool_coalesce *kec,
+                             struct netlink_ext_ack *extack)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+
+    ec->use_adaptive_rx_coalesce = priv->adaptive_rx;
+    ec->rx_coalesce_usecs = READ_ONCE(priv->rxq[0].coal_usecs);
+    ec->rx_max_coalesced_frames = READ_ONCE(priv->rxq[0].coal_frames);
+    return 0;
+}
+
+/* ethtool -C: static values apply to every RX queue */
+static int neel_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+                             struct kernel_ethtool_coalesce *kec,
+                             struct netlink_ext_ack *extack)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    int i;
+
+    WRITE_ONCE(priv->adaptive_rx, !!ec->use_adaptive_rx_coalesce);
+    if (priv->adaptive_rx)
+        return 0;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        WRITE_ONCE(priv->rxq[i].coal_usecs, ec->rx_coalesce_usecs);
+        WRITE_ONCE(priv->rxq[i].coal_frames,
+                   max_t(u32, ec->rx_max_coalesced_frames, 1));
+    }
+    return 0;
+}
+
+static const char neel_rx_stat_names[][ETH_GSTRING_LEN] = {
+    "irqs",
+    "coal_usecs",
+    "coal_frames",
+};
 
-static struct net_device *dev;
+#define NEEL_RX_STATS   ARRAY_SIZE(neel_rx_stat_names)
 
-static int my_open(struct net_device *dev)
+static const char neel_tx_stat_names[][ETH_GSTRING_LEN] = {
+    "edt_held",
+    "edt_horizon_drops",
+    "edt_late_ns_total",
+    "edt_late_ns_max",
+    "link_held",
+    "link_loss_drops",
+    "link_limit_drops",
+};
+
+#define NEEL_TX_STATS   ARRAY_SIZE(neel_tx_stat_names)
+
+static int neel_get_sset_count(struct net_device *dev, int sset)
 {
-    pr_info("Hit: my_open(%s)\n", dev->name);
+    switch (sset) {
+    case ETH_SS_STATS:
+        return NEEL_NUM_QUEUES * (NEEL_RX_STATS + NEEL_TX_STATS);
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+/* ethtool -S: per queue strings are "rx<queue>_<name>" and "tx<queue>_<name>" */
+static void neel_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+    int i, j;
+
+    if (sset != ETH_SS_STATS)
+        return;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++)
+        for (j = 0; j < NEEL_RX_STATS; j++)
+            ethtool_sprintf(&data, "rx%d_%s", i, neel_rx_stat_names[j]);
+    for (i = 0; i < NEEL_NUM_QUEUES; i++)
+        for (j = 0; j < NEEL_TX_STATS; j++)
+            ethtool_sprintf(&data, "tx%d_%s", i, neel_tx_stat_names[j]);
+}
+
+static void neel_get_ethtool_stats(struct net_device *dev,
+                                   struct ethtool_stats *stats, u64 *data)
+{
+    struct neel_priv *priv = netdev_priv(dev);
+    int i;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        struct neel_rx_queue *rxq = &priv->rxq[i];
+
+        *data++ = READ_ONCE(rxq->irqs);
+        *data++ = READ_ONCE(rxq->coal_usecs);
+        *data++ = READ_ONCE(rxq->coal_frames);
+    }
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        struct neel_edt_wheel *w = &priv->txq[i].edt;
+
+        spin_lock_bh(&w->lock);
+        *data++ = w->held;
+        *data++ = w->horizon_drops;
+        *data++ = w->late_ns_total;
+        *data++ = w->late_ns_max;
+        spin_unlock_bh(&w->lock);
+
+        spin_lock_bh(&priv->txq[i].link.lock);
+        *data++ = priv->txq[i].link.held;
+        *data++ = priv->txq[i].link.loss_drops;
+        *data++ = priv->txq[i].link.limit_drops;
+        spin_unlock_bh(&priv->txq[i].link.lock);
+    }
+}
+
+static const struct ethtool_ops neel_ethtool_ops = {
+    .supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+                                 ETHTOOL_COALESCE_RX_MAX_FRAMES |
+                                 ETHTOOL_COALESCE_USE_ADAPTIVE_RX,
+    .get_link = ethtool_op_get_link,
+    .get_channels = neel_get_channels,
+    .get_rxnfc = neel_get_rxnfc,
+    .get_rxfh_key_size = neel_get_rxfh_key_size,
+    .get_rxfh_indir_size = neel_get_rxfh_indir_size,
+    .get_rxfh = neel_get_rxfh,
+    .set_rxfh = neel_set_rxfh,
+    .get_ts_info = neel_get_ts_info,
+    .get_sset_count = neel_get_sset_count,
+    .get_strings = neel_get_strings,
+    .get_ethtool_stats = neel_get_ethtool_stats,
+    .get_coalesce = neel_get_coalesce,
+    .set_coalesce = neel_set_coalesce,
+};
+
+static struct neel_tap *neel_tap_from_file(struct file *file)
+{
+    /* misc_open() leaves the miscdevice in private_data */
+    return container_of(file->private_data, struct neel_tap, misc);
+}
+
+/*
+ * Only one reader at a time: it owns the ring for as long as the file
+ * is open (an mmap keeps the file open).
+ */
+static int neel_tap_open(struct inode *inode, struct file *file)
+{
+    struct neel_tap *tap = neel_tap_from_file(file);
+    struct neel_tap_ring *ring;
+    size_t size;
+
+    if (test_and_set_bit(0, &tap->busy))
+        return -EBUSY;
 
-    /* start up the transmission queue */
+    size = PAGE_SIZE + PAGE_ALIGN((size_t)tap_slots * tap_slot_size);
+    ring = vmalloc_user(size);
+    if (!ring) {
+        clear_bit(0, &tap->busy);
+        return -ENOMEM;
+    }
+
+    tap->nr_slots = tap_slots;
+    tap->slot_size = tap_slot_size;
+    tap->head = 0;
+    tap->captured = 0;
+    tap->drops = 0;
 
-    netif_start_queue(dev);
+    /* for the reader only, never read back */
+    ring->nr_slots = tap->nr_slots;
+    ring->slot_size = tap->slot_size;
+    ring->snaplen = tap->snaplen;
+    ring->sample = tap->sample;
+
+    tap->area = ring;
+    tap->area_size = size;
+    rcu_assign_pointer(tap->ring, ring);
     return 0;
 }
 
-static int my_close(struct net_device *dev)
+static int neel_tap_release(struct inode *inode, struct file *file)
 {
-    pr_info("Hit: my_close(%s)\n", dev->name);
+    struct neel_tap *tap = neel_tap_from_file(file);
 
-    /* shutdown the transmission queue */
+    RCU_INIT_POINTER(tap->ring, NULL);
+    synchronize_net();
 
-    netif_stop_queue(dev);
+    vfree(tap->area);
+    tap->area = NULL;
+    clear_bit(0, &tap->busy);
     return 0;
 }
 
-/* Note this method is only needed on some; without it
-   module will fail upon removal or use. At any rate there is a memory
-   leak whenever you try to send a packet through in any case*/
+static int neel_tap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct neel_tap *tap = neel_tap_from_file(file);
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > tap->area_size)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, tap->area, 0);
+}
 
-static int stub_start_xmit(struct sk_buff *skb, struct net_device *dev)
+static __poll_t neel_tap_poll(struct file *file, poll_table *wait)
 {
-    dev_kfree_skb(skb);
+    struct neel_tap *tap = neel_tap_from_file(file);
+    struct neel_tap_ring *ring = tap->area;
+
+    poll_wait(file, &tap->wq, wait);
+
+    if (READ_ONCE(tap->head) != READ_ONCE(ring->tail))
+        return EPOLLIN | EPOLLRDNORM;
     return 0;
 }
 
+static long neel_tap_ioctl(struct file *file, unsigned int cmd,
+                           unsigned long arg)
+{
+    struct neel_tap *tap = neel_tap_from_file(file);
+    u32 val;
 
-static struct net_device_ops ndo = {
-    .ndo_open = my_open,
-    .ndo_stop = my_close,
-    .ndo_start_xmit = stub_start_xmit,
+    switch (cmd) {
+    case NEEL_TAP_SET_SNAPLEN:
+        if (get_user(val, (u32 __user *)arg))
+            return -EFAULT;
+        if (val > tap_slot_size - sizeof(struct neel_tap_desc))
+            return -EINVAL;
+        WRITE_ONCE(tap->snaplen, val);
+        tap->area->snaplen = val;
+        return 0;
+    case NEEL_TAP_SET_SAMPLE:
+        if (get_user(val, (u32 __user *)arg))
+            return -EFAULT;
+        if (!val)
+            return -EINVAL;
+        WRITE_ONCE(tap->sample, val);
+        tap->area->sample = val;
+        return 0;
+    case NEEL_TAP_GET_RING_SIZE:
+        return put_user((u64)tap->area_size, (u64 __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations neel_tap_fops = {
+    .owner          = THIS_MODULE,
+    .open           = neel_tap_open,
+    .release        = neel_tap_release,
+    .mmap           = neel_tap_mmap,
+    .poll           = neel_tap_poll,
+    .unlocked_ioctl = neel_tap_ioctl,
+    .llseek         = no_llseek,
+};
+
+/*
+ * Build a receive skb for a frame of "len" bytes read from "from": the
+ * headers in the linear area, the payload in page fragments.
+ */
+static struct sk_buff *neel_build_rx_skb(struct net_device *dev,
+                                         struct iov_iter *from, size_t len)
+{
+    size_t hlen = min_t(size_t, len, NEEL_RX_HDR_LEN);
+    struct sk_buff *skb;
+    int err = -EFAULT;
+
+    skb = netdev_alloc_skb_ip_align(dev, hlen);
+    if (!skb)
+        return ERR_PTR(-ENOMEM);
+
+    if (copy_from_iter(skb_put(skb, hlen), hlen, from) != hlen)
+        goto free;
+    len -= hlen;
+
+    while (len) {
+        size_t chunk = min_t(size_t, len, NEEL_RX_BUF_SIZE);
+        struct page *page;
+        void *buf;
+
+        buf = netdev_alloc_frag(NEEL_RX_BUF_SIZE);
+        if (!buf) {
+            err = -ENOMEM;
+            goto free;
+        }
+        page = virt_to_head_page(buf);
+        skb_add_rx_frag(skb, skb_shinfo(skb)->nr_frags, page,
+                        buf - page_address(page), chunk, NEEL_RX_BUF_SIZE);
+
+        if (copy_from_iter(buf, chunk, from) != chunk)
+            goto free;
+        len -= chunk;
+    }
+    return skb;
+
+free:
+    kfree_skb(skb);
+    return ERR_PTR(err);
+}
+
+/*
+ * writev() on /dev/neel_inject: every iovec is one ethernet frame.
+ * Frames are handed to the receive path NEEL_INJECT_BATCH at a time.
+ */
+static ssize_t neel_inject_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct neel_priv *priv = container_of(iocb->ki_filp->private_data,
+                                          struct neel_priv, inject);
+    struct net_device *dev = priv->dev;
+    unsigned int max_len = dev->mtu + dev->hard_header_len + VLAN_HLEN;
+    struct sk_buff_head batch;
+    ssize_t done = 0;
+    int err = 0;
+
+    if (!netif_running(dev))
+        return -ENETDOWN;
+
+    __skb_queue_head_init(&batch);
+
+    while (iov_iter_count(from)) {
+        size_t len = iov_iter_single_seg_count(from);
+        struct sk_buff *skb;
+
+        if (len < ETH_HLEN || len > max_len) {
+            err = -EINVAL;
+            break;
+        }
+
+        skb = neel_build_rx_skb(dev, from, len);
+        if (IS_ERR(skb)) {
+            err = PTR_ERR(skb);
+            break;
+        }
+
+        __skb_queue_tail(&batch, skb);
+        done += len;
+
+        if (skb_queue_len(&batch) == NEEL_INJECT_BATCH) {
+            local_bh_disable();
+            neel_rx_bulk(priv, &batch);
+            local_bh_enable();
+        }
+    }
+
+    if (!skb_queue_empty(&batch)) {
+        local_bh_disable();
+        neel_rx_bulk(priv, &batch);
+        local_bh_enable();
+    }
+
+    return done ? done : err;
+}
+
+static const struct file_operations neel_inject_fops = {
+    .owner          = THIS_MODULE,
+    .open           = nonseekable_open,
+    .write_iter     = neel_inject_write_iter,
+    .llseek         = no_llseek,
+};
+
+static const struct nla_policy neel_flow_policy[NEEL_FLOW_A_MAX + 1] = {
+    [NEEL_FLOW_A_IIF]       = { .type = NLA_U32 },
+    [NEEL_FLOW_A_PROTO]     = { .type = NLA_U8 },
+    [NEEL_FLOW_A_SRC]       = NLA_POLICY_MIN_LEN(sizeof(struct in_addr)),
+    [NEEL_FLOW_A_DST]       = NLA_POLICY_MIN_LEN(sizeof(struct in_addr)),
+    [NEEL_FLOW_A_SPORT]     = { .type = NLA_BE16 },
+    [NEEL_FLOW_A_DPORT]     = { .type = NLA_BE16 },
+    [NEEL_FLOW_A_OIF]       = { .type = NLA_U32 },
+    [NEEL_FLOW_A_ACTION]    = NLA_POLICY_MAX(NLA_U8, NEEL_FLOW_ACT_TX),
+};
+
+static struct genl_family neel_flow_family;
+
+/* IPv4 or IPv6 address attribute to the IPv4 mapped form of the key */
+static int neel_flow_parse_addr(const struct nlattr *nla, struct in6_addr *addr)
+{
+    switch (nla_len(nla)) {
+    case sizeof(struct in_addr):
+        ipv6_addr_set_v4mapped(nla_get_in_addr(nla), addr);
+        return 0;
+    case sizeof(struct in6_addr):
+        *addr = nla_get_in6_addr(nla);
+        return 0;
+    }
+    return -EINVAL;
+}
+
+static int neel_flow_parse_key(struct genl_info *info, struct neel_flow_key *key)
+{
+    struct nlattr **tb = info->attrs;
+
+    if (GENL_REQ_ATTR_CHECK(info, NEEL_FLOW_A_IIF) ||
+        GENL_REQ_ATTR_CHECK(info, NEEL_FLOW_A_PROTO) ||
+        GENL_REQ_ATTR_CHECK(info, NEEL_FLOW_A_SRC) ||
+        GENL_REQ_ATTR_CHECK(info, NEEL_FLOW_A_DST))
+        return -EINVAL;
+
+    memset(key, 0, sizeof(*key));
+    if (neel_flow_parse_addr(tb[NEEL_FLOW_A_SRC], &key->src) ||
+        neel_flow_parse_addr(tb[NEEL_FLOW_A_DST], &key->dst) ||
+        ipv6_addr_v4mapped(&key->src) != ipv6_addr_v4mapped(&key->dst)) {
+        GENL_SET_ERR_MSG(info, "addresses must both be IPv4 or both IPv6");
+        return -EINVAL;
+    }
+
+    key->iif = nla_get_u32(tb[NEEL_FLOW_A_IIF]);
+    key->proto = nla_get_u8(tb[NEEL_FLOW_A_PROTO]);
+    /* the datapath only looks at ports for TCP and UDP */
+    if (key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) {
+        if (tb[NEEL_FLOW_A_SPORT])
+            key->sport = nla_get_be16(tb[NEEL_FLOW_A_SPORT]);
+        if (tb[NEEL_FLOW_A_DPORT])
+            key->dport = nla_get_be16(tb[NEEL_FLOW_A_DPORT]);
+    }
+    return 0;
+}
+
+/* Only our own interfaces can be forwarded from or to */
+static struct net_device *neel_flow_dev(int ifindex)
+{
+    struct net_device *ndev;
+
+    ndev = dev_get_by_index(&init_net, ifindex);
+    if (!ndev)
+        return NULL;
+    dev_put(ndev);
+
+    return ndev->netdev_ops == &ndo ? ndev : NULL;
+}
+
+static int neel_flow_add(struct sk_buff *skb, struct genl_info *info)
+{
+    struct neel_flow *flow;
+    struct net_device *to;
+    int err;
+
+    if (GENL_REQ_ATTR_CHECK(info, NEEL_FLOW_A_OIF) ||
+        GENL_REQ_ATTR_CHECK(info, NEEL_FLOW_A_ACTION))
+        return -EINVAL;
+
+    if (atomic_read(&neel_flows.nelems) >= NEEL_FLOW_MAX)
+        return -ENOSPC;
+
+    flow = kzalloc(sizeof(*flow), GFP_KERNEL);
+    if (!flow)
+        return -ENOMEM;
+
+    err = neel_flow_parse_key(info, &flow->key);
+    if (err)
+        goto err_free;
+
+    to = neel_flow_dev(nla_get_u32(info->attrs[NEEL_FLOW_A_OIF]));
+    if (!neel_flow_dev(flow->key.iif) || !to) {
+        GENL_SET_ERR_MSG(info, "both interfaces must be neel_netif");
+        err = -ENODEV;
+        goto err_free;
+    }
+    flow->to = to;
+    flow->action = nla_get_u8(info->attrs[NEEL_FLOW_A_ACTION]);
+
+    err = rhashtable_lookup_insert_fast(&neel_flows, &flow->node,
+                                        neel_flow_params);
+    if (err)
+        goto err_free;
+    return 0;
+
+err_free:
+    kfree(flow);
+    return err;
+}
+
+static int neel_flow_del(struct sk_buff *skb, struct genl_info *info)
+{
+    struct neel_flow_key key;
+    struct neel_flow *flow;
+    int err;
+
+    err = neel_flow_parse_key(info, &key);
+    if (err)
+        return err;
+
+    flow = rhashtable_lookup_fast(&neel_flows, &key, neel_flow_params);
+    if (!flow)
+        return -ENOENT;
+
+    rhashtable_remove_fast(&neel_flows, &flow->node, neel_flow_params);
+    kfree_rcu(flow, rcu);
+    return 0;
+}
+
+/* Remove every flow. The genl ops are serialized, so is this. */
+static void neel_flow_flush(void)
+{
+    struct rhashtable_iter iter;
+    struct neel_flow *flow;
+
+    rhashtable_walk_enter(&neel_flows, &iter);
+    rhashtable_walk_start(&iter);
+    while ((flow = rhashtable_walk_next(&iter))) {
+        if (IS_ERR(flow))
+            continue;
+        if (!rhashtable_remove_fast(&neel_flows, &flow->node, neel_flow_params))
+            kfree_rcu(flow, rcu);
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+}
+
+static int neel_flow_flush_doit(struct sk_buff *skb, struct genl_info *info)
+{
+    neel_flow_flush();
+    return 0;
+}
+
+static int neel_flow_fill(struct sk_buff *skb, const struct neel_flow *flow,
+                          u32 portid, u32 seq)
+{
+    const struct neel_flow_key *key = &flow->key;
+    void *hdr;
+
+    hdr = genlmsg_put(skb, portid, seq, &neel_flow_family, NLM_F_MULTI,
+                      NEEL_FLOW_CMD_GET);
+    if (!hdr)
+        return -EMSGSIZE;
+
+    if (nla_put_u32(skb, NEEL_FLOW_A_IIF, key->iif) ||
+        nla_put_u8(skb, NEEL_FLOW_A_PROTO, key->proto) ||
+        nla_put_be16(skb, NEEL_FLOW_A_SPORT, key->sport) ||
+        nla_put_be16(skb, NEEL_FLOW_A_DPORT, key->dport) ||
+        nla_put_u32(skb, NEEL_FLOW_A_OIF, flow->to->ifindex) ||
+        nla_put_u8(skb, NEEL_FLOW_A_ACTION, flow->action) ||
+        nla_put_u64_64bit(skb, NEEL_FLOW_A_PACKETS,
+                          atomic64_read(&flow->packets), NEEL_FLOW_A_PAD) ||
+        nla_put_u64_64bit(skb, NEEL_FLOW_A_BYTES,
+                          atomic64_read(&flow->bytes), NEEL_FLOW_A_PAD))
+        goto cancel;
+
+    if (ipv6_addr_v4mapped(&key->src)) {
+        if (nla_put_in_addr(skb, NEEL_FLOW_A_SRC, key->src.s6_addr32[3]) ||
+            nla_put_in_addr(skb, NEEL_FLOW_A_DST, key->dst.s6_addr32[3]))
+            goto cancel;
+    } else {
+        if (nla_put_in6_addr(skb, NEEL_FLOW_A_SRC, &key->src) ||
+            nla_put_in6_addr(skb, NEEL_FLOW_A_DST, &key->dst))
+            goto cancel;
+    }
+
+    genlmsg_end(skb, hdr);
+    return 0;
+
+cancel:
+    genlmsg_cancel(skb, hdr);
+    return -EMSGSIZE;
+}
+
+/* Dump the table; cb->args[0] counts the flows already sent */
+static int neel_flow_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+    struct rhashtable_iter iter;
+    struct neel_flow *flow;
+    long idx = 0;
+
+    rhashtable_walk_enter(&neel_flows, &iter);
+    rhashtable_walk_start(&iter);
+    while ((flow = rhashtable_walk_next(&iter))) {
+        if (IS_ERR(flow))
+            continue;
+        if (idx++ < cb->args[0])
+            continue;
+        if (neel_flow_fill(skb, flow, NETLINK_CB(cb->skb).portid,
+                           cb->nlh->nlmsg_seq)) {
+            idx--;
+            break;
+        }
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+
+    cb->args[0] = idx;
+    return skb->len;
+}
+
+static const struct genl_small_ops neel_flow_ops[] = {
+    {
+        .cmd    = NEEL_FLOW_CMD_ADD,
+        .doit   = neel_flow_add,
+        .flags  = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd    = NEEL_FLOW_CMD_DEL,
+        .doit   = neel_flow_del,
+        .flags  = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd    = NEEL_FLOW_CMD_GET,
+        .dumpit = neel_flow_dump,
+    },
+    {
+        .cmd    = NEEL_FLOW_CMD_FLUSH,
+        .doit   = neel_flow_flush_doit,
+        .flags  = GENL_ADMIN_PERM,
+    },
+};
+
+static struct genl_family neel_flow_family __ro_after_init = {
+    .name           = NEEL_FLOW_GENL_NAME,
+    .version        = NEEL_FLOW_GENL_VERSION,
+    .maxattr        = NEEL_FLOW_A_MAX,
+    .policy         = neel_flow_policy,
+    .module         = THIS_MODULE,
+    .small_ops      = neel_flow_ops,
+    .n_small_ops    = ARRAY_SIZE(neel_flow_ops),
+};
+
+/*
+ * sysfs: /sys/class/net/<dev>/link/txq<n>/<parameter>, one directory
+ * per TX queue. The kobjects live in the net_device's private area.
+ */
+#define to_neel_link(k) container_of(k, struct neel_link, kobj)
+
+enum {
+    NEEL_LINK_DELAY,
+    NEEL_LINK_JITTER,
+    NEEL_LINK_LOSS,
+    NEEL_LINK_RATE,
+    NEEL_LINK_BURST_BYTES,
+    NEEL_LINK_LIMIT_FRAMES,
+};
+
+struct neel_link_attr {
+    struct kobj_attribute attr;
+    int param;
+    u64 max;
+};
+
+static u64 neel_link_get(struct neel_link *l, int param)
+{
+    switch (param) {
+    case NEEL_LINK_DELAY:       return READ_ONCE(l->delay_us);
+    case NEEL_LINK_JITTER:      return READ_ONCE(l->jitter_us);
+    case NEEL_LINK_LOSS:        return READ_ONCE(l->loss_ppm);
+    case NEEL_LINK_RATE:        return READ_ONCE(l->rate_kbit);
+    case NEEL_LINK_BURST_BYTES: return READ_ONCE(l->burst_bytes);
+    default:                    return READ_ONCE(l->limit);
+    }
+}
+
+static ssize_t neel_link_show(struct kobject *kobj, struct kobj_attribute *attr,
+                              char *buf)
+{
+    struct neel_link_attr *la = container_of(attr, struct neel_link_attr, attr);
+
+    return sysfs_emit(buf, "%llu\n", neel_link_get(to_neel_link(kobj), la->param));
+}
+
+static ssize_t neel_link_store(struct kobject *kobj, struct kobj_attribute *attr,
+                               const char *buf, size_t count)
+{
+    struct neel_link_attr *la = container_of(attr, struct neel_link_attr, attr);
+    struct neel_link *l = to_neel_link(kobj);
+    u64 val;
+
+    if (kstrtou64(buf, 0, &val) || val > la->max)
+        return -EINVAL;
+
+    spin_lock_bh(&l->lock);
+    switch (la->param) {
+    case NEEL_LINK_DELAY:       WRITE_ONCE(l->delay_us, val); break;
+    case NEEL_LINK_JITTER:      WRITE_ONCE(l->jitter_us, val); break;
+    case NEEL_LINK_LOSS:        WRITE_ONCE(l->loss_ppm, val); break;
+    case NEEL_LINK_RATE:        WRITE_ONCE(l->rate_kbit, val); break;
+    case NEEL_LINK_BURST_BYTES: WRITE_ONCE(l->burst_bytes, max_t(u64, val, ETH_FRAME_LEN)); break;
+    case NEEL_LINK_LIMIT_FRAMES: WRITE_ONCE(l->limit, max_t(u64, val, 1)); break;
+    }
+    neel_link_reset(l);
+    WRITE_ONCE(l->active, l->delay_us || l->jitter_us || l->loss_ppm ||
+                          l->rate_kbit);
+    spin_unlock_bh(&l->lock);
+
+    return count;
+}
+
+#define NEEL_LINK_ATTR(_name, _param, _max)                             \
+    static struct neel_link_attr neel_link_attr_##_name = {             \
+        .attr = __ATTR(_name, 0644, neel_link_show, neel_link_store),   \
+        .param = _param,                                                \
+        .max = _max,                                                    \
+    }
+
+NEEL_LINK_ATTR(delay_us, NEEL_LINK_DELAY, 10 * USEC_PER_SEC);
+NEEL_LINK_ATTR(jitter_us, NEEL_LINK_JITTER, USEC_PER_SEC);
+NEEL_LINK_ATTR(loss_ppm, NEEL_LINK_LOSS, 1000000);
+NEEL_LINK_ATTR(rate_kbit, NEEL_LINK_RATE, 400ULL * 1000 * 1000);
+NEEL_LINK_ATTR(burst_bytes, NEEL_LINK_BURST_BYTES, 64 << 20);
+NEEL_LINK_ATTR(limit, NEEL_LINK_LIMIT_FRAMES, 1 << 20);
+
+static struct attribute *neel_link_attrs[] = {
+    &neel_link_attr_delay_us.attr.attr,
+    &neel_link_attr_jitter_us.attr.attr,
+    &neel_link_attr_loss_ppm.attr.attr,
+    &neel_link_attr_rate_kbit.attr.attr,
+    &neel_link_attr_burst_bytes.attr.attr,
+    &neel_link_attr_limit.attr.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(neel_link);
+
+/* The memory belongs to the net_device, nothing to free */
+static void neel_link_release(struct kobject *kobj)
+{
+}
+
+static const struct kobj_type neel_link_ktype = {
+    .release        = neel_link_release,
+    .sysfs_ops      = &kobj_sysfs_ops,
+    .default_groups = neel_link_groups,
+};
+
+static void neel_link_sysfs_del(struct neel_priv *priv)
+{
+    int i;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++)
+        kobject_put(&priv->txq[i].link.kobj);
+    kobject_put(priv->link_kobj);
+}
+
+static int neel_link_sysfs_add(struct neel_priv *priv)
+{
+    int i, err;
+
+    priv->link_kobj = kobject_create_and_add("link", &priv->dev->dev.kobj);
+    if (!priv->link_kobj)
+        return -ENOMEM;
+
+    for (i = 0; i < NEEL_NUM_QUEUES; i++) {
+        err = kobject_init_and_add(&priv->txq[i].link.kobj, &neel_link_ktype,
+                                   priv->link_kobj, "txq%d", i);
+        if (err) {
+            /* kobject_init_and_add wants a put even when it fails */
+            while (i >= 0)
+                kobject_put(&priv->txq[i--].link.kobj);
+            kobject_put(priv->link_kobj);
+            return err;
+        }
+    }
+    return 0;
+}
+
+static const struct netlink_range_validation neel_sample_rate_range = {
+    .max = NEEL_SAMPLE_RATE_MAX,
+};
+
+static const struct nla_policy neel_sample_policy[NEEL_SAMPLE_A_MAX + 1] = {
+    [NEEL_SAMPLE_A_RATE]    = NLA_POLICY_FULL_RANGE(NLA_U32, &neel_sample_rate_range),
+    [NEEL_SAMPLE_A_HDR_LEN] = NLA_POLICY_RANGE(NLA_U32, ETH_HLEN,
+                                               NEEL_SAMPLE_HDR_MAX),
+};
+
+static int neel_sample_set(struct sk_buff *skb, struct genl_info *info)
+{
+    struct nlattr **tb = info->attrs;
+
+    /* under genl_lock, like neel_sample_stop() setting it */
+    if (neel_sample_stopped)
+        return -ESHUTDOWN;
+    if (tb[NEEL_SAMPLE_A_HDR_LEN])
+        WRITE_ONCE(neel_sample_hdr_len, nla_get_u32(tb[NEEL_SAMPLE_A_HDR_LEN]));
+    if (tb[NEEL_SAMPLE_A_RATE]) {
+        u32 rate = nla_get_u32(tb[NEEL_SAMPLE_A_RATE]);
+
+        WRITE_ONCE(neel_sample_rate, rate);
+        if (rate)
+            schedule_delayed_work(&neel_sample_work,
+                                  msecs_to_jiffies(NEEL_SAMPLE_FLUSH_MS));
+    }
+    return 0;
+}
+
+static const struct genl_small_ops neel_sample_ops[] = {
+    {
+        .cmd    = NEEL_SAMPLE_CMD_SET,
+        .doit   = neel_sample_set,
+        .flags  = GENL_ADMIN_PERM,
+    },
+};
+
+static const struct genl_multicast_group neel_sample_mcgrps[] = {
+    { .name = NEEL_SAMPLE_MCGRP_NAME, .flags = GENL_UNS_ADMIN_PERM },
+};
+
+static struct genl_family neel_sample_family __ro_after_init = {
+    .name           = NEEL_SAMPLE_GENL_NAME,
+    .version        = NEEL_SAMPLE_GENL_VERSION,
+    .maxattr        = NEEL_SAMPLE_A_MAX,
+    .policy         = neel_sample_policy,
+    .module         = THIS_MODULE,
+    .small_ops      = neel_sample_ops,
+    .n_small_ops    = ARRAY_SIZE(neel_sample_ops),
+    .mcgrps         = neel_sample_mcgrps,
+    .n_mcgrps       = ARRAY_SIZE(neel_sample_mcgrps),
 };
 
+/*
+ * Sampling off for good, pending messages dropped. Called before the
+ * family is unregistered: once this returns no datapath caller is left
+ * in genl_has_listeners() or genlmsg_multicast(), and no SET can switch
+ * sampling back on.
+ */
+static void neel_sample_stop(void)
+{
+    unsigned int cpu;
+
+    genl_lock();
+    neel_sample_stopped = true;
+    WRITE_ONCE(neel_sample_rate, 0);
+    genl_unlock();
+    cancel_delayed_work_sync(&neel_sample_work);
+    synchronize_net();
+
+    for_each_possible_cpu(cpu) {
+        struct neel_sampler *s = per_cpu_ptr(&neel_sampler, cpu);
+
+        nlmsg_free(s->msg);
+        s->msg = NULL;
+    }
+}
+
+static void neel_rx_queue_init_moderation(struct neel_rx_queue *rxq)
+{
+    struct dim_cq_moder moder;
+
+    hrtimer_init(&rxq->irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    rxq->irq_timer.function = neel_rx_irq_timer;
+    init_irq_work(&rxq->irq_work, neel_rx_irq_work);
+    rxq->irq_cpu = cpumask_local_spread(rxq->index, NUMA_NO_NODE);
+
+    INIT_WORK(&rxq->dim.work, neel_rx_dim_work);
+    rxq->dim.mode = DIM_CQ_PERIOD_MODE_START_FROM_EQE;
+    moder = net_dim_get_def_rx_moderation(rxq->dim.mode);
+    rxq->coal_usecs = moder.usec;
+    rxq->coal_frames = moder.pkts;
+}
+
+static void neel_tx_queue_init(struct net_device *dev,
+                               struct neel_tx_queue *txq, unsigned int index)
+{
+    txq->dev = dev;
+    txq->index = index;
+    u64_stats_init(&txq->syncp);
+    spin_lock_init(&txq->edt.lock);
+    hrtimer_init(&txq->edt.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    txq->edt.timer.function = neel_edt_timer;
+
+    spin_lock_init(&txq->link.lock);
+    __skb_queue_head_init(&txq->link.frames);
+    hrtimer_init(&txq->link.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    txq->link.timer.function = neel_link_timer;
+    txq->link.limit = NEEL_LINK_LIMIT;
+    txq->link.burst_bytes = NEEL_LINK_BURST;
+
+    __skb_queue_head_init(&txq->tc_fifo);
+}
+
 static void my_setup(struct net_device *dev)
 {
+    struct neel_priv *priv = netdev_priv(dev);
+    u8 addr[ETH_ALEN];
     int j;
     pr_info("my_setup(%s)\n", dev->name);
 
     /* Fill in the MAC address with a phoney */
 
     for (j = 0; j < ETH_ALEN; ++j) {
-        dev->dev_addr[j] = (char)j;
+        addr[j] = (char)j;
     }
+    eth_hw_addr_set(dev, addr);
 
     ether_setup(dev);
     dev->netdev_ops = &ndo;
+    dev->ethtool_ops = &neel_ethtool_ops;
+    dev->features |= NETIF_F_RXHASH | NETIF_F_SG | NETIF_F_HW_CSUM |
+                     NETIF_F_HIGHDMA;
+    dev->hw_features |= NETIF_F_RXHASH | NETIF_F_SG | NETIF_F_HW_CSUM;
+
+    /* jumbo frames: anything an IP datagram can carry */
+    dev->min_mtu = ETH_MIN_MTU;
+    dev->max_mtu = ETH_MAX_MTU;
+
+    priv->dev = dev;
+    priv->adaptive_rx = true;
+    for (j = 0; j < NEEL_NUM_QUEUES; j++) {
+        struct neel_rx_queue *rxq = &priv->rxq[j];
+
+        rxq->dev = dev;
+        rxq->index = j;
+        skb_queue_head_init(&rxq->skbs);
+        u64_stats_init(&rxq->syncp);
+        neel_tx_queue_init(dev, &priv->txq[j], j);
+        netif_napi_add(dev, &rxq->napi, neel_napi_poll);
+        neel_rx_queue_init_moderation(rxq);
+    }
+    netif_napi_add_tx(dev, &priv->tc_napi, neel_tc_poll);
+
+    spin_lock_init(&priv->tap.lock);
+    init_waitqueue_head(&priv->tap.wq);
+    priv->tap.snaplen = 128;
+    priv->tap.sample = 1;
+    priv->tap.misc.minor = MISC_DYNAMIC_MINOR;
+    priv->tap.misc.name = "neel_tap";
+    priv->tap.misc.fops = &neel_tap_fops;
+
+    priv->inject.minor = MISC_DYNAMIC_MINOR;
+    priv->inject.name = "neel_inject";
+    priv->inject.fops = &neel_inject_fops;
+
+    /* Random key and an even spread of the table, like most NICs */
+    netdev_rss_key_fill(priv->rss_key, sizeof(priv->rss_key));
+    for (j = 0; j < NEEL_RSS_INDIR_SIZE; j++)
+        priv->rss_indir[j] = ethtool_rxfh_indir_default(j, NEEL_NUM_QUEUES);
 }
 
 static int __init my_init(void)
 {
+    struct net_device *dev;
+    struct neel_priv *priv;
+    unsigned int i, cpu;
+    int err;
+
     pr_info("Loading stub network module:....");
 
+    if (!nr_ifs || nr_ifs > NEEL_MAX_IFS)
+        return -EINVAL;
+    if (!tap_slots || tap_slot_size < sizeof(struct neel_tap_desc) + ETH_HLEN ||
+        !IS_ALIGNED(tap_slot_size, 8))
+        return -EINVAL;
+
     /*
-     * alloc_netdev allocates the private data area and the net device structure.
+     * alloc_netdev_mqs allocates the private data area and the net device
+     * structure with NEEL_NUM_QUEUES TX and RX queues.
      * It also initializes the name field in the net_device structure to the base
      * string for the name, such as neel_netif%d, as done below.
      *
@@ -105,21 +3594,129 @@ static int __init my_init(void)
      *   TX packets 0  bytes 0 (0.0 B)
      *   TX errors 0  dropped 0 overruns 0  carrier 0  collisions 0
      */
-    dev = alloc_netdev(0, "neel_netif%d", NET_NAME_UNKNOWN, my_setup);
-    if (register_netdev(dev)) {
-        pr_info(" Failed to register\n");
-        free_netdev(dev);
-        return -1;
+    /*
+     * A platform device stands in for the bus device of a real NIC: it
+     * parents the interface and is what the DMA API maps against.
+     */
+    neel_pdev = platform_device_register_simple("neel_netif", PLATFORM_DEVID_NONE,
+                                                NULL, 0);
+    if (IS_ERR(neel_pdev))
+        return PTR_ERR(neel_pdev);
+    err = dma_coerce_mask_and_coherent(&neel_pdev->dev, DMA_BIT_MASK(64));
+    if (err)
+        goto err_pdev;
+
+    err = rhashtable_init(&neel_flows, &neel_flow_params);
+    if (err)
+        goto err_pdev;
+
+    for (i = 0; i < nr_ifs; i++) {
+        dev = alloc_netdev_mqs(sizeof(struct neel_priv), "neel_netif%d",
+                               NET_NAME_UNKNOWN, my_setup,
+                               NEEL_NUM_QUEUES, NEEL_NUM_QUEUES);
+        if (!dev) {
+            err = -ENOMEM;
+            goto err_devs;
+        }
+        priv = netdev_priv(dev);
+        priv->dmadev = &neel_pdev->dev;
+        SET_NETDEV_DEV(dev, &neel_pdev->dev);
+        /* 00:01:02:03:04:05 for the first one, counting up from there */
+        eth_hw_addr_gen(dev, dev->dev_addr, i);
+
+        if (register_netdev(dev)) {
+            pr_info(" Failed to register\n");
+            free_netdev(dev);
+            err = -1;
+            goto err_devs;
+        }
+        devs[i] = dev;
+
+        err = neel_link_sysfs_add(priv);
+        if (err) {
+            unregister_netdev(dev);
+            free_netdev(dev);
+            goto err_devs;
+        }
+
+        if (threaded) {
+            rtnl_lock();
+            err = dev_set_threaded(dev, true);
+            rtnl_unlock();
+            if (err)
+                pr_warn("threaded NAPI not enabled: %d\n", err);
+        }
     }
-    pr_info("Succeeded in loading %s!\n\n", dev_name(&dev->dev));
+
+    err = genl_register_family(&neel_flow_family);
+    if (err)
+        goto err_devs;
+
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu_ptr(&neel_sampler, cpu)->lock);
+    err = genl_register_family(&neel_sample_family);
+    if (err)
+        goto err_sample;
+
+    /* the capture tap rides along with the first interface */
+    priv = netdev_priv(devs[0]);
+    err = misc_register(&priv->tap.misc);
+    if (err)
+        goto err_tap;
+    err = misc_register(&priv->inject);
+    if (err)
+        goto err_inject;
+
+    pr_info("Succeeded in loading %s!\n\n", dev_name(&devs[0]->dev));
     return 0;
+
+err_inject:
+    misc_deregister(&priv->tap.misc);
+err_tap:
+    pr_err("misc_register failed!!!\n");
+    neel_sample_stop();
+    genl_unregister_family(&neel_sample_family);
+err_sample:
+    genl_unregister_family(&neel_flow_family);
+    neel_flow_flush();
+    synchronize_net();
+err_devs:
+    while (i--) {
+        neel_link_sysfs_del(netdev_priv(devs[i]));
+        unregister_netdev(devs[i]);
+        free_netdev(devs[i]);
+    }
+    rhashtable_destroy(&neel_flows);
+err_pdev:
+    platform_device_unregister(neel_pdev);
+    return err;
 }
 
 static void __exit my_exit(void)
 {
+    struct neel_priv *priv = netdev_priv(devs[0]);
+    unsigned int i;
+
     pr_info("Unloading stub network module\n\n");
-    unregister_netdev(dev);
-    free_netdev(dev);
+    misc_deregister(&priv->inject);
+    misc_deregister(&priv->tap.misc);
+
+    neel_sample_stop();
+    genl_unregister_family(&neel_sample_family);
+
+    /* no new flows, then no frame can be forwarded to a dying interface */
+    genl_unregister_family(&neel_flow_family);
+    neel_flow_flush();
+    synchronize_net();
+
+    for (i = 0; i < nr_ifs; i++) {
+        neel_link_sysfs_del(netdev_priv(devs[i]));
+        unregister_netdev(devs[i]);
+    }
+    for (i = 0; i < nr_ifs; i++)
+        free_netdev(devs[i]);
+    rhashtable_destroy(&neel_flows);
+    platform_device_unregister(neel_pdev);
 }
 
 module_init(my_init);
@@ -128,4 +3725,3 @@ module_exit(my_exit);
 MODULE_AUTHOR("Neelkanth Reddy");
 MODULE_DESCRIPTION("Basic network device driver");
 MODULE_LICENSE("GPL v2");
-
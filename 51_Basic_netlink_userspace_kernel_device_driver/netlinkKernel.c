@@ -66,60 +66,468 @@
  ********************************************************************     
  */
 
+/*
+ ********************************************************************
+ * Batches: many requests per sendmsg, few reply skbs               *
+ ********************************************************************
+ * 1. One sendmsg() from userspace can carry many netlink messages
+ *    back to back in the same sk_buff. "hello_nl_recv_msg" walks
+ *    all of them with nlmsg_ok()/nlmsg_next(), not just the first
+ *    'nlmsghdr' at skb->data.
+ *
+ * 2. The replies to one batch are packed into as few skbs as
+ *    possible: replies are appended to an NLMSG_GOODSIZE skb and
+ *    the skb is unicast only when the next reply does not fit, and
+ *    once more at the end of the batch. A batch of 200 requests is
+ *    answered with a handful of skbs instead of 200.
+ *
+ * 3. A request with NLM_F_ACK gets an NLMSG_ERROR message with
+ *    error 0 right after its reply, in the same reply skb, so acks
+ *    and replies arrive in request order. Every reply carries the
+ *    sequence number of its request.
+ *
+ *    ./netlink_userspace_app 200     <== 200 requests, one sendmsg
+ *
+ ********************************************************************
+ */
+
+/*
+ ********************************************************************
+ * Requests are processed in a workqueue, in order per sender       *
+ ********************************************************************
+ * 1. "hello_nl_recv_msg" runs in the context of the sending
+ *    process, inside its sendmsg(). It does no work there: it only
+ *    takes a reference on the sk_buff and queues it for the sender
+ *    (one 'hello_sender' per netlink portid).
+ *
+ * 2. Every sender has its own work item, queued once when its
+ *    first request arrives. The work drains the sender's queue in
+ *    order, packing the replies of all queued sk_buffs together,
+ *    and frees the sender once its last replies are sent and the
+ *    queue is still empty. A work item never runs twice at the same
+ *    time, so requests of one sender are answered in the order they
+ *    were sent, while the work items of different senders run in
+ *    parallel on any CPU.
+ *
+ * 3. A sender can have at most HELLO_NL_BACKLOG sk_buffs waiting.
+ *    When its backlog is full, "hello_nl_recv_msg" makes it wait in
+ *    sendmsg() until the work catches up, instead of queueing
+ *    without bound. A request that is dropped anyway (signal while
+ *    waiting, no memory, module unloading) still gets its ack, with
+ *    error -ENOBUFS, when it asked for one with NLM_F_ACK.
+ *
+ ********************************************************************
+ */
+
+/*
+ ********************************************************************
+ * Reply sk_buffs come from a per-CPU cache                         *
+ ********************************************************************
+ * 1. Every CPU keeps HELLO_REPLY_CACHE_SIZE sk_buffs allocated
+ *    ahead of time. "hello_reply_alloc" takes one from the cache of
+ *    the CPU it runs on, so answering a request does not go to the
+ *    slab allocator. A work item on that CPU refills the cache when
+ *    it runs low.
+ *
+ * 2. The cached sk_buffs are sized for the common case, one request
+ *    answered with its reply and ack (HELLO_REPLY_CACHE_PAYLOAD).
+ *    They are small on purpose: netlink_unicast() trims an sk_buff
+ *    that is more than half empty by reallocating its head, which
+ *    would bring the allocation back.
+ *
+ * 3. So the first reply sk_buff of a batch comes from the cache and
+ *    the following ones, for batches of many requests, are
+ *    NLMSG_GOODSIZE sk_buffs from nlmsg_new() as before.
+ *
+ ********************************************************************
+ */
+
 #include <linux/module.h>
 #include <net/sock.h>
 #include <linux/netlink.h>
 #include <linux/skbuff.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
 
 
 #define NETLINK_USER 31
+/* Type of the reply messages, the first non control message type */
+#define NETLINK_HELLO_REPLY NLMSG_MIN_TYPE
+
+/* sk_buffs a sender may have waiting for the workqueue */
+#define HELLO_NL_BACKLOG 256
+
 struct sock *netlink_socket = NULL;
 
-static void hello_nl_recv_msg(struct sk_buff *skb) {
-    struct nlmsghdr *nlh;
-    int pid;
-    struct sk_buff *skb_out;
-    int msg_size;
-    char *msg="Hello..This is neelkanth from kernel driver module...";
+#define HELLO_REPLY_CACHE_PAYLOAD  128
+#define HELLO_REPLY_CACHE_SIZE     32  /* skbs per CPU */
+#define HELLO_REPLY_CACHE_LOW      8   /* refill below this */
+
+struct hello_reply_cache {
+    struct sk_buff_head skbs;
+    struct work_struct refill;
+    int cpu;
+};
+
+static DEFINE_PER_CPU(struct hello_reply_cache, hello_reply_cache);
+
+static void hello_reply_cache_refill(struct work_struct *work)
+{
+    struct hello_reply_cache *cache =
+        container_of(work, struct hello_reply_cache, refill);
+    struct sk_buff *skb;
+
+    while (skb_queue_len_lockless(&cache->skbs) < HELLO_REPLY_CACHE_SIZE) {
+        skb = nlmsg_new(HELLO_REPLY_CACHE_PAYLOAD, GFP_KERNEL);
+        if (!skb)
+            break;
+        skb_queue_tail(&cache->skbs, skb);
+    }
+}
+
+/*
+ * Reply skb for a message of 'payload' bytes. The cache of the current
+ * CPU is used; being migrated right after picking it is harmless, the
+ * queue has its own lock.
+ */
+static struct sk_buff *hello_reply_alloc(int payload)
+{
+    struct hello_reply_cache *cache = raw_cpu_ptr(&hello_reply_cache);
+    struct sk_buff *skb;
+
+    if (payload > HELLO_REPLY_CACHE_PAYLOAD)
+        return nlmsg_new(payload, GFP_KERNEL);
+
+    skb = skb_dequeue(&cache->skbs);
+    if (skb_queue_len_lockless(&cache->skbs) < HELLO_REPLY_CACHE_LOW)
+        queue_work_on(cache->cpu, system_wq, &cache->refill);
+    if (!skb)
+        skb = nlmsg_new(payload, GFP_KERNEL);
+    return skb;
+}
+
+static void hello_reply_cache_init(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct hello_reply_cache *cache = per_cpu_ptr(&hello_reply_cache, cpu);
+
+        skb_queue_head_init(&cache->skbs);
+        INIT_WORK(&cache->refill, hello_reply_cache_refill);
+        cache->cpu = cpu;
+        hello_reply_cache_refill(&cache->refill);
+    }
+}
+
+/* Called once nothing can take a reply skb anymore */
+static void hello_reply_cache_destroy(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct hello_reply_cache *cache = per_cpu_ptr(&hello_reply_cache, cpu);
+
+        cancel_work_sync(&cache->refill);
+        skb_queue_purge(&cache->skbs);
+    }
+}
+
+/*
+ * Requests of one sender not processed yet. It exists from the first
+ * request until its work finds the queue empty, so 'work' is queued
+ * exactly once in its lifetime.
+ */
+struct hello_sender {
+    struct hlist_node node;     /* in hello_senders */
+    u32 portid;
+    struct sk_buff_head queue;
+    struct work_struct work;
+};
+
+static struct workqueue_struct *hello_wq;
+static DEFINE_HASHTABLE(hello_senders, 6);
+/* protects hello_senders, the queues of the senders and hello_stopping */
+static DEFINE_SPINLOCK(hello_senders_lock);
+static bool hello_stopping;
+/* senders waiting for room in their backlog */
+static DECLARE_WAIT_QUEUE_HEAD(hello_backlog_wait);
+
+/*
+ * Replies to one batch of requests, all for the same sender.
+ */
+struct hello_batch {
+    struct sk_buff *skb;    /* replies not sent yet */
+    u32 portid;
+    int replies;
+    int skbs;
+};
+
+/* Send the replies collected so far */
+static void hello_batch_flush(struct hello_batch *batch)
+{
     int res;
 
-    printk(KERN_INFO "Entering: %s\n", __FUNCTION__);
+    if (!batch->skb)
+        return;
+
+    /* Send a Unicast message to userspace process over netlink socket */
+    res = nlmsg_unicast(netlink_socket, batch->skb, batch->portid);
+    if (res < 0) {
+        printk(KERN_INFO "Error while sending bak to user\n");
+    }
+    batch->skb = NULL;
+    batch->skbs++;
+}
+
+/*
+ * Reserve room for one message of 'payload' bytes in the batch,
+ * flushing the current reply skb first when it is full.
+ */
+static struct nlmsghdr *hello_batch_put(struct hello_batch *batch,
+                                        const struct nlmsghdr *req,
+                                        int type, int payload, int flags)
+{
+    struct nlmsghdr *nlh;
+
+    if (batch->skb && skb_tailroom(batch->skb) < nlmsg_total_size(payload))
+        hello_batch_flush(batch);
+
+    if (!batch->skb) {
+        /* Create new message, from the cache for the first one */
+        if (!batch->skbs)
+            batch->skb = hello_reply_alloc(payload);
+        else
+            batch->skb = nlmsg_new(max_t(size_t, payload, NLMSG_GOODSIZE), GFP_KERNEL);
+        if (!batch->skb) {
+            printk(KERN_ERR "Failed to allocate new skb\n");
+            return NULL;
+        }
+        NETLINK_CB(batch->skb).dst_group = 0; /* not in mcast group */
+    }
+
+    nlh = nlmsg_put(batch->skb, 0, req->nlmsg_seq, type, payload, flags);
+    if (nlh)
+        batch->replies++;
+    return nlh;
+}
+
+/*
+ * Handle one request: print it and queue the reply, plus an ack
+ * when the sender asked for one.
+ */
+static void hello_nl_handle_msg(struct hello_batch *batch, struct nlmsghdr *nlh)
+{
+    char *msg="Hello..This is neelkanth from kernel driver module...";
+    int msg_size = strlen(msg);
+    struct nlmsghdr *reply;
+    struct nlmsgerr *ack;
 
-    /* Read the message content from 'sk_buff' structure */
-    /*
-     * Message received from User space process via Net link socket 
-     */
-    nlh = (struct nlmsghdr*)skb->data;
     /*
      * Print the message received from the user space process over NL socket
      */
-    printk(KERN_INFO "Netlink received msg payload(from userspace):%s\n",
-            (char*)nlmsg_data(nlh));
-    pid = nlh->nlmsg_pid; /*pid of sending process */
-    printk("PID of userspace process from which message is received: %d\n", pid);
+    printk(KERN_DEBUG "Netlink received msg payload(from userspace):%.*s\n",
+            (int)strnlen(nlmsg_data(nlh), nlmsg_len(nlh)), (char*)nlmsg_data(nlh));
+
+    /* write the message content into 'sk_buff' structure */
+    reply = hello_batch_put(batch, nlh, NETLINK_HELLO_REPLY, msg_size, 0);
+    if (!reply)
+        return;
+    memcpy(nlmsg_data(reply), msg, msg_size);
 
+    if (!(nlh->nlmsg_flags & NLM_F_ACK))
+        return;
+
+    /* ack with the request header only, as with NETLINK_CAP_ACK */
+    reply = hello_batch_put(batch, nlh, NLMSG_ERROR, sizeof(*ack), NLM_F_CAPPED);
+    if (!reply)
+        return;
+    ack = nlmsg_data(reply);
+    ack->error = 0;
+    memcpy(&ack->msg, nlh, sizeof(*nlh));
+}
+
+/*
+ * Handle every request of one skb received from the sender.
+ */
+static void hello_nl_process(struct hello_batch *batch, struct sk_buff *skb)
+{
+    struct nlmsghdr *nlh;
+    int len;
 
     /*
-     * Message sent from Kernel driver to Userspace process over Netlink socket
+     * Message received from User space process via Net link socket.
+     * Walk every message of the skb, not only the first one.
      */
-    msg_size=strlen(msg);
-    /* Create new message using Netlink msg new API */
-    skb_out = nlmsg_new(msg_size, 0);
-    if (!skb_out) {
-        printk(KERN_ERR "Failed to allocate new skb\n");
+    nlh = nlmsg_hdr(skb);
+    len = skb->len;
+    while (nlmsg_ok(nlh, len)) {
+        /* control messages (NOOP, ERROR, DONE, ...) are not requests */
+        if (nlh->nlmsg_type == 0 || nlh->nlmsg_type >= NLMSG_MIN_TYPE)
+            hello_nl_handle_msg(batch, nlh);
+        nlh = nlmsg_next(nlh, &len);
+    }
+}
+
+/*
+ * Work of one sender: answer its queued skbs in order, then free the
+ * sender once nothing is left. The replies are flushed while the
+ * sender is still hashed: a request arriving meanwhile is queued here
+ * and seen by the loop, rather than going to a new sender whose work
+ * could answer it first on another CPU. The sender is unhashed only
+ * under the lock, after the flush, with an empty queue.
+ */
+static void hello_sender_work(struct work_struct *work)
+{
+    struct hello_sender *sender = container_of(work, struct hello_sender, work);
+    struct hello_batch batch = { .portid = sender->portid };
+    struct sk_buff *skb;
+    int requests = 0;
+    bool wake;
+
+    while (1) {
+        spin_lock_bh(&hello_senders_lock);
+        skb = __skb_dequeue(&sender->queue);
+        if (!skb && !batch.skb) {
+            hash_del(&sender->node);
+            spin_unlock_bh(&hello_senders_lock);
+            break;
+        }
+        if (!skb) {
+            /* nothing left for now: send the replies, then look again */
+            spin_unlock_bh(&hello_senders_lock);
+            hello_batch_flush(&batch);
+            continue;
+        }
+        wake = skb_queue_len(&sender->queue) == HELLO_NL_BACKLOG - 1;
+        spin_unlock_bh(&hello_senders_lock);
+
+        if (wake)
+            wake_up_all(&hello_backlog_wait);
+        hello_nl_process(&batch, skb);
+        consume_skb(skb);
+        requests++;
+    }
+
+    printk(KERN_INFO "PID of userspace process from which message is received: %d,"
+           " %d skbs, %d replies in %d skbs\n", batch.portid, requests,
+           batch.replies, batch.skbs);
+    kfree(sender);
+}
+
+/* Called with hello_senders_lock held */
+static struct hello_sender *hello_sender_find(u32 portid)
+{
+    struct hello_sender *sender;
+
+    hash_for_each_possible(hello_senders, sender, node, portid)
+        if (sender->portid == portid)
+            return sender;
+    return NULL;
+}
+
+/*
+ * Queue 'skb' on 'sender', or on 'new' (hashing it and queueing its
+ * work) when the sender has nothing pending. Called with
+ * hello_senders_lock held. Returns 1 when 'new' is now in use, 0 when
+ * 'skb' went to an existing sender and -ENOBUFS when it could not be
+ * queued: it is then left to the caller, to drop outside the lock.
+ */
+static int hello_sender_queue(struct hello_sender *sender,
+                              struct hello_sender *new, struct sk_buff *skb)
+{
+    if (hello_stopping || (sender ? skb_queue_len(&sender->queue) >=
+                                    HELLO_NL_BACKLOG : !new))
+        return -ENOBUFS;
+
+    if (!sender) {
+        sender = new;
+        hash_add(hello_senders, &sender->node, sender->portid);
+        queue_work(hello_wq, &sender->work);
+    }
+    __skb_queue_tail(&sender->queue, skb);
+    return sender == new;
+}
+
+static bool hello_sender_has_room(u32 portid)
+{
+    struct hello_sender *sender;
+    bool room;
+
+    spin_lock_bh(&hello_senders_lock);
+    sender = hello_sender_find(portid);
+    room = hello_stopping || !sender ||
+           skb_queue_len(&sender->queue) < HELLO_NL_BACKLOG;
+    spin_unlock_bh(&hello_senders_lock);
+    return room;
+}
+
+/*
+ * Drop a received skb that could not be queued. Its requests are not
+ * answered, but those asking for an ack get one with -ENOBUFS, so the
+ * sender does not wait for it forever.
+ */
+static void hello_nl_drop(struct sk_buff *skb)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr(skb);
+    int len = skb->len;
+
+    printk_ratelimited(KERN_INFO "Dropping request of PID %u\n",
+                       NETLINK_CB(skb).portid);
+
+    while (nlmsg_ok(nlh, len)) {
+        if ((nlh->nlmsg_type == 0 || nlh->nlmsg_type >= NLMSG_MIN_TYPE) &&
+            (nlh->nlmsg_flags & NLM_F_ACK))
+            netlink_ack(skb, nlh, -ENOBUFS, NULL);
+        nlh = nlmsg_next(nlh, &len);
+    }
+    kfree_skb(skb);
+}
+
+static void hello_nl_recv_msg(struct sk_buff *skb) {
+    u32 portid = NETLINK_CB(skb).portid;
+    struct hello_sender *sender, *new;
+    int res;
+
+    /* netlink frees 'skb' when we return, keep it for the work */
+    skb = skb_get(skb);
+
+    /* a full backlog makes the sender wait here, in its sendmsg() */
+    if (wait_event_interruptible(hello_backlog_wait,
+                                 hello_sender_has_room(portid))) {
+        hello_nl_drop(skb);
         return;
     }
-    /* write the message content into 'sk_buff' structure */
-    nlh = nlmsg_put(skb_out, 0, 0, NLMSG_DONE, msg_size, 0); 
-    NETLINK_CB(skb_out).dst_group = 0; /* not in mcast group */
-    strncpy(nlmsg_data(nlh), msg, msg_size);
-    /* Send a Unicast message to userspace process over netlink socket */
-    res = nlmsg_unicast(netlink_socket, skb_out, pid);
-    if (res < 0) {
-        printk(KERN_INFO "Error while sending bak to user\n");
+
+    spin_lock_bh(&hello_senders_lock);
+    sender = hello_sender_find(portid);
+    if (sender || hello_stopping) {
+        res = hello_sender_queue(sender, NULL, skb);
+        spin_unlock_bh(&hello_senders_lock);
+        if (res < 0)
+            hello_nl_drop(skb);
+        return;
     }
+    spin_unlock_bh(&hello_senders_lock);
 
-    return;
+    /* first request pending from this sender, allocate it unlocked */
+    new = kzalloc(sizeof(*new), GFP_KERNEL);
+    if (new) {
+        new->portid = portid;
+        skb_queue_head_init(&new->queue);
+        INIT_WORK(&new->work, hello_sender_work);
+    }
+
+    spin_lock_bh(&hello_senders_lock);
+    sender = hello_sender_find(portid);
+    res = hello_sender_queue(sender, new, skb);
+    spin_unlock_bh(&hello_senders_lock);
+    if (res != 1)
+        kfree(new);
+    if (res < 0)
+        hello_nl_drop(skb);
 }
 
 /*
@@ -135,10 +543,18 @@ static int __init hello_init(void)
         .input = hello_nl_recv_msg,
     };
 
+    /* Unbound: the work of each sender may run on any CPU */
+    hello_wq = alloc_workqueue("hello_nl", WQ_UNBOUND, 0);
+    if (!hello_wq)
+        return -ENOMEM;
+    hello_reply_cache_init();
+
     /* Create netlink socket in the kernel driver */
     netlink_socket = netlink_kernel_create(&init_net, NETLINK_USER, &cfg);
     if (!netlink_socket) {
         printk(KERN_ALERT "Error creating socket.\n");
+        destroy_workqueue(hello_wq);
+        hello_reply_cache_destroy();
         return -10;
     }
 
@@ -151,7 +567,16 @@ static int __init hello_init(void)
 static void __exit hello_exit(void)
 {
     printk(KERN_INFO "exiting hello module\n");
+
+    /* no new requests, then let the senders still queued finish */
+    spin_lock_bh(&hello_senders_lock);
+    hello_stopping = true;
+    spin_unlock_bh(&hello_senders_lock);
+    wake_up_all(&hello_backlog_wait);
+    destroy_workqueue(hello_wq);
+
     netlink_kernel_release(netlink_socket);
+    hello_reply_cache_destroy();
 
     return;
 }
@@ -6,97 +6,77 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "nl_client.h"
 
 #define NETLINK_USER 31
+/* Type of the replies, see netlinkKernel.c */
+#define NETLINK_HELLO_REPLY NLMSG_MIN_TYPE
 
 #define MAX_PAYLOAD 1024 /* maximum payload size*/
-struct sockaddr_nl src_addr, dest_addr;
-struct nlmsghdr *nlh = NULL;
-struct iovec iov;
-int sock_fd = 0;
-struct msghdr msg;
+#define MAX_BATCH   1024 /* maximum requests per sendmsg */
+static struct nl_client nl;
 
-int main(void)
+int main(int argc, char **argv)
 {
-    memset(&src_addr, 0, sizeof(src_addr));
-    memset(&dest_addr, 0, sizeof(dest_addr));
+    /* number of requests to send in one sendmsg, 1 by default */
+    int count = argc > 1 ? atoi(argv[1]) : 1;
+    int payload = strlen("This is neelkanth from userspace") + 1;
+    int i, len, replies = 0, acks = 0;
+    struct nlmsghdr *nlh;
+
+    if (count < 1 || count > MAX_BATCH) {
+        printf("count must be between 1 and %d\n", MAX_BATCH);
+        return -1;
+    }
 
     printf("My process ID: %d\n", getpid());
 
-    /* 
+    /*
      * Create a netlink socket for communicating with kernel
-     * driver module.
+     * driver module, bound to a port of its own. Requests go
+     * to the kernel (port 0) as unicast messages.
      */
-    sock_fd=socket(PF_NETLINK, SOCK_RAW, NETLINK_USER);
-    if (sock_fd < 0) {
+    if (nl_client_open(&nl, NETLINK_USER) < 0) {
         return -1;
     }
 
-    /*
-     * Set the parameters of netlink socket for sending unicast
-     * message to linux kernel.  
-     */
-    src_addr.nl_family = AF_NETLINK;
-    /* self pid */
-    src_addr.nl_pid = getpid();   
-    dest_addr.nl_family = AF_NETLINK;
-    /* For Linux Kernel, PID will be 0 */
-    dest_addr.nl_pid = 0;     
-     /* 
-      * For unicast message to Linux Kernel driver, 
-      * set the below to 0 
-      */
-    dest_addr.nl_groups = 0; 
-
-    /*  
-     * Bind 'src addr' to netlink socket.  
-     */
-    bind(sock_fd, (struct sockaddr*)&src_addr, sizeof(src_addr));
-
     /*
      * Build netlink message Header from userspace process
-     * to linux kernel driver Module. 
+     * to linux kernel driver Module.
+     * "count" messages are laid out back to back in the send buffer,
+     * each asking for an ack, and go to the kernel in a single sendmsg.
      */
-    nlh = (struct nlmsghdr *)malloc(NLMSG_SPACE(MAX_PAYLOAD));
-    memset(nlh, 0, NLMSG_SPACE(MAX_PAYLOAD));
-    nlh->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
-    nlh->nlmsg_pid = getpid();
-    nlh->nlmsg_flags = 0;
-
-    strcpy(NLMSG_DATA(nlh), "This is neelkanth from userspace");
-
-    #if 0
-    Build Final Message header.
-     
-    struct msghdr {
-       void             __user *msg_name;    /* ptr to socket address structure */
-       int              msg_namelen;         /* size of socket address structure */
-       struct iovec     __user *msg_iov;     /* scatter/gather array */
-       __kernel_size_t  msg_iovlen;          /* # elements in msg_iov */
-       void             __user *msg_control; /* ancillary data */
-       __kernel_size_t  msg_controllen;      /* ancillary data buffer length */
-    unsigned int        msg_flags;           /* flags on received message */
-
-    };
-
-    #endif
-
-    iov.iov_base = (void *)nlh;
-    iov.iov_len = nlh->nlmsg_len;
-    msg.msg_name = (void *)&dest_addr;
-    msg.msg_namelen = sizeof(dest_addr);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    for (i = 0; i < count; i++) {
+        nlh = nl_client_msg(&nl, 0, NLM_F_REQUEST | NLM_F_ACK, payload);
+        strcpy(NLMSG_DATA(nlh), "This is neelkanth from userspace");
+    }
 
     /* Send Message to Kernel */
     printf("Sending message to kernel\n");
-    sendmsg(sock_fd, &msg, 0);
+    nl_client_send(&nl);
 
-    /* Read message from kernel */
+    /*
+     * Read messages from kernel. The replies come back packed, many
+     * per recvmsg, each followed by the ack of its request.
+     */
     printf("Waiting for message from kernel\n");
-    recvmsg(sock_fd, &msg, 0);
-    printf("Received message payload: %s\n", (char *)NLMSG_DATA(nlh));
-    close(sock_fd);
+    while (acks < count) {
+        if (nl_client_recv(&nl) < 0)
+            break;
+
+        nl_client_for_each_msg(&nl, nlh, len) {
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                acks++;
+            } else if (nlh->nlmsg_type == NETLINK_HELLO_REPLY) {
+                if (!replies++)
+                    printf("Received message payload: %.*s\n",
+                           (int)(nlh->nlmsg_len - NLMSG_HDRLEN),
+                           (char *)NLMSG_DATA(nlh));
+            }
+        }
+    }
+    printf("%d requests, %d replies, %d acks\n", count, replies, acks);
+    nl_client_close(&nl);
 
     return 0;
 }
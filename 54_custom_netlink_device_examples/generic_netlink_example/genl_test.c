@@ -0,0 +1,248 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <net/genetlink.h>
+
+#include "genl_test.h"
+
+/*
+ * The same kind of echo service as the unicast and multicast examples, but
+ * on a generic netlink family instead of a raw protocol number. Every
+ * command describes its attributes in an nla_policy, so the genetlink core
+ * checks types, lengths and ranges (and reports the offending attribute
+ * through the extended ack) before any handler runs: a message is never
+ * walked with strlen() or trusted to be NUL terminated.
+ *
+ * GENL_TEST_CMD_BATCH carries many ECHO/SET/GET operations in one request
+ * and answers them in one reply, so a client pays one syscall and one skb
+ * in each direction for the whole batch instead of one per operation.
+ *
+ * The family is not parallel_ops: the genetlink core serializes all
+ * handlers, which is what protects the value table.
+ */
+
+static u32 genl_test_values[GENL_TEST_TABLE_SIZE];
+
+/* Attributes of one operation, on its own or inside GENL_TEST_A_OPS */
+static const struct nla_policy genl_test_op_policy[GENL_TEST_A_CMD + 1] = {
+  [GENL_TEST_A_MSG]   = { .type = NLA_NUL_STRING, .len = GENL_TEST_MSG_MAX - 1 },
+  [GENL_TEST_A_KEY]   = NLA_POLICY_MAX(NLA_U32, GENL_TEST_TABLE_SIZE - 1),
+  [GENL_TEST_A_VALUE] = { .type = NLA_U32 },
+  [GENL_TEST_A_CMD]   = NLA_POLICY_RANGE(NLA_U8, GENL_TEST_CMD_ECHO,
+                                         GENL_TEST_CMD_GET),
+};
+
+static const struct nla_policy genl_test_policy[GENL_TEST_A_MAX + 1] = {
+  [GENL_TEST_A_MSG]   = { .type = NLA_NUL_STRING, .len = GENL_TEST_MSG_MAX - 1 },
+  [GENL_TEST_A_KEY]   = NLA_POLICY_MAX(NLA_U32, GENL_TEST_TABLE_SIZE - 1),
+  [GENL_TEST_A_VALUE] = { .type = NLA_U32 },
+  [GENL_TEST_A_OPS]   = NLA_POLICY_NESTED_ARRAY(genl_test_op_policy),
+};
+
+/*
+ * A result entry holds the CMD of its operation, an ERROR and at most one
+ * u32 more than the operation sent (GET gets KEY and VALUE back, ECHO gets
+ * its own MSG back), so it is never more than this larger than the entry
+ * it answers.
+ */
+#define GENL_TEST_RESULT_EXTRA  (2 * nla_total_size(sizeof(u32)))
+
+static struct genl_family genl_test_family;
+
+/*
+ * Run one operation whose attributes are in "tb" and put its reply
+ * attributes in "msg". "nest" is the OPS entry the attributes came from,
+ * NULL for a plain command. Returns 0 or -errno.
+ */
+static int genl_test_do_op(u8 cmd, const struct nlattr *nest,
+                           struct nlattr **tb, struct sk_buff *msg,
+                           struct netlink_ext_ack *extack)
+{
+  u32 key;
+
+  switch (cmd) {
+  case GENL_TEST_CMD_ECHO:
+    if (NL_REQ_ATTR_CHECK(extack, nest, tb, GENL_TEST_A_MSG))
+      return -EINVAL;
+    return nla_put_string(msg, GENL_TEST_A_MSG, nla_data(tb[GENL_TEST_A_MSG]));
+
+  case GENL_TEST_CMD_SET:
+    if (NL_REQ_ATTR_CHECK(extack, nest, tb, GENL_TEST_A_KEY) ||
+        NL_REQ_ATTR_CHECK(extack, nest, tb, GENL_TEST_A_VALUE))
+      return -EINVAL;
+    key = nla_get_u32(tb[GENL_TEST_A_KEY]);
+    genl_test_values[key] = nla_get_u32(tb[GENL_TEST_A_VALUE]);
+    return 0;
+
+  case GENL_TEST_CMD_GET:
+    if (NL_REQ_ATTR_CHECK(extack, nest, tb, GENL_TEST_A_KEY))
+      return -EINVAL;
+    key = nla_get_u32(tb[GENL_TEST_A_KEY]);
+    if (nla_put_u32(msg, GENL_TEST_A_KEY, key) ||
+        nla_put_u32(msg, GENL_TEST_A_VALUE, genl_test_values[key]))
+      return -EMSGSIZE;
+    return 0;
+  }
+
+  NL_SET_ERR_MSG(extack, "unknown operation");
+  return -EOPNOTSUPP;
+}
+
+/* ECHO, SET and GET on their own: one operation, one reply (or ack) */
+static int genl_test_doit(struct sk_buff *skb, struct genl_info *info)
+{
+  u8 cmd = info->genlhdr->cmd;
+  struct sk_buff *msg;
+  void *hdr;
+  int err;
+
+  if (cmd == GENL_TEST_CMD_SET)
+    return genl_test_do_op(cmd, NULL, info->attrs, NULL, info->extack);
+
+  msg = genlmsg_new(nla_total_size(GENL_TEST_MSG_MAX), GFP_KERNEL);
+  if (!msg)
+    return -ENOMEM;
+
+  hdr = genlmsg_put_reply(msg, info, &genl_test_family, 0, cmd);
+  if (!hdr) {
+    nlmsg_free(msg);
+    return -EMSGSIZE;
+  }
+
+  err = genl_test_do_op(cmd, NULL, info->attrs, msg, info->extack);
+  if (err) {
+    nlmsg_free(msg);
+    return err;
+  }
+
+  genlmsg_end(msg, hdr);
+  return genlmsg_reply(msg, info);
+}
+
+/*
+ * BATCH: run every entry of OPS in order and answer with one RESULTS
+ * entry each. An operation that fails does not stop the batch; its error
+ * is in its result. The policy has already validated every entry, so a
+ * malformed batch is refused as a whole before anything runs.
+ */
+static int genl_test_batch(struct sk_buff *skb, struct genl_info *info)
+{
+  struct nlattr *tb[GENL_TEST_A_CMD + 1];
+  struct nlattr *ops, *op, *results, *result;
+  struct sk_buff *msg;
+  int count = 0, failed = 0, rem, err;
+  void *hdr;
+
+  if (GENL_REQ_ATTR_CHECK(info, GENL_TEST_A_OPS))
+    return -EINVAL;
+  ops = info->attrs[GENL_TEST_A_OPS];
+
+  nla_for_each_nested(op, ops, rem)
+    count++;
+  if (count > GENL_TEST_BATCH_MAX) {
+    NL_SET_ERR_MSG_ATTR(info->extack, ops, "too many operations");
+    return -E2BIG;
+  }
+
+  msg = genlmsg_new(nla_total_size(nla_len(ops)) +
+                    count * GENL_TEST_RESULT_EXTRA, GFP_KERNEL);
+  if (!msg)
+    return -ENOMEM;
+
+  hdr = genlmsg_put_reply(msg, info, &genl_test_family, 0,
+                          GENL_TEST_CMD_BATCH);
+  if (!hdr)
+    goto nospace;
+  results = nla_nest_start(msg, GENL_TEST_A_RESULTS);
+  if (!results)
+    goto nospace;
+
+  nla_for_each_nested(op, ops, rem) {
+    u8 cmd = 0;
+
+    err = nla_parse_nested(tb, GENL_TEST_A_CMD, op, genl_test_op_policy,
+                           NULL);
+    if (!err && tb[GENL_TEST_A_CMD])
+      cmd = nla_get_u8(tb[GENL_TEST_A_CMD]);
+
+    result = nla_nest_start(msg, nla_type(op));
+    if (!result || nla_put_u8(msg, GENL_TEST_A_CMD, cmd))
+      goto nospace;
+    if (!err)
+      err = genl_test_do_op(cmd, op, tb, msg, NULL);
+    if (err) {
+      /* drop whatever the failed operation managed to put */
+      nlmsg_trim(msg, nla_data(result) + nla_total_size(sizeof(u8)));
+      failed++;
+    }
+    if (nla_put_s32(msg, GENL_TEST_A_ERROR, err))
+      goto nospace;
+    nla_nest_end(msg, result);
+  }
+
+  nla_nest_end(msg, results);
+  genlmsg_end(msg, hdr);
+
+  pr_debug("genl_test: Batch of %d operations from portid %u, %d failed\n",
+           count, info->snd_portid, failed);
+
+  return genlmsg_reply(msg, info);
+
+nospace:
+  /* cannot happen with the size computed above */
+  nlmsg_free(msg);
+  return -EMSGSIZE;
+}
+
+static const struct genl_small_ops genl_test_ops[] = {
+  {
+    .cmd  = GENL_TEST_CMD_ECHO,
+    .doit = genl_test_doit,
+  },
+  {
+    .cmd  = GENL_TEST_CMD_SET,
+    .doit = genl_test_doit,
+  },
+  {
+    .cmd  = GENL_TEST_CMD_GET,
+    .doit = genl_test_doit,
+  },
+  {
+    .cmd  = GENL_TEST_CMD_BATCH,
+    .doit = genl_test_batch,
+  },
+};
+
+static struct genl_family genl_test_family __ro_after_init = {
+  .name          = GENL_TEST_FAMILY_NAME,
+  .version       = GENL_TEST_VERSION,
+  .maxattr       = GENL_TEST_A_MAX,
+  .policy        = genl_test_policy,
+  .module        = THIS_MODULE,
+  .small_ops     = genl_test_ops,
+  .n_small_ops   = ARRAY_SIZE(genl_test_ops),
+};
+
+static int __init genl_test_init(void)
+{
+  int err;
+
+  printk(KERN_INFO "genl_test: Init module\n");
+
+  err = genl_register_family(&genl_test_family);
+  if (err)
+    printk(KERN_ALERT "genl_test: Error registering family %s: %d\n",
+           GENL_TEST_FAMILY_NAME, err);
+  return err;
+}
+
+static void __exit genl_test_exit(void)
+{
+  printk(KERN_INFO "genl_test: Exit module\n");
+
+  genl_unregister_family(&genl_test_family);
+}
+
+module_init(genl_test_init);
+module_exit(genl_test_exit);
+
+MODULE_LICENSE("GPL");
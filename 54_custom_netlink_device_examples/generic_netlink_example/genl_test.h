@@ -0,0 +1,51 @@
+/*
+ * Generic netlink family "genl_test", shared by the kernel module
+ * (genl_test.c) and the userspace program (genl_user.c).
+ *
+ * Commands and the attributes they take:
+ *
+ *   GENL_TEST_CMD_ECHO     MSG                 -> MSG
+ *   GENL_TEST_CMD_SET      KEY, VALUE          -> (ack)
+ *   GENL_TEST_CMD_GET      KEY                 -> KEY, VALUE
+ *   GENL_TEST_CMD_BATCH    OPS                 -> RESULTS
+ *
+ * OPS nests one attribute per operation (its type is the index of the
+ * operation), each holding CMD plus the attributes of that command.
+ * RESULTS nests one attribute per operation, in the same order, each
+ * holding CMD, ERROR and the reply attributes of the command. The
+ * whole batch is one request and one reply message.
+ */
+#ifndef GENL_TEST_H
+#define GENL_TEST_H
+
+#define GENL_TEST_FAMILY_NAME   "genl_test"
+#define GENL_TEST_VERSION       1
+
+#define GENL_TEST_MSG_MAX       256     /* bytes, NUL included */
+#define GENL_TEST_TABLE_SIZE    1024    /* keys are 0 .. size - 1 */
+#define GENL_TEST_BATCH_MAX     1024    /* operations per batch */
+
+enum {
+  GENL_TEST_CMD_UNSPEC,
+  GENL_TEST_CMD_ECHO,
+  GENL_TEST_CMD_SET,
+  GENL_TEST_CMD_GET,
+  GENL_TEST_CMD_BATCH,
+  __GENL_TEST_CMD_MAX,
+};
+#define GENL_TEST_CMD_MAX (__GENL_TEST_CMD_MAX - 1)
+
+enum {
+  GENL_TEST_A_UNSPEC,
+  GENL_TEST_A_MSG,        /* NUL terminated string */
+  GENL_TEST_A_KEY,        /* u32 */
+  GENL_TEST_A_VALUE,      /* u32 */
+  GENL_TEST_A_CMD,        /* u8, inside OPS and RESULTS entries */
+  GENL_TEST_A_ERROR,      /* s32, 0 or -errno, inside RESULTS entries */
+  GENL_TEST_A_OPS,        /* nested array */
+  GENL_TEST_A_RESULTS,    /* nested array */
+  __GENL_TEST_A_MAX,
+};
+#define GENL_TEST_A_MAX (__GENL_TEST_A_MAX - 1)
+
+#endif /* GENL_TEST_H */
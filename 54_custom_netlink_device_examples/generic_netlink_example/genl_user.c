@@ -0,0 +1,324 @@
+/*
+ * Userspace side of the genl_test generic netlink family.
+ *
+ *     ./genl_user echo <message>
+ *     ./genl_user set <key> <value>
+ *     ./genl_user get <key>
+ *     ./genl_user batch <n>     n SET/GET/ECHO operations in one request
+ *     ./genl_user bench <n>     n GET requests, then one BATCH of n GETs
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "genl_test.h"
+
+#define BUF_SIZE (128 * 1024)
+
+static char buf[BUF_SIZE];
+static char req_buf[BUF_SIZE];
+static int nl_seq;
+
+static struct nlmsghdr *init_req(int type, int cmd, int version)
+{
+  struct nlmsghdr *nlh = (struct nlmsghdr *)req_buf;
+  struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+  memset(nlh, 0, NLMSG_LENGTH(GENL_HDRLEN));
+  nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+  nlh->nlmsg_type = type;
+  nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  nlh->nlmsg_seq = ++nl_seq;
+  genl->cmd = cmd;
+  genl->version = version;
+  return nlh;
+}
+
+static struct nlattr *add_attr(struct nlmsghdr *nlh, int type, const void *data, int len)
+{
+  struct nlattr *nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+  nla->nla_type = type;
+  nla->nla_len = NLA_HDRLEN + len;
+  if (len)
+    memcpy((char *)nla + NLA_HDRLEN, data, len);
+  nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+  return nla;
+}
+
+/* Nests are opened as an empty attribute and closed once filled */
+static struct nlattr *nest_start(struct nlmsghdr *nlh, int type)
+{
+  return add_attr(nlh, type, NULL, 0);
+}
+
+static void nest_end(struct nlmsghdr *nlh, struct nlattr *nest)
+{
+  nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+static struct nlattr *next_attr(struct nlattr *nla, int *rem)
+{
+  *rem -= NLA_ALIGN(nla->nla_len);
+  return (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+}
+
+#define for_each_attr(nla, start, len, rem) \
+  for (nla = (struct nlattr *)(start), rem = (len); \
+       rem >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= rem; \
+       nla = next_attr(nla, &rem))
+
+#define ATTR_DATA(nla)  ((void *)((char *)(nla) + NLA_HDRLEN))
+#define ATTR_LEN(nla)   ((int)(nla)->nla_len - NLA_HDRLEN)
+
+/*
+ * Send the request in req_buf and read the replies until the ACK. "cb"
+ * is called for every other message. Returns the ACK's error.
+ */
+static int talk(int fd, void (*cb)(struct nlmsghdr *, void *), void *arg)
+{
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+  struct nlmsghdr *req = (struct nlmsghdr *)req_buf;
+
+  if (sendto(fd, req, req->nlmsg_len, 0, (struct sockaddr *)&kernel,
+             sizeof(kernel)) < 0)
+    return -errno;
+
+  while (1) {
+    int len = recv(fd, buf, sizeof(buf), 0);
+    struct nlmsghdr *nlh;
+
+    if (len < 0)
+      return -errno;
+
+    for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_type == NLMSG_ERROR)
+        return ((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+      if (cb)
+        cb(nlh, arg);
+    }
+  }
+}
+
+#define GENL_ATTRS(nlh) ((char *)NLMSG_DATA(nlh) + GENL_HDRLEN)
+#define GENL_ATTRLEN(nlh) ((int)(nlh)->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN))
+
+static void family_cb(struct nlmsghdr *nlh, void *arg)
+{
+  struct nlattr *nla;
+  int rem;
+
+  for_each_attr(nla, GENL_ATTRS(nlh), GENL_ATTRLEN(nlh), rem)
+    if (nla->nla_type == CTRL_ATTR_FAMILY_ID)
+      *(int *)arg = *(__u16 *)ATTR_DATA(nla);
+}
+
+static int resolve_family(int fd)
+{
+  struct nlmsghdr *nlh = init_req(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+  int id = 0;
+
+  add_attr(nlh, CTRL_ATTR_FAMILY_NAME, GENL_TEST_FAMILY_NAME,
+           strlen(GENL_TEST_FAMILY_NAME) + 1);
+  if (talk(fd, family_cb, &id) < 0 || !id)
+    return -1;
+  return id;
+}
+
+/* Print the reply attributes of one operation */
+static void print_attrs(void *start, int len)
+{
+  struct nlattr *nla;
+  int rem;
+
+  for_each_attr(nla, start, len, rem) {
+    switch (nla->nla_type) {
+    case GENL_TEST_A_MSG:
+      printf(" msg \"%.*s\"", ATTR_LEN(nla), (char *)ATTR_DATA(nla));
+      break;
+    case GENL_TEST_A_KEY:
+      printf(" key %u", *(__u32 *)ATTR_DATA(nla));
+      break;
+    case GENL_TEST_A_VALUE:
+      printf(" value %u", *(__u32 *)ATTR_DATA(nla));
+      break;
+    case GENL_TEST_A_ERROR:
+      if (*(__s32 *)ATTR_DATA(nla))
+        printf(" error %s", strerror(-*(__s32 *)ATTR_DATA(nla)));
+      break;
+    }
+  }
+  printf("\n");
+}
+
+static void reply_cb(struct nlmsghdr *nlh, void *arg)
+{
+  (void)arg;
+  printf("Received from kernel:");
+  print_attrs(GENL_ATTRS(nlh), GENL_ATTRLEN(nlh));
+}
+
+static const char *op_names[] = {
+  [GENL_TEST_CMD_ECHO] = "echo",
+  [GENL_TEST_CMD_SET]  = "set",
+  [GENL_TEST_CMD_GET]  = "get",
+};
+
+/* One line per RESULTS entry; "arg" counts them when not NULL */
+static void batch_cb(struct nlmsghdr *nlh, void *arg)
+{
+  struct nlattr *results, *result, *nla;
+  int rem, rrem, arem;
+
+  for_each_attr(results, GENL_ATTRS(nlh), GENL_ATTRLEN(nlh), rem) {
+    if (results->nla_type != GENL_TEST_A_RESULTS)
+      continue;
+    for_each_attr(result, ATTR_DATA(results), ATTR_LEN(results), rrem) {
+      if (arg) {
+        (*(int *)arg)++;
+        continue;
+      }
+      printf("%4u:", result->nla_type);
+      for_each_attr(nla, ATTR_DATA(result), ATTR_LEN(result), arem)
+        if (nla->nla_type == GENL_TEST_A_CMD &&
+            *(__u8 *)ATTR_DATA(nla) <= GENL_TEST_CMD_GET)
+          printf(" %s", op_names[*(__u8 *)ATTR_DATA(nla)] ?: "?");
+      print_attrs(ATTR_DATA(result), ATTR_LEN(result));
+    }
+  }
+}
+
+static const int batch_mix[] = {
+  GENL_TEST_CMD_SET, GENL_TEST_CMD_GET, GENL_TEST_CMD_ECHO,
+};
+
+/* Add operation i of a batch, on key i */
+static void add_op(struct nlmsghdr *nlh, int i, int cmd)
+{
+  struct nlattr *op = nest_start(nlh, i);
+  __u32 key = i % GENL_TEST_TABLE_SIZE, value = i * 10;
+  __u8 c = cmd;
+
+  add_attr(nlh, GENL_TEST_A_CMD, &c, sizeof(c));
+  if (cmd == GENL_TEST_CMD_ECHO)
+    add_attr(nlh, GENL_TEST_A_MSG, "ping", sizeof("ping"));
+  else
+    add_attr(nlh, GENL_TEST_A_KEY, &key, sizeof(key));
+  if (cmd == GENL_TEST_CMD_SET)
+    add_attr(nlh, GENL_TEST_A_VALUE, &value, sizeof(value));
+  nest_end(nlh, op);
+}
+
+static double now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void usage(void)
+{
+  printf("usage: genl_user echo <message>\n"
+         "       genl_user set <key> <value>\n"
+         "       genl_user get <key>\n"
+         "       genl_user batch <n>\n"
+         "       genl_user bench <n>\n");
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_nl self = { .nl_family = AF_NETLINK };
+  struct nlmsghdr *nlh;
+  struct nlattr *ops;
+  int fd, family, err, i, n;
+
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&self, sizeof(self)) < 0) {
+    printf("netlink socket: %s\n", strerror(errno));
+    return 1;
+  }
+
+  family = resolve_family(fd);
+  if (family < 0) {
+    printf("generic netlink family %s not found, is genl_test.ko loaded?\n",
+           GENL_TEST_FAMILY_NAME);
+    return 1;
+  }
+
+  n = atoi(argv[2]);
+  if (!strcmp(argv[1], "echo")) {
+    nlh = init_req(family, GENL_TEST_CMD_ECHO, GENL_TEST_VERSION);
+    add_attr(nlh, GENL_TEST_A_MSG, argv[2], strlen(argv[2]) + 1);
+    err = talk(fd, reply_cb, NULL);
+  } else if (!strcmp(argv[1], "set") && argc == 4) {
+    __u32 key = strtoul(argv[2], NULL, 0), value = strtoul(argv[3], NULL, 0);
+
+    nlh = init_req(family, GENL_TEST_CMD_SET, GENL_TEST_VERSION);
+    add_attr(nlh, GENL_TEST_A_KEY, &key, sizeof(key));
+    add_attr(nlh, GENL_TEST_A_VALUE, &value, sizeof(value));
+    err = talk(fd, NULL, NULL);
+  } else if (!strcmp(argv[1], "get")) {
+    __u32 key = strtoul(argv[2], NULL, 0);
+
+    nlh = init_req(family, GENL_TEST_CMD_GET, GENL_TEST_VERSION);
+    add_attr(nlh, GENL_TEST_A_KEY, &key, sizeof(key));
+    err = talk(fd, reply_cb, NULL);
+  } else if (!strcmp(argv[1], "batch") && n > 0 && n <= GENL_TEST_BATCH_MAX) {
+    nlh = init_req(family, GENL_TEST_CMD_BATCH, GENL_TEST_VERSION);
+    ops = nest_start(nlh, GENL_TEST_A_OPS);
+    for (i = 0; i < n; i++)
+      add_op(nlh, i, batch_mix[i % 3]);
+    nest_end(nlh, ops);
+    err = talk(fd, batch_cb, NULL);
+  } else if (!strcmp(argv[1], "bench") && n > 0 && n <= GENL_TEST_BATCH_MAX) {
+    double start = now_us(), single, batch;
+    int results = 0;
+
+    for (i = 0, err = 0; i < n && !err; i++) {
+      __u32 key = i;
+
+      nlh = init_req(family, GENL_TEST_CMD_GET, GENL_TEST_VERSION);
+      add_attr(nlh, GENL_TEST_A_KEY, &key, sizeof(key));
+      err = talk(fd, NULL, NULL);
+    }
+    single = now_us() - start;
+
+    if (!err) {
+      start = now_us();
+      nlh = init_req(family, GENL_TEST_CMD_BATCH, GENL_TEST_VERSION);
+      ops = nest_start(nlh, GENL_TEST_A_OPS);
+      for (i = 0; i < n; i++)
+        add_op(nlh, i, GENL_TEST_CMD_GET);
+      nest_end(nlh, ops);
+      err = talk(fd, batch_cb, &results);
+      batch = now_us() - start;
+    }
+    if (!err)
+      printf("%d GET requests: %.0f us, one BATCH of %d GETs: %.0f us\n",
+             n, single, results, batch);
+  } else {
+    usage();
+    return 1;
+  }
+
+  if (err) {
+    printf("%s: %s\n", argv[1], strerror(-err));
+    return 1;
+  }
+
+  close(fd);
+  return 0;
+}
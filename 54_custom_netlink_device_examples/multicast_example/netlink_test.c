@@ -2,9 +2,16 @@
 #include <linux/module.h>
 #include <linux/netlink.h>
 #include <linux/skbuff.h>
+#include <linux/hrtimer.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/sched.h>
+#include <linux/mm.h>
 
 #define MYPROTO NETLINK_USERSOCK
 #define MYGRP 17
+/* groups of the protocol, numbered from 1 */
+#define NL_GROUPS 32
 
 /*
  * In this project, we have 3 userspace processes and 1 kernel device driver.
@@ -29,47 +36,360 @@ which will then forward the message to all the subscribed processes, including t
 other two userspace processes.
  */
 
+/*
+ * Topics: every message belongs to a topic, chosen by its netlink header,
+ * type NLMSG_MIN_TYPE + topic, and goes to the multicast group of that
+ * topic only, MYGRP + topic. Topic 0 is MYGRP, and messages with a type
+ * out of range go there too. A subscriber joins the groups of the topics
+ * it wants and never sees the others: the kernel does not even queue
+ * them to its socket. A topic nobody listens to costs no copy and no
+ * skb at all.
+ */
+#define NL_TOPICS (NL_GROUPS - MYGRP + 1)
+#define NL_TOPIC_TYPE(topic) (NLMSG_MIN_TYPE + (topic))
+#define NL_TOPIC_GROUP(topic) (MYGRP + (topic))
+
+/*
+ * Events are not multicast one skb each. They are packed, one netlink
+ * message per event, into a batch skb of NLMSG_GOODSIZE per topic that
+ * goes out to the group when the next event does not fit, or at the
+ * latest flush_us microseconds after its first event (a soft hrtimer).
+ * Every subscriber then pays the delivery of one skb for many events,
+ * while no event waits longer than flush_us. With flush_us=0 every event
+ * is sent on its own.
+ */
+static unsigned int flush_us = 1000;
+module_param(flush_us, uint, 0644);
+MODULE_PARM_DESC(flush_us, "Longest time an event waits in a batch, in microseconds (0: no batching)");
+
+struct nl_batch {
+  struct sk_buff *skb;    /* batch being filled, NULL if none */
+  int events;
+  int topic;
+  struct hrtimer timer;   /* deadline of the batch being filled */
+};
+
+static struct nl_batch batches[NL_TOPICS];
+
+/* protects the batches, nl_stats and nl_stopping, orders the sends */
+static DEFINE_SPINLOCK(nl_lock);
+/* module unloading: nothing is batched or sent anymore */
+static bool nl_stopping;
+
+/*
+ * What became of the events sent to every group, in events (not skbs),
+ * shown in /proc/net/netlink_test_groups. nlmsg_multicast() reports one
+ * result per skb:
+ *
+ *   delivered     every subscriber got it
+ *   enobufs       the receive queue of at least one subscriber was full,
+ *                 that subscriber lost it (the others got it)
+ *   no_listener   nobody subscribed to the group
+ *
+ * nomem counts events lost before sending, throttled the times a
+ * producer was made to wait (see 'throttle'). Updated under nl_lock.
+ */
+struct nl_group_stats {
+  u64 batches;
+  u64 delivered;
+  u64 enobufs;
+  u64 no_listener;
+  u64 nomem;
+  u64 throttled;
+};
+
+static struct nl_group_stats nl_stats[NL_GROUPS + 1];
+
+/*
+ * With throttle=1, an overflowing subscriber makes the producers that
+ * can sleep wait before queueing more: nl_backoff_ms doubles on every
+ * ENOBUFS, from NL_BACKOFF_MIN_MS up to NL_BACKOFF_MAX_MS, and drops
+ * back to 0 once a batch reaches everybody. A producer that runs in the
+ * sender's sendmsg() (netlink_test_recv_msg) thus slows the sender down
+ * to what the subscribers can take. Producers that cannot sleep are
+ * never throttled.
+ */
+static bool throttle;
+module_param(throttle, bool, 0644);
+MODULE_PARM_DESC(throttle, "Make producers wait while subscribers overflow");
+
+#define NL_BACKOFF_MIN_MS 1
+#define NL_BACKOFF_MAX_MS 100
+
+static unsigned int nl_backoff_ms;
+static unsigned long nl_backoff_until;  /* jiffies */
+
 struct sock *nl_sock = NULL;
 
+/* Multicast 'skb' holding 'events' events to 'group', with nl_lock held */
+static void nl_group_send(struct sk_buff *skb, int group, int events)
+{
+  struct nl_group_stats *stats = &nl_stats[group];
+  int res;
+
+  res = nlmsg_multicast(nl_sock, skb, 0, group, GFP_ATOMIC);
+
+  stats->batches++;
+  if (!res) {
+    stats->delivered += events;
+    nl_backoff_ms = 0;
+  } else if (res == -ESRCH) {
+    stats->no_listener += events;
+  } else {
+    stats->enobufs += events;
+    nl_backoff_ms = clamp_t(unsigned int, nl_backoff_ms * 2, NL_BACKOFF_MIN_MS,
+                            NL_BACKOFF_MAX_MS);
+    WRITE_ONCE(nl_backoff_until, jiffies + msecs_to_jiffies(nl_backoff_ms));
+  }
+}
+
+/* Send the batch being filled, with nl_lock held */
+static void nl_batch_flush(struct nl_batch *batch)
+{
+  if (!batch->skb)
+    return;
+
+  nl_group_send(batch->skb, NL_TOPIC_GROUP(batch->topic), batch->events);
+
+  batch->skb = NULL;
+  batch->events = 0;
+  hrtimer_try_to_cancel(&batch->timer);
+}
+
+static enum hrtimer_restart nl_batch_timer(struct hrtimer *timer)
+{
+  struct nl_batch *batch = container_of(timer, struct nl_batch, timer);
+
+  spin_lock_bh(&nl_lock);
+  nl_batch_flush(batch);
+  spin_unlock_bh(&nl_lock);
+
+  return HRTIMER_NORESTART;
+}
+
+/*
+ * True when somebody subscribed to 'group'. If not, the events for it
+ * are only counted.
+ */
+static bool nl_group_listened(int group, int events)
+{
+  if (netlink_has_listeners(nl_sock, group))
+    return true;
+
+  spin_lock_bh(&nl_lock);
+  nl_stats[group].no_listener += events;
+  spin_unlock_bh(&nl_lock);
+  return false;
+}
+
+/* Wait while the subscribers are behind, at most one backoff period */
+static void nl_throttle_wait(int group)
+{
+  long delay = READ_ONCE(nl_backoff_until) - jiffies;
+
+  if (delay <= 0)
+    return;
+
+  spin_lock_bh(&nl_lock);
+  nl_stats[group].throttled++;
+  spin_unlock_bh(&nl_lock);
+
+  schedule_timeout_interruptible(delay);
+}
+
+/*
+ * Producer API: queue an event of 'len' bytes for the group of 'topic'.
+ * Can be called from any context but hard interrupts; 'gfp' tells
+ * whether the caller may sleep, as for an allocation. Returns 0 or
+ * -errno.
+ */
+static int netlink_test_event(int topic, const void *data, int len, gfp_t gfp)
+{
+  struct nl_batch *batch;
+  struct nlmsghdr *nlh;
+  int group, err = 0;
+
+  if (topic < 0 || topic >= NL_TOPICS)
+    return -EINVAL;
+  if (nlmsg_total_size(len) > NLMSG_GOODSIZE)
+    return -EMSGSIZE;
+
+  batch = &batches[topic];
+  group = NL_TOPIC_GROUP(topic);
+  if (!nl_group_listened(group, 1))
+    return 0;
+
+  if (throttle && gfpflags_allow_blocking(gfp))
+    nl_throttle_wait(group);
+
+  spin_lock_bh(&nl_lock);
+
+  if (nl_stopping) {
+    err = -ESHUTDOWN;
+    goto out;
+  }
+
+  if (batch->skb && skb_tailroom(batch->skb) < nlmsg_total_size(len))
+    nl_batch_flush(batch);
+
+  if (!batch->skb) {
+    batch->skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_ATOMIC);
+    if (!batch->skb) {
+      nl_stats[group].nomem++;
+      err = -ENOMEM;
+      goto out;
+    }
+    if (flush_us)
+      hrtimer_start(&batch->timer, us_to_ktime(flush_us), HRTIMER_MODE_REL_SOFT);
+  }
+
+  nlh = nlmsg_put(batch->skb, 0, 0, NL_TOPIC_TYPE(topic), len, 0);
+  memcpy(nlmsg_data(nlh), data, len);
+  batch->events++;
+
+  /* full, or not batching at all */
+  if (!flush_us || skb_tailroom(batch->skb) < nlmsg_total_size(1))
+    nl_batch_flush(batch);
+
+out:
+  spin_unlock_bh(&nl_lock);
+  return err;
+}
+
+/*
+ * Datagrams of at least zerocopy_min bytes are not copied into a batch:
+ * the skb that came from the sender is multicast as it is, every
+ * message in it, with the sender's netlink headers. Only a clone is
+ * made, which shares the data, and netlink_broadcast() clones it again
+ * per subscriber; no payload byte is copied whatever the fan-out.
+ * Shorter datagrams are cheap to copy and go through the batch.
+ */
+static unsigned int zerocopy_min = 256;
+module_param(zerocopy_min, uint, 0644);
+MODULE_PARM_DESC(zerocopy_min, "Datagrams of at least this many bytes are forwarded without copy");
+
+static int nl_forward(struct sk_buff *skb, int topic, gfp_t gfp)
+{
+  int group = NL_TOPIC_GROUP(topic);
+  struct sk_buff *out;
+
+  if (!nl_group_listened(group, 1))
+    return 0;
+
+  if (throttle && gfpflags_allow_blocking(gfp))
+    nl_throttle_wait(group);
+
+  /*
+   * Large datagrams have a vmalloc()ed head that only the netlink
+   * destructor of the original skb knows how to free, they cannot be
+   * cloned and need one copy.
+   */
+  if (is_vmalloc_addr(skb->head))
+    out = skb_copy(skb, gfp);
+  else
+    out = skb_clone(skb, gfp);
+
+  spin_lock_bh(&nl_lock);
+  if (nl_stopping) {
+    spin_unlock_bh(&nl_lock);
+    kfree_skb(out);
+    return -ESHUTDOWN;
+  }
+  if (!out) {
+    nl_stats[group].nomem++;
+    spin_unlock_bh(&nl_lock);
+    return -ENOMEM;
+  }
+
+  /* the control block still describes the sender, this comes from us */
+  memset(&NETLINK_CB(out), 0, sizeof(NETLINK_CB(out)));
+
+  /* keep the order: what is batched was queued before */
+  nl_batch_flush(&batches[topic]);
+  nl_group_send(out, group, 1);
+  spin_unlock_bh(&nl_lock);
+
+  return 0;
+}
+
 static void netlink_test_recv_msg(struct sk_buff *skb)
 {
-  struct sk_buff *skb_out;
   struct nlmsghdr *nlh;
   int msg_size;
+  int topic;
   char *msg;
   int pid;
   int res;
 
   nlh = (struct nlmsghdr *)skb->data;
+  /* the header and its length come from the sender */
+  if (!nlmsg_ok(nlh, skb->len)) {
+    printk_ratelimited(KERN_INFO "netlink_test: Dropping malformed message of %u bytes\n",
+                       skb->len);
+    return;
+  }
   pid = nlh->nlmsg_pid; /* pid of sending process */
-  msg = (char *)nlmsg_data(nlh);
-  msg_size = strlen(msg);
 
-  printk(KERN_INFO "netlink_test: Received from pid %d: %s\n", pid, msg);
+  /* the topic of the first message routes the whole datagram */
+  topic = nlh->nlmsg_type - NLMSG_MIN_TYPE;
+  if (topic < 0 || topic >= NL_TOPICS)
+    topic = 0;
 
-  // create reply
-  skb_out = nlmsg_new(msg_size, 0);
-  if (!skb_out) {
-    printk(KERN_ERR "netlink_test: Failed to allocate new skb\n");
+  if (skb->len >= zerocopy_min) {
+    pr_debug("netlink_test: Forwarding %u bytes from pid %d, topic %d\n",
+             skb->len, pid, topic);
+    res = nl_forward(skb, topic, GFP_KERNEL);
+    if (res < 0)
+      printk(KERN_INFO "netlink_test: Error while forwarding message to user: %d\n", res);
     return;
   }
 
-  // put received message into reply
-  nlh = nlmsg_put(skb_out, 0, 0, NLMSG_DONE, msg_size, 0);
-  //NETLINK_CB(skb_out).dst_group = MYGRP; /* in multicast group */
-  strncpy(nlmsg_data(nlh), msg, msg_size);
+  msg = (char *)nlmsg_data(nlh);
+  msg_size = strnlen(msg, nlmsg_len(nlh));
 
-  printk(KERN_INFO "netlink_test: Send %s\n", msg);
-  res = nlmsg_multicast(nl_sock, skb_out, 0, MYGRP, GFP_KERNEL);
+  pr_debug("netlink_test: Received from pid %d, topic %d: %.*s\n", pid, topic,
+           msg_size, msg);
 
+  // forward the received message to the group of its topic as an event
+  res = netlink_test_event(topic, msg, msg_size, GFP_KERNEL);
   if (res < 0)
-    printk(KERN_INFO "netlink_test: Error while sending skb to user\n");
+    printk(KERN_INFO "netlink_test: Error while queueing message for user: %d\n", res);
+}
+
+static int nl_stats_show(struct seq_file *m, void *v)
+{
+  int group;
+
+  seq_printf(m, "%-6s %12s %12s %12s %12s %12s %12s\n", "group", "batches",
+             "delivered", "enobufs", "no_listener", "nomem", "throttled");
+
+  spin_lock_bh(&nl_lock);
+  for (group = 1; group <= NL_GROUPS; group++) {
+    struct nl_group_stats *s = &nl_stats[group];
+
+    if (!s->batches && !s->no_listener && !s->nomem && !s->throttled)
+      continue;
+    seq_printf(m, "%-6d %12llu %12llu %12llu %12llu %12llu %12llu\n", group,
+               s->batches, s->delivered, s->enobufs, s->no_listener,
+               s->nomem, s->throttled);
+  }
+  spin_unlock_bh(&nl_lock);
+
+  return 0;
 }
 
 static int __init netlink_test_init(void)
 {
+  int topic;
+
   printk(KERN_INFO "netlink_test: Init module\n");
 
+  for (topic = 0; topic < NL_TOPICS; topic++) {
+    batches[topic].topic = topic;
+    hrtimer_init(&batches[topic].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    batches[topic].timer.function = nl_batch_timer;
+  }
+
   struct netlink_kernel_cfg cfg = {
     .input = netlink_test_recv_msg,
   };
@@ -80,14 +400,38 @@ static int __init netlink_test_init(void)
     return -10;
   }
 
+  if (!proc_create_single("netlink_test_groups", 0444, init_net.proc_net,
+                          nl_stats_show))
+    printk(KERN_INFO "netlink_test: Cannot create /proc/net/netlink_test_groups\n");
+
   return 0;
 }
 
 static void __exit netlink_test_exit(void)
 {
+  int topic;
+
   printk(KERN_INFO "netlink_test: Exit module\n");
 
+  remove_proc_entry("netlink_test_groups", init_net.proc_net);
+
+  /*
+   * Send what is still batched and, in the same critical section, stop
+   * producers: no batch is started and no timer armed after this.
+   */
+  spin_lock_bh(&nl_lock);
+  nl_stopping = true;
+  for (topic = 0; topic < NL_TOPICS; topic++)
+    nl_batch_flush(&batches[topic]);
+  spin_unlock_bh(&nl_lock);
+
   netlink_kernel_release(nl_sock);
+  /* a timer may still be running, flushing nothing */
+  for (topic = 0; topic < NL_TOPICS; topic++)
+    hrtimer_cancel(&batches[topic].timer);
+  /* nothing should remain, but do not leak it */
+  for (topic = 0; topic < NL_TOPICS; topic++)
+    kfree_skb(batches[topic].skb);
 }
 
 module_init(netlink_test_init);
@@ -5,9 +5,15 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
+#include <linux/filter.h>
+#include <arpa/inet.h>
+
+#include "nl_client.h"
 
 #define MYPROTO NETLINK_USERSOCK
 #define MYGRP 17
+/* topic t: messages of type NLMSG_MIN_TYPE + t, group MYGRP + t */
+#define NL_TOPICS 16
 
 #define MAX_PAYLOAD 1024  /* maximum payload size*/
 
@@ -34,102 +40,143 @@ which will then forward the message to all the subscribed processes, including t
 other two userspace processes.
  */
 
-void read_event(int sock)
+static struct nl_client nl;
+
+void read_event(struct nl_client *nl)
 {
-  struct sockaddr_nl nladdr;
-  struct msghdr msg;
-  struct iovec iov;
-  char buffer[65536];
-  int ret;
-
-  iov.iov_base = (void *) buffer;
-  iov.iov_len = sizeof(buffer);
-  msg.msg_name = (void *) &(nladdr);
-  msg.msg_namelen = sizeof(nladdr);
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
+  struct nlmsghdr *nlh;
+  int rem;
 
   printf("Listen for message...\n");
-  ret = recvmsg(sock, &msg, 0);
-  if (ret < 0)
+  if (nl_client_recv(nl) < 0)
       return;
 
-  char *payload = NLMSG_DATA((struct nlmsghdr *) &buffer);
-  printf("Received from kernel: %s\n", payload);
+  /* the kernel packs many messages into one datagram */
+  nl_client_for_each_msg(nl, nlh, rem)
+    printf("Received from kernel: %.*s\n", (int)NLMSG_PAYLOAD(nlh, 0),
+           (char *)NLMSG_DATA(nlh));
+}
+
+/*
+ * Let the kernel drop every datagram whose first message does not start
+ * with 'prefix' (1 to 4 bytes) before it is queued to the socket.
+ */
+static int attach_prefix_filter(int sock, const char *prefix)
+{
+  unsigned int value = 0, mask = 0;
+  int i, len = strlen(prefix);
+
+  if (len < 1 || len > 4) {
+    printf("filter prefix must be 1 to 4 bytes\n");
+    return -1;
+  }
+  /* BPF loads words most significant byte first */
+  for (i = 0; i < len; i++) {
+    value |= (unsigned char)prefix[i] << (24 - 8 * i);
+    mask |= 0xffU << (24 - 8 * i);
+  }
+
+  struct sock_filter code[] = {
+    /* payload of the first message, 0 (drop) if too short */
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NLMSG_HDRLEN),
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+
+  if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+    printf("setsockopt(SO_ATTACH_FILTER): %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-t topic]... [-p prefix] <message>\n"
+         "  -t topic   join the group of this topic (0 to %d), sends on the first,\n"
+         "             topic 0 by default\n"
+         "  -p prefix  only receive datagrams whose first message starts with prefix\n",
+         name, NL_TOPICS - 1);
 }
 
 int main(int argc, char **argv)
 {
-  struct sockaddr_nl src_addr;
-  struct sockaddr_nl dest_addr;
   struct nlmsghdr *nlh;
-  struct msghdr msg;
-  struct iovec iov;
-  int sock_fd;
+  int topics[NL_TOPICS];
+  int ntopics = 0;
+  char *prefix = NULL;
+  int opt;
   int rc;
-
-  if (argc != 2) {
-    printf("usage: %s <message>\n", argv[0]);
+  int i;
+
+  while ((opt = getopt(argc, argv, "t:p:")) != -1) {
+    switch (opt) {
+    case 't':
+      if (ntopics == NL_TOPICS || atoi(optarg) < 0 || atoi(optarg) >= NL_TOPICS) {
+        usage(argv[0]);
+        return 1;
+      }
+      topics[ntopics++] = atoi(optarg);
+      break;
+    case 'p':
+      prefix = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
     return 1;
   }
+  if (!ntopics)
+    topics[ntopics++] = 0;
 
-  sock_fd = socket(PF_NETLINK, SOCK_RAW, MYPROTO);
-  if (sock_fd < 0) {
-    printf("socket(): %s\n", strerror(errno));
+  rc = nl_client_open(&nl, MYPROTO);
+  if (rc < 0) {
+    printf("netlink socket: %s\n", strerror(-rc));
     return 1;
   }
 
-  memset(&src_addr, 0, sizeof(src_addr));
-  src_addr.nl_family = AF_NETLINK;
-  src_addr.nl_pid = getpid();  /* self pid */
-  //src_addr.nl_groups = 0;  /* not in mcast groups */
-  bind(sock_fd, (struct sockaddr*)&src_addr, sizeof(src_addr));
-
-  memset(&dest_addr, 0, sizeof(dest_addr));
-  dest_addr.nl_family = AF_NETLINK;
-  dest_addr.nl_pid = 0;   /* For Linux Kernel */
-
-  nlh = (struct nlmsghdr *)malloc(NLMSG_SPACE(MAX_PAYLOAD));
-
-  /* Fill the netlink message header */
-  nlh->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
-  nlh->nlmsg_pid = getpid();  /* self pid */
-  nlh->nlmsg_flags = 0;
-
-  /* Fill in the netlink message payload */
-  strcpy(NLMSG_DATA(nlh), argv[1]);
-
-  memset(&iov, 0, sizeof(iov));
-  iov.iov_base = (void *)nlh;
-  iov.iov_len = nlh->nlmsg_len;
-
-  memset(&msg, 0, sizeof(msg));
-  msg.msg_name = (void *)&dest_addr;
-  msg.msg_namelen = sizeof(dest_addr);
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
+  /* the topic, see netlink_test.c; the payload is built in place */
+  nlh = nl_client_msg(&nl, NLMSG_MIN_TYPE + topics[0], 0, MAX_PAYLOAD);
+  strncpy(NLMSG_DATA(nlh), argv[optind], MAX_PAYLOAD - 1);
+
+  for (i = 0; i < ntopics; i++) {
+    rc = nl_client_join(&nl, MYGRP + topics[i]);
+    if (rc < 0) {
+      printf("setsockopt(NETLINK_ADD_MEMBERSHIP): %s \n", strerror(-rc));
+      nl_client_close(&nl);
+      return 1;
+    }
+  }
 
-  int group = MYGRP;
-  if (setsockopt(sock_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
-    printf("setsockopt(NETLINK_ADD_MEMBERSHIP): %s \n", strerror(errno));
-    close(sock_fd);
+  if (prefix && attach_prefix_filter(nl.fd, prefix) < 0) {
+    nl_client_close(&nl);
     return 1;
   }
 
-  printf("Send to kernel: %s\n", argv[1]);
+  printf("Send to kernel: %s\n", argv[optind]);
 
-  rc = sendmsg(sock_fd, &msg, 0);
+  rc = nl_client_send(&nl);
   if (rc < 0) {
-    printf("sendmsg(): %s\n", strerror(errno));
-    close(sock_fd);
+    printf("sendmsg(): %s\n", strerror(-rc));
+    nl_client_close(&nl);
     return 1;
   }
 
   while (1) {
-    read_event(sock_fd);
+    read_event(&nl);
   }
 
-  close(sock_fd);
+  nl_client_close(&nl);
 
   return 0;
 }
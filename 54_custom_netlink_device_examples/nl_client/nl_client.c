@@ -0,0 +1,96 @@
+/*
+ * Small netlink client shared by the userspace examples, see nl_client.h.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "nl_client.h"
+
+int nl_client_open(struct nl_client *nl, int protocol)
+{
+  struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+  socklen_t addr_len = sizeof(addr);
+
+  nl->tx_len = 0;
+  nl->rx_len = 0;
+  nl->seq = 0;
+  nl->fd = socket(PF_NETLINK, SOCK_RAW, protocol);
+  if (nl->fd < 0)
+    return -errno;
+
+  /* nl_pid 0: the kernel picks the port, our pid when it is free */
+  if (bind(nl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      getsockname(nl->fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+    int err = -errno;
+
+    close(nl->fd);
+    nl->fd = -1;
+    return err;
+  }
+  nl->portid = addr.nl_pid;
+  return 0;
+}
+
+void nl_client_close(struct nl_client *nl)
+{
+  if (nl->fd >= 0)
+    close(nl->fd);
+  nl->fd = -1;
+}
+
+int nl_client_join(struct nl_client *nl, int group)
+{
+  if (setsockopt(nl->fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+                 sizeof(group)) < 0)
+    return -errno;
+  return 0;
+}
+
+struct nlmsghdr *nl_client_msg(struct nl_client *nl, __u16 type, __u16 flags,
+                               size_t payload)
+{
+  struct nlmsghdr *nlh;
+
+  if (payload > NL_CLIENT_TX_BUF ||
+      NLMSG_SPACE(payload) > NL_CLIENT_TX_BUF - nl->tx_len)
+    return NULL;
+
+  nlh = (struct nlmsghdr *)(nl->tx + nl->tx_len);
+  memset(nlh, 0, NLMSG_SPACE(payload));
+  nlh->nlmsg_len = NLMSG_LENGTH(payload);
+  nlh->nlmsg_type = type;
+  nlh->nlmsg_flags = flags;
+  nlh->nlmsg_seq = ++nl->seq;
+  nlh->nlmsg_pid = nl->portid;
+  nl->tx_len += NLMSG_SPACE(payload);
+  return nlh;
+}
+
+int nl_client_send(struct nl_client *nl)
+{
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+  size_t len = nl->tx_len;
+
+  nl->tx_len = 0;
+  if (sendto(nl->fd, nl->tx, len, 0, (struct sockaddr *)&kernel,
+             sizeof(kernel)) < 0)
+    return -errno;
+  return 0;
+}
+
+int nl_client_recv(struct nl_client *nl)
+{
+  ssize_t len;
+
+  nl->rx_len = 0;
+  /* MSG_TRUNC: the real length, to never walk a datagram cut short */
+  len = recv(nl->fd, nl->rx, sizeof(nl->rx), MSG_TRUNC);
+  if (len < 0)
+    return -errno;
+  if ((size_t)len > sizeof(nl->rx))
+    return -EMSGSIZE;
+  nl->rx_len = len;
+  return len;
+}
@@ -0,0 +1,76 @@
+/*
+ * Small netlink client shared by the userspace examples: nl_recv, nl_recv1
+ * and nl_send (multicast_example), nl_userspace_app (unicast_example) and
+ * netlink_userspace_app (51_Basic_netlink_userspace_kernel_device_driver).
+ *
+ * Nothing is allocated per message. A struct nl_client carries one send
+ * and one receive buffer, aligned for any netlink payload, that are
+ * reused for the life of the socket:
+ *
+ *     static struct nl_client nl;
+ *     struct nlmsghdr *nlh;
+ *     int rem;
+ *
+ *     nl_client_open(&nl, NETLINK_USERSOCK);
+ *     nlh = nl_client_msg(&nl, type, flags, payload_len);
+ *     memcpy(NLMSG_DATA(nlh), payload, payload_len);
+ *     nl_client_send(&nl);
+ *
+ *     nl_client_recv(&nl);
+ *     nl_client_for_each_msg(&nl, nlh, rem)
+ *       ...
+ *
+ * Messages are built in place, back to back in the send buffer, and go
+ * to the kernel in one datagram on nl_client_send(). Received messages
+ * are walked where they are, in the receive buffer, until the next
+ * nl_client_recv(). Functions return 0 (or a length) on success and
+ * -errno on failure.
+ */
+#ifndef NL_CLIENT_H
+#define NL_CLIENT_H
+
+#include <stddef.h>
+#include <linux/netlink.h>
+
+#define NL_CLIENT_TX_BUF 65536
+/* a whole datagram: multicast batches, dump skbs, packed replies */
+#define NL_CLIENT_RX_BUF 65536
+
+struct nl_client {
+  int fd;
+  __u32 portid;     /* our port, nlmsg_pid of what we send */
+  __u32 seq;        /* of the last message built */
+  size_t tx_len;    /* bytes built and not sent yet */
+  size_t rx_len;    /* bytes of the last datagram received */
+  /* 8 bytes so that __u64 payloads can be read in place */
+  char tx[NL_CLIENT_TX_BUF] __attribute__((aligned(8)));
+  char rx[NL_CLIENT_RX_BUF] __attribute__((aligned(8)));
+};
+
+/* Socket of 'protocol', bound to a port chosen by the kernel */
+int nl_client_open(struct nl_client *nl, int protocol);
+void nl_client_close(struct nl_client *nl);
+int nl_client_join(struct nl_client *nl, int group);
+
+/*
+ * Append a message with room for 'payload' bytes, zeroed, to the send
+ * buffer and return it, or NULL when it does not fit. The header is
+ * filled in, with the next sequence number.
+ */
+struct nlmsghdr *nl_client_msg(struct nl_client *nl, __u16 type, __u16 flags,
+                               size_t payload);
+
+/* Send every message built since the last call, as one datagram */
+int nl_client_send(struct nl_client *nl);
+
+/*
+ * Receive one datagram, returns its length. A datagram larger than the
+ * receive buffer is lost and gives -EMSGSIZE.
+ */
+int nl_client_recv(struct nl_client *nl);
+
+#define nl_client_for_each_msg(nl, nlh, rem) \
+  for (nlh = (struct nlmsghdr *)(nl)->rx, rem = (int)(nl)->rx_len; \
+       NLMSG_OK(nlh, rem); nlh = NLMSG_NEXT(nlh, rem))
+
+#endif /* NL_CLIENT_H */
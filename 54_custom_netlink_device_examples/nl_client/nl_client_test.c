@@ -0,0 +1,189 @@
+/*
+ * Self-check of nl_client, run by "make check":
+ *
+ *   1. messages are built in place, aligned, back to back, until the
+ *      send buffer is full
+ *   2. a datagram of several messages goes from one NETLINK_USERSOCK
+ *      socket to another and is walked in place
+ *   3. a datagram larger than the receive buffer is reported with
+ *      -EMSGSIZE, not walked half received
+ *   4. a round trip with the kernel: an RTM_GETLINK dump over
+ *      NETLINK_ROUTE, walked over all of its datagrams
+ *   5. a round trip with unicast_example/netlink_driver.ko, when it is
+ *      loaded
+ *
+ * Prints one line per check and exits with 1 when one fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "nl_client.h"
+
+#define NETLINK_TEST 17     /* unicast_example/netlink_driver.c */
+
+static struct nl_client a, b;
+static int failed;
+
+static void check(int ok, const char *what)
+{
+  printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok)
+    failed = 1;
+}
+
+/* Send what 'from' has built to the user socket 'to' */
+static int send_to(struct nl_client *from, struct nl_client *to)
+{
+  struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_pid = to->portid };
+  size_t len = from->tx_len;
+
+  from->tx_len = 0;
+  if (sendto(from->fd, from->tx, len, 0, (struct sockaddr *)&addr,
+             sizeof(addr)) < 0)
+    return -errno;
+  return 0;
+}
+
+static void test_build(void)
+{
+  struct nlmsghdr *nlh, *prev = NULL;
+  int n = 0, ok = 1;
+
+  while ((nlh = nl_client_msg(&a, NLMSG_MIN_TYPE, NLM_F_REQUEST, 100))) {
+    unsigned char *p = NLMSG_DATA(nlh);
+    int i;
+
+    if ((unsigned long)nlh % NLMSG_ALIGNTO ||
+        nlh->nlmsg_len != NLMSG_LENGTH(100) ||
+        nlh->nlmsg_type != NLMSG_MIN_TYPE ||
+        nlh->nlmsg_pid != a.portid ||
+        (prev && (nlh->nlmsg_seq != prev->nlmsg_seq + 1 ||
+                  (char *)nlh != (char *)prev + NLMSG_SPACE(100))))
+      ok = 0;
+    for (i = 0; i < 100; i++)
+      ok &= !p[i];
+    memset(p, 0xff, 100);   /* the next message must not see this */
+    prev = nlh;
+    n++;
+  }
+  check(ok && n == NL_CLIENT_TX_BUF / NLMSG_SPACE(100),
+        "messages built in place until the send buffer is full");
+  a.tx_len = 0;
+}
+
+static void test_user_round_trip(void)
+{
+  struct nlmsghdr *nlh;
+  int i, rem, n = 0, ok = 1;
+
+  for (i = 0; i < 3; i++) {
+    nlh = nl_client_msg(&a, NLMSG_MIN_TYPE + i, 0, sizeof(int));
+    memcpy(NLMSG_DATA(nlh), &i, sizeof(i));
+  }
+  if (send_to(&a, &b) < 0 || nl_client_recv(&b) < 0) {
+    check(0, "datagram of 3 messages between two sockets");
+    return;
+  }
+  nl_client_for_each_msg(&b, nlh, rem) {
+    ok &= nlh->nlmsg_type == NLMSG_MIN_TYPE + n &&
+          *(int *)NLMSG_DATA(nlh) == n;
+    n++;
+  }
+  check(ok && n == 3, "datagram of 3 messages between two sockets");
+}
+
+static void test_truncated(void)
+{
+  static char big[NL_CLIENT_RX_BUF + 4096];
+  struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_pid = b.portid };
+  struct nlmsghdr *nlh = (struct nlmsghdr *)big;
+  int rc;
+
+  nlh->nlmsg_len = sizeof(big);
+  nlh->nlmsg_type = NLMSG_MIN_TYPE;
+  if (sendto(a.fd, big, sizeof(big), 0, (struct sockaddr *)&addr,
+             sizeof(addr)) < 0) {
+    check(0, "datagram larger than the receive buffer");
+    return;
+  }
+  rc = nl_client_recv(&b);
+  check(rc == -EMSGSIZE && b.rx_len == 0,
+        "datagram larger than the receive buffer gives -EMSGSIZE");
+}
+
+static void test_kernel_dump(void)
+{
+  struct nl_client *nl = &a;
+  struct nlmsghdr *nlh;
+  int rem, links = 0, done = 0, err = 0;
+
+  nl_client_close(nl);
+  if (nl_client_open(nl, NETLINK_ROUTE) < 0) {
+    check(0, "RTM_GETLINK dump from the kernel");
+    return;
+  }
+  nl_client_msg(nl, RTM_GETLINK, NLM_F_REQUEST | NLM_F_DUMP,
+                sizeof(struct ifinfomsg));
+  if (nl_client_send(nl) < 0)
+    err = 1;
+  while (!err && !done) {
+    if (nl_client_recv(nl) < 0)
+      break;
+    nl_client_for_each_msg(nl, nlh, rem) {
+      if (nlh->nlmsg_type == NLMSG_DONE)
+        done = 1;
+      else if (nlh->nlmsg_type == NLMSG_ERROR)
+        err = 1;
+      else if (nlh->nlmsg_type == RTM_NEWLINK)
+        links++;
+    }
+  }
+  check(done && !err && links > 0, "RTM_GETLINK dump from the kernel");
+}
+
+static void test_unicast_echo(void)
+{
+  static const char text[] = "nl_client self-check";
+  struct nl_client *nl = &a;
+  struct nlmsghdr *nlh;
+  int rem, ok = 0;
+
+  nl_client_close(nl);
+  if (nl_client_open(nl, NETLINK_TEST) < 0) {
+    printf("skip echo through unicast_example/netlink_driver.ko, not loaded\n");
+    return;
+  }
+  nlh = nl_client_msg(nl, 0, 0, sizeof(text));
+  memcpy(NLMSG_DATA(nlh), text, sizeof(text));
+  if (nl_client_send(nl) == 0 && nl_client_recv(nl) > 0)
+    nl_client_for_each_msg(nl, nlh, rem)
+      ok |= nlh->nlmsg_type == NLMSG_DONE &&
+            NLMSG_PAYLOAD(nlh, 0) == strlen(text) &&
+            !memcmp(NLMSG_DATA(nlh), text, strlen(text));
+  check(ok, "echo through unicast_example/netlink_driver.ko");
+}
+
+int main(void)
+{
+  if (nl_client_open(&a, NETLINK_USERSOCK) < 0 ||
+      nl_client_open(&b, NETLINK_USERSOCK) < 0) {
+    printf("netlink socket: %s\n", strerror(errno));
+    return 1;
+  }
+
+  test_build();
+  test_user_round_trip();
+  test_truncated();
+  test_kernel_dump();
+  test_unicast_echo();
+
+  nl_client_close(&a);
+  nl_client_close(&b);
+  return failed;
+}
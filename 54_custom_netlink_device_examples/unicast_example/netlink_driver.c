@@ -2,9 +2,68 @@
 #include <linux/module.h>
 #include <linux/netlink.h>
 #include <linux/skbuff.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/notifier.h>
 
 #define NETLINK_TEST 17
 
+/*
+ * skbs a sender may have waiting for the workqueue. A sender that finds
+ * its backlog full sleeps in its sendmsg() until the work catches up.
+ */
+#define NETLINK_TEST_BACKLOG 256
+
+/*
+ * Credit flow control. A client that cannot afford to lose a reply sends
+ * a NETLINK_TEST_CREDIT message with a __u32 of 0 first; the kernel
+ * answers with a NETLINK_TEST_CREDIT message carrying the window, the
+ * number of echo replies it may have in flight to that client (0 when
+ * flow control could not be set up). From then on every echo reply takes
+ * one credit, and the client gives credits back with NETLINK_TEST_CREDIT
+ * messages carrying how many replies it has read. Without credits the
+ * requests stay queued until some are returned, instead of being
+ * answered into a full receive queue and lost. Opening again resets the
+ * window. History dumps are paced by the dump itself and take no credit.
+ *
+ * A window of replies only has to fit in the client's receive buffer,
+ * whatever the rate, so the window advertised on opening is cut down to
+ * what that buffer holds of echo replies of NETLINK_TEST_ECHO_MAX bytes.
+ * Longer echoes are not covered. Clients that never open keep the old
+ * behaviour.
+ */
+#define NETLINK_TEST_CREDIT     (NLMSG_MIN_TYPE + 1)
+#define NETLINK_TEST_ECHO_MAX   1024
+
+/*
+ * Every echoed message is also kept in a history table of the last
+ * 'history' messages. A request of type NETLINK_TEST_HISTORY with
+ * NLM_F_DUMP streams the table back, oldest first, one
+ * netlink_test_record per NLM_F_MULTI message and NLMSG_DONE at the end.
+ *
+ * The dump is resumable: netlink_dump_start() sends the first skb of
+ * records and the netlink core calls netlink_test_dump() for the next
+ * one each time the client has read enough to make room in its receive
+ * queue. So a table of any size goes out one skb at a time, at the pace
+ * of the reader, without building it in one buffer and without a round
+ * trip per record. The position in the table is kept in the callback
+ * context between calls. Records overwritten while a dump is in progress
+ * are skipped.
+ */
+#define NETLINK_TEST_HISTORY    NLMSG_MIN_TYPE
+#define NETLINK_TEST_RECORD_MSG 64
+
+struct netlink_test_record {
+    __u64 seq;                          /* of the message, from 0 */
+    __u32 pid;                          /* port of the sender */
+    __u32 len;                          /* of the whole message */
+    char msg[NETLINK_TEST_RECORD_MSG];  /* its first bytes, NUL padded */
+};
+
 /*
  * The nlmsghdr structure is used to send and receive Netlink messages 
  * between user-space and kernel-space processes in Linux. The Netlink 
@@ -40,41 +99,551 @@
  * through the kernel's network stack, both in transmission and reception.
  */
 
+/*
+ * The input callback runs inside the sendmsg() of the sending process.
+ * It only queues the skb on its sender (one netlink_test_sender per
+ * portid); the reply is built and sent by the sender's work item, on
+ * an unbound workqueue. A work item never runs concurrently with
+ * itself, so every sender is answered in order, while different
+ * senders are served in parallel on any CPU.
+ *
+ * History dumps are the exception: they are started right away, in
+ * the input callback, and then paced by the netlink core.
+ *
+ * A sender goes away when its queue is empty, unless it opened flow
+ * control: then its credits are kept until its socket is closed.
+ */
+struct netlink_test_sender {
+    struct hlist_node node;
+    u32 portid;
+    struct sk_buff_head queue;
+    struct work_struct work;    /* queued when there is something to do */
+    bool flow;                  /* opened credit flow control */
+    bool released;              /* socket closed, to be freed by the work */
+    unsigned int credits;       /* replies it may still get, with flow */
+    unsigned int window;        /* advertised when flow was opened */
+};
+
 struct sock *nl_sock = NULL;
 
-static void netlink_test_recv_msg(struct sk_buff *skb)
+static struct workqueue_struct *nl_wq;
+static DEFINE_HASHTABLE(nl_senders, 6);
+/* protects nl_senders, the sender queues and nl_stopping */
+static DEFINE_SPINLOCK(nl_senders_lock);
+static bool nl_stopping;
+/* senders waiting for room in their backlog */
+static DECLARE_WAIT_QUEUE_HEAD(nl_backlog_wait);
+
+static unsigned int window = 64;
+module_param(window, uint, 0444);
+MODULE_PARM_DESC(window, "Echo replies in flight per flow controlled client, up to 256 and to what its receive buffer holds");
+
+static unsigned int history = 16384;
+module_param(history, uint, 0444);
+MODULE_PARM_DESC(history, "Messages kept for the history dump, rounded up to a power of 2");
+
+static struct netlink_test_record *nl_history;
+static u64 nl_history_next;     /* seq of the next record */
+/* protects nl_history and nl_history_next */
+static DEFINE_SPINLOCK(nl_history_lock);
+
+/* Position of a dump, in the callback context */
+struct netlink_test_dump_ctx {
+    u64 next;   /* seq of the next record to send */
+    u64 end;    /* seq of the first record not to send */
+};
+
+/*
+ * Per-CPU cache of reply skbs, allocated ahead of time by a work item so
+ * that the echo path takes its reply skb without going to the slab
+ * allocator. The cached skbs have room for NL_REPLY_CACHE_PAYLOAD bytes,
+ * the common message; longer replies fall back to nlmsg_new(). They are
+ * kept small on purpose: netlink_unicast() trims an skb that is more than
+ * half empty by reallocating its head, which would bring the allocation
+ * back.
+ */
+#define NL_REPLY_CACHE_PAYLOAD  128
+#define NL_REPLY_CACHE_SIZE     32  /* skbs per CPU */
+#define NL_REPLY_CACHE_LOW      8   /* refill below this */
+
+struct nl_reply_cache {
+    struct sk_buff_head skbs;
+    struct work_struct refill;
+    int cpu;
+};
+
+static DEFINE_PER_CPU(struct nl_reply_cache, nl_reply_cache);
+
+static void nl_reply_cache_refill(struct work_struct *work)
+{
+    struct nl_reply_cache *cache =
+        container_of(work, struct nl_reply_cache, refill);
+    struct sk_buff *skb;
+
+    while (skb_queue_len_lockless(&cache->skbs) < NL_REPLY_CACHE_SIZE) {
+        skb = nlmsg_new(NL_REPLY_CACHE_PAYLOAD, GFP_KERNEL);
+        if (!skb)
+            break;
+        skb_queue_tail(&cache->skbs, skb);
+    }
+}
+
+/*
+ * Reply skb for a message of 'payload' bytes. The cache of the current
+ * CPU is used; being migrated right after picking it is harmless, the
+ * queue has its own lock.
+ */
+static struct sk_buff *nl_reply_alloc(int payload)
+{
+    struct nl_reply_cache *cache = raw_cpu_ptr(&nl_reply_cache);
+    struct sk_buff *skb;
+
+    if (payload > NL_REPLY_CACHE_PAYLOAD)
+        return nlmsg_new(payload, GFP_KERNEL);
+
+    skb = skb_dequeue(&cache->skbs);
+    if (skb_queue_len_lockless(&cache->skbs) < NL_REPLY_CACHE_LOW)
+        queue_work_on(cache->cpu, system_wq, &cache->refill);
+    if (!skb)
+        skb = nlmsg_new(payload, GFP_KERNEL);
+    return skb;
+}
+
+static void nl_reply_cache_init(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct nl_reply_cache *cache = per_cpu_ptr(&nl_reply_cache, cpu);
+
+        skb_queue_head_init(&cache->skbs);
+        INIT_WORK(&cache->refill, nl_reply_cache_refill);
+        cache->cpu = cpu;
+        nl_reply_cache_refill(&cache->refill);
+    }
+}
+
+/* Called once nothing can take a reply skb anymore */
+static void nl_reply_cache_destroy(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct nl_reply_cache *cache = per_cpu_ptr(&nl_reply_cache, cpu);
+
+        cancel_work_sync(&cache->refill);
+        skb_queue_purge(&cache->skbs);
+    }
+}
+
+static void netlink_test_record(u32 pid, const char *msg, int len)
+{
+    struct netlink_test_record *rec;
+
+    spin_lock_bh(&nl_history_lock);
+    rec = &nl_history[nl_history_next & (history - 1)];
+    rec->seq = nl_history_next++;
+    rec->pid = pid;
+    rec->len = len;
+    /* 'msg' is not NUL terminated, 'len' bounds it */
+    memset(rec->msg, 0, sizeof(rec->msg));
+    memcpy(rec->msg, msg, min_t(int, len, sizeof(rec->msg) - 1));
+    spin_unlock_bh(&nl_history_lock);
+}
+
+/* The dump covers what is in the table when it starts */
+static int netlink_test_dump_begin(struct netlink_callback *cb)
+{
+    struct netlink_test_dump_ctx *ctx = (void *)cb->ctx;
+
+    NL_ASSERT_DUMP_CTX_FITS(struct netlink_test_dump_ctx);
+
+    spin_lock_bh(&nl_history_lock);
+    ctx->end = nl_history_next;
+    ctx->next = ctx->end > history ? ctx->end - history : 0;
+    spin_unlock_bh(&nl_history_lock);
+    return 0;
+}
+
+/*
+ * Fill 'skb' with the next records. Returns the length of what was put,
+ * 0 once everything was sent, which makes the core send NLMSG_DONE.
+ */
+static int netlink_test_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+    struct netlink_test_dump_ctx *ctx = (void *)cb->ctx;
+    struct nlmsghdr *nlh;
+
+    spin_lock_bh(&nl_history_lock);
+    /* skip what was overwritten since the previous call */
+    if (nl_history_next - ctx->next > history)
+        ctx->next = nl_history_next - history;
+    for (; ctx->next < ctx->end; ctx->next++) {
+        nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+                        NETLINK_TEST_HISTORY, sizeof(struct netlink_test_record),
+                        NLM_F_MULTI);
+        if (!nlh)
+            break;
+        memcpy(nlmsg_data(nlh), &nl_history[ctx->next & (history - 1)],
+               sizeof(struct netlink_test_record));
+    }
+    spin_unlock_bh(&nl_history_lock);
+
+    return skb->len;
+}
+
+static void netlink_test_dump_start(struct sk_buff *skb, struct nlmsghdr *nlh)
+{
+    struct netlink_dump_control c = {
+        .start  = netlink_test_dump_begin,
+        .dump   = netlink_test_dump,
+        .module = THIS_MODULE,
+    };
+    int err;
+
+    /* -EINTR: the dump is running, the core ends it with NLMSG_DONE */
+    err = netlink_dump_start(nl_sock, skb, nlh, &c);
+    if (err != -EINTR)
+        netlink_ack(skb, nlh, err, NULL);
+}
+
+static bool netlink_test_is_dump(struct nlmsghdr *nlh)
+{
+    return nlh->nlmsg_type == NETLINK_TEST_HISTORY &&
+           (nlh->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP;
+}
+
+/* Answer one request of sender 'pid', returns whether an echo reply went out */
+static bool netlink_test_process(struct sk_buff *skb, u32 pid)
 {
     struct sk_buff *skb_out;
     struct nlmsghdr *nlh;
     int msg_size;
     char *msg;
-    int pid;
     int res;
 
     nlh = (struct nlmsghdr *)skb->data;
-    pid = nlh->nlmsg_pid; /* pid of sending process */
+
+    /* checked with nlmsg_ok() before it was queued */
     msg = (char *)nlmsg_data(nlh);
-    msg_size = strlen(msg);
+    msg_size = strnlen(msg, nlmsg_len(nlh));
 
-    printk(KERN_INFO "netlink_test: Received from pid %d: %s\n", pid, msg);
+    pr_debug("netlink_test: Received from pid %u: %s\n", pid, msg);
+    netlink_test_record(pid, msg, msg_size);
 
     // create reply
-    skb_out = nlmsg_new(msg_size, 0);
+    skb_out = nl_reply_alloc(msg_size);
     if (!skb_out) {
       printk(KERN_ERR "netlink_test: Failed to allocate new skb\n");
-      return;
+      return false;
     }
 
     // put received message into reply
     nlh = nlmsg_put(skb_out, 0, 0, NLMSG_DONE, msg_size, 0);
     NETLINK_CB(skb_out).dst_group = 0; /* not in mcast group */
-    strncpy(nlmsg_data(nlh), msg, msg_size);
+    memcpy(nlmsg_data(nlh), msg, msg_size);
 
-    printk(KERN_INFO "netlink_test: Send %s\n", msg);
+    pr_debug("netlink_test: Send %s\n", msg);
 
     res = nlmsg_unicast(nl_sock, skb_out, pid);
-    if (res < 0)
+    if (res < 0) {
       printk(KERN_INFO "netlink_test: Error while sending skb to user\n");
+      return false;
+    }
+    return true;
+}
+
+/* Called with nl_senders_lock held */
+static void netlink_test_kick(struct netlink_test_sender *sender)
+{
+    if (!nl_stopping)
+        queue_work(nl_wq, &sender->work);
+}
+
+/*
+ * Drain the queue of one sender in order, as far as its credits allow,
+ * and free the sender when nothing is left to keep. The sender is
+ * unhashed under the lock, and the work is only queued under the lock
+ * on hashed senders, so nothing can queue it again once it is freed.
+ */
+static void netlink_test_work(struct work_struct *work)
+{
+    struct netlink_test_sender *sender =
+        container_of(work, struct netlink_test_sender, work);
+    bool credit, wake, done = false;
+    struct sk_buff *skb;
+
+    while (1) {
+        spin_lock_bh(&nl_senders_lock);
+        skb = skb_peek(&sender->queue);
+        credit = skb && sender->flow;
+        if (credit && !sender->credits)
+            skb = NULL;     /* paused until credits come back */
+        if (!skb) {
+            done = !work_pending(&sender->work) &&
+                   (sender->released ||
+                    (!sender->flow && skb_queue_empty(&sender->queue)));
+            if (done)
+                hash_del(&sender->node);
+            spin_unlock_bh(&nl_senders_lock);
+            break;
+        }
+        __skb_unlink(skb, &sender->queue);
+        sender->credits -= credit;
+        wake = skb_queue_len(&sender->queue) == NETLINK_TEST_BACKLOG - 1;
+        spin_unlock_bh(&nl_senders_lock);
+
+        if (wake)
+            wake_up_all(&nl_backlog_wait);
+
+        if (!netlink_test_process(skb, sender->portid) && credit) {
+            /* nothing reached the client, it will not return this one */
+            spin_lock_bh(&nl_senders_lock);
+            sender->credits++;
+            spin_unlock_bh(&nl_senders_lock);
+        }
+        consume_skb(skb);
+    }
+
+    if (done) {
+        __skb_queue_purge(&sender->queue);
+        kfree(sender);
+    }
+}
+
+/* Called with nl_senders_lock held */
+static struct netlink_test_sender *netlink_test_find(u32 portid)
+{
+    struct netlink_test_sender *sender;
+
+    /* a released sender may share its portid with a new socket */
+    hash_for_each_possible(nl_senders, sender, node, portid)
+        if (sender->portid == portid && !sender->released)
+            return sender;
+    return NULL;
+}
+
+static struct netlink_test_sender *netlink_test_sender_new(u32 portid)
+{
+    struct netlink_test_sender *new;
+
+    new = kzalloc(sizeof(*new), GFP_KERNEL);
+    if (new) {
+        new->portid = portid;
+        skb_queue_head_init(&new->queue);
+        INIT_WORK(&new->work, netlink_test_work);
+    }
+    return new;
+}
+
+static bool netlink_test_has_room(u32 portid)
+{
+    struct netlink_test_sender *sender;
+    bool room;
+
+    spin_lock_bh(&nl_senders_lock);
+    sender = netlink_test_find(portid);
+    room = nl_stopping || !sender ||
+           skb_queue_len(&sender->queue) < NETLINK_TEST_BACKLOG;
+    spin_unlock_bh(&nl_senders_lock);
+    return room;
+}
+
+/*
+ * Queue 'skb' on 'sender', or on 'new' when the sender has nothing
+ * pending. Called with nl_senders_lock held, consumes 'skb'. Returns
+ * true when 'new' is now in use.
+ */
+static bool netlink_test_queue(struct netlink_test_sender *sender,
+                               struct netlink_test_sender *new,
+                               struct sk_buff *skb)
+{
+    if (nl_stopping || (sender ? skb_queue_len(&sender->queue) >=
+                                 NETLINK_TEST_BACKLOG : !new)) {
+        printk_ratelimited(KERN_INFO "netlink_test: Dropping request of pid %u\n",
+                           NETLINK_CB(skb).portid);
+        kfree_skb(skb);
+        return false;
+    }
+
+    if (!sender) {
+        sender = new;
+        hash_add(nl_senders, &sender->node, sender->portid);
+    }
+    __skb_queue_tail(&sender->queue, skb);
+    netlink_test_kick(sender);
+    return sender == new;
+}
+
+/*
+ * Window for a client whose socket is 'sk': the echo replies of up to
+ * NETLINK_TEST_ECHO_MAX bytes its receive buffer holds, slab rounding
+ * of their heads included, and at most the 'window' parameter.
+ */
+static unsigned int netlink_test_window(const struct sock *sk)
+{
+    unsigned int truesize;
+
+    truesize = roundup_pow_of_two(SKB_DATA_ALIGN(nlmsg_total_size(NETLINK_TEST_ECHO_MAX)) +
+                                  SKB_DATA_ALIGN(sizeof(struct skb_shared_info))) +
+               SKB_DATA_ALIGN(sizeof(struct sk_buff));
+    return clamp_t(unsigned int, READ_ONCE(sk->sk_rcvbuf) / truesize, 1, window);
+}
+
+/*
+ * NETLINK_TEST_CREDIT in 'skb': open flow control and advertise the
+ * window (0 credits), or give credits back. Handled right away, not
+ * queued, as the queue may be waiting for exactly these credits.
+ */
+static void netlink_test_credit(struct sk_buff *skb)
+{
+    struct netlink_test_sender *sender, *new = NULL;
+    u32 portid = NETLINK_CB(skb).portid;
+    struct nlmsghdr *nlh = nlmsg_hdr(skb);
+    unsigned int advertised = 0, open = 0;
+    struct sk_buff *skb_out;
+    u32 credits;
+
+    if (nlmsg_len(nlh) < sizeof(credits))
+        return;
+    credits = *(u32 *)nlmsg_data(nlh);
+
+    if (!credits) {
+        new = netlink_test_sender_new(portid);
+        /* the sending socket is alive for the whole input callback */
+        open = netlink_test_window(NETLINK_CB(skb).sk);
+    }
+
+    spin_lock_bh(&nl_senders_lock);
+    sender = netlink_test_find(portid);
+    if (!sender && new && !nl_stopping) {
+        sender = new;
+        new = NULL;
+        hash_add(nl_senders, &sender->node, sender->portid);
+    }
+    if (sender && !credits) {
+        sender->flow = true;
+        sender->credits = sender->window = advertised = open;
+        netlink_test_kick(sender);
+    } else if (sender && sender->flow) {
+        sender->credits = min(sender->credits + credits, sender->window);
+        netlink_test_kick(sender);
+    }
+    spin_unlock_bh(&nl_senders_lock);
+    kfree(new);
+
+    if (credits)
+        return;
+
+    skb_out = nlmsg_new(sizeof(advertised), GFP_KERNEL);
+    if (!skb_out)
+        return;
+    nlh = nlmsg_put(skb_out, 0, nlh->nlmsg_seq, NETLINK_TEST_CREDIT,
+                    sizeof(advertised), 0);
+    memcpy(nlmsg_data(nlh), &advertised, sizeof(advertised));
+    nlmsg_unicast(nl_sock, skb_out, portid);
+}
+
+static void netlink_test_recv_msg(struct sk_buff *skb)
+{
+    u32 portid = NETLINK_CB(skb).portid; /* port of sending process */
+    struct netlink_test_sender *sender, *new;
+
+    /* the header and its length come from the sender */
+    if (!nlmsg_ok(nlmsg_hdr(skb), skb->len)) {
+        printk_ratelimited(KERN_INFO "netlink_test: Dropping malformed message of pid %u\n",
+                           portid);
+        return;
+    }
+
+    if (nlmsg_hdr(skb)->nlmsg_type == NETLINK_TEST_CREDIT) {
+        netlink_test_credit(skb);
+        return;
+    }
+
+    /*
+     * Dumps are started here, while the sending socket is sure to be
+     * alive: the core looks at NETLINK_CB(skb).sk, on which the work
+     * would hold no reference. They need no queueing, the dump paces
+     * itself.
+     */
+    if (netlink_test_is_dump(nlmsg_hdr(skb))) {
+        netlink_test_dump_start(skb, nlmsg_hdr(skb));
+        return;
+    }
+
+    /* pause the sender rather than drop what it sends */
+    if (wait_event_interruptible(nl_backlog_wait, netlink_test_has_room(portid))) {
+        printk_ratelimited(KERN_INFO "netlink_test: Dropping request of pid %u\n",
+                           portid);
+        return;
+    }
+
+    /* netlink frees 'skb' when we return, the work needs it later */
+    skb = skb_get(skb);
+
+    spin_lock_bh(&nl_senders_lock);
+    sender = netlink_test_find(portid);
+    if (sender || nl_stopping) {
+        netlink_test_queue(sender, NULL, skb);
+        spin_unlock_bh(&nl_senders_lock);
+        return;
+    }
+    spin_unlock_bh(&nl_senders_lock);
+
+    new = netlink_test_sender_new(portid);
+
+    spin_lock_bh(&nl_senders_lock);
+    sender = netlink_test_find(portid);
+    if (!netlink_test_queue(sender, new, skb))
+        kfree(new);
+    spin_unlock_bh(&nl_senders_lock);
+}
+
+/* The client closed its socket, its credits and requests go with it */
+static int netlink_test_release(struct notifier_block *nb, unsigned long event,
+                                void *ptr)
+{
+    struct netlink_notify *n = ptr;
+    struct netlink_test_sender *sender;
+
+    if (event != NETLINK_URELEASE || n->protocol != NETLINK_TEST ||
+        !net_eq(n->net, &init_net))
+        return NOTIFY_DONE;
+
+    spin_lock_bh(&nl_senders_lock);
+    sender = netlink_test_find(n->portid);
+    if (sender) {
+        sender->released = true;
+        __skb_queue_purge(&sender->queue);
+        netlink_test_kick(sender);
+    }
+    spin_unlock_bh(&nl_senders_lock);
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block nl_notifier = {
+    .notifier_call = netlink_test_release,
+};
+
+/*
+ * Called once no work can run anymore: paused and flow controlled
+ * senders. The input callback may still be looking senders up, hence
+ * the lock; with nl_stopping set it adds none.
+ */
+static void netlink_test_free_senders(void)
+{
+    struct netlink_test_sender *sender;
+    struct hlist_node *tmp;
+    int bkt;
+
+    spin_lock_bh(&nl_senders_lock);
+    hash_for_each_safe(nl_senders, bkt, tmp, sender, node) {
+        hash_del(&sender->node);
+        __skb_queue_purge(&sender->queue);
+        kfree(sender);
+    }
+    spin_unlock_bh(&nl_senders_lock);
 }
 
 static int __init netlink_test_init(void)
@@ -85,9 +654,27 @@ static int __init netlink_test_init(void)
     .input = netlink_test_recv_msg,
   };
 
+  history = roundup_pow_of_two(max(history, 1U));
+  window = clamp_t(unsigned int, window, 1, NETLINK_TEST_BACKLOG);
+  nl_history = kvcalloc(history, sizeof(*nl_history), GFP_KERNEL);
+  if (!nl_history)
+    return -ENOMEM;
+
+  nl_wq = alloc_workqueue("netlink_test", WQ_UNBOUND, 0);
+  if (!nl_wq) {
+    kvfree(nl_history);
+    return -ENOMEM;
+  }
+  nl_reply_cache_init();
+  netlink_register_notifier(&nl_notifier);
+
   nl_sock = netlink_kernel_create(&init_net, NETLINK_TEST, &cfg);
   if (!nl_sock) {
     printk(KERN_ALERT "netlink_test: Error creating socket.\n");
+    netlink_unregister_notifier(&nl_notifier);
+    destroy_workqueue(nl_wq);
+    nl_reply_cache_destroy();
+    kvfree(nl_history);
     return -10;
   }
 
@@ -98,7 +685,19 @@ static void __exit netlink_test_exit(void)
 {
   printk(KERN_INFO "netlink_test: Exit module\n");
 
+  /* refuse new requests, finish the queued ones, then close */
+  spin_lock_bh(&nl_senders_lock);
+  nl_stopping = true;
+  spin_unlock_bh(&nl_senders_lock);
+  wake_up_all(&nl_backlog_wait);
+  netlink_unregister_notifier(&nl_notifier);
+  destroy_workqueue(nl_wq);
+  netlink_test_free_senders();
+
   netlink_kernel_release(nl_sock);
+  nl_reply_cache_destroy();
+  /* a dump in progress holds a reference on the module */
+  kvfree(nl_history);
 }
 
 module_init(netlink_test_init);
@@ -3,91 +3,232 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <linux/netlink.h>
 
+#include "nl_client.h"
+
 #define MAX_PAYLOAD 1024  /* maximum payload size */
 #define NETLINK_TEST 17
 
+/* history dump, see netlink_driver.c */
+#define NETLINK_TEST_HISTORY    NLMSG_MIN_TYPE
+#define NETLINK_TEST_RECORD_MSG 64
+
+struct netlink_test_record {
+  __u64 seq;
+  __u32 pid;
+  __u32 len;
+  char msg[NETLINK_TEST_RECORD_MSG];
+};
+
+/* credit flow control, see netlink_driver.c */
+#define NETLINK_TEST_CREDIT     (NLMSG_MIN_TYPE + 1)
+
+static struct nl_client nl;
+
+/*
+ * Ask for the history of echoed messages and print it. The kernel
+ * streams it in as many datagrams as needed, each one produced when
+ * the previous one was read, and ends with NLMSG_DONE. Dump skbs are
+ * up to 32 KiB, the receive buffer of nl_client takes them whole.
+ */
+static int dump_history(struct nl_client *nl)
+{
+  unsigned long records = 0, datagrams = 0;
+  struct nlmsghdr *nlh;
+  int rc, rem;
 
-int main(int argc, char **argv)
+  nl_client_msg(nl, NETLINK_TEST_HISTORY, NLM_F_REQUEST | NLM_F_DUMP, 0);
+  rc = nl_client_send(nl);
+  if (rc < 0) {
+    printf("sendto(): %s\n", strerror(-rc));
+    return 1;
+  }
+
+  while (1) {
+    rc = nl_client_recv(nl);
+    if (rc < 0) {
+      printf("recv(): %s\n", strerror(-rc));
+      return 1;
+    }
+    datagrams++;
+
+    nl_client_for_each_msg(nl, nlh, rem) {
+      struct netlink_test_record *rec = NLMSG_DATA(nlh);
+
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        printf("%lu records in %lu datagrams\n", records, datagrams);
+        return 0;
+      }
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        printf("dump: %s\n", strerror(-((struct nlmsgerr *)NLMSG_DATA(nlh))->error));
+        return 1;
+      }
+      if (nlh->nlmsg_type != NETLINK_TEST_HISTORY ||
+          NLMSG_PAYLOAD(nlh, 0) < sizeof(*rec))
+        continue;
+
+      printf("%llu pid %u len %u: %.*s\n", (unsigned long long)rec->seq,
+             rec->pid, rec->len, NETLINK_TEST_RECORD_MSG, rec->msg);
+      records++;
+    }
+  }
+}
+
+static int send_credit(struct nl_client *nl, __u32 credits)
 {
-  struct sockaddr_nl src_addr;
-  struct sockaddr_nl dest_addr;
   struct nlmsghdr *nlh;
-  struct msghdr msg;
-  struct iovec iov;
-  int sock_fd;
   int rc;
 
-  if (argc != 2) {
-    printf("usage: %s <message>\n", argv[0]);
-    return 1;
+  nlh = nl_client_msg(nl, NETLINK_TEST_CREDIT, NLM_F_REQUEST, sizeof(credits));
+  memcpy(NLMSG_DATA(nlh), &credits, sizeof(credits));
+  rc = nl_client_send(nl);
+  if (rc < 0) {
+    printf("sendto(): %s\n", strerror(-rc));
+    return -1;
   }
+  return 0;
+}
 
-  printf("Process id of the process: %d\n", getpid());  
+/*
+ * Send 'count' echo requests as fast as the credit window allows and
+ * read every reply. Credits are given back every half window, so the
+ * kernel never has more than a window of replies in our receive queue
+ * and none of them is lost.
+ */
+static int flood(struct nl_client *nl, unsigned long count, const char *text)
+{
+  unsigned long sent = 0, received = 0;
+  unsigned int window = 0, credits, to_return = 0;
+  size_t payload = strnlen(text, MAX_PAYLOAD - 1) + 1;
+  struct timespec t0, t1;
+  struct nlmsghdr *nlh;
+  double secs;
+  int rc, rem;
 
-  sock_fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_TEST);
-  if (sock_fd < 0) {
-    printf("socket: %s\n", strerror(errno));
+  /* open flow control, the kernel answers with the window */
+  if (send_credit(nl, 0) < 0)
     return 1;
+  while (!window) {
+    rc = nl_client_recv(nl);
+    if (rc < 0) {
+      printf("recv(): %s\n", strerror(-rc));
+      return 1;
+    }
+    nlh = (struct nlmsghdr *)nl->rx;
+    if (!NLMSG_OK(nlh, rc) || nlh->nlmsg_type != NETLINK_TEST_CREDIT)
+      continue;
+    memcpy(&window, NLMSG_DATA(nlh), sizeof(window));
+    if (!window) {
+      printf("the kernel could not open flow control\n");
+      return 1;
+    }
   }
+  credits = window;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (received < count) {
+    /* the driver reads one request per datagram */
+    for (; credits && sent < count; credits--, sent++) {
+      nlh = nl_client_msg(nl, 0, 0, payload);  /* echo request */
+      memcpy(NLMSG_DATA(nlh), text, payload - 1);
+      rc = nl_client_send(nl);
+      if (rc < 0) {
+        printf("sendto(): %s\n", strerror(-rc));
+        return 1;
+      }
+    }
+
+    rc = nl_client_recv(nl);
+    if (rc < 0) {
+      /* ENOBUFS here would mean a lost reply, which credits rule out */
+      printf("recv(): %s\n", strerror(-rc));
+      return 1;
+    }
+    nl_client_for_each_msg(nl, nlh, rem) {
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        received++;
+        to_return++;
+      }
+    }
+
+    if (to_return && (to_return >= window / 2 || !credits)) {
+      if (send_credit(nl, to_return) < 0)
+        return 1;
+      credits += to_return;
+      to_return = 0;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
 
-  memset(&src_addr, 0, sizeof(src_addr));
-  src_addr.nl_family = AF_NETLINK;
-  src_addr.nl_pid = getpid();  /* self pid */
-  src_addr.nl_groups = 0;  /* not in mcast groups */
-  bind(sock_fd, (struct sockaddr*)&src_addr, sizeof(src_addr));
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("%lu replies of %lu in %.3f s, %.0f/s, window %u\n", received, count,
+         secs, secs > 0 ? received / secs : 0, window);
+  return 0;
+}
 
-  memset(&dest_addr, 0, sizeof(dest_addr));
-  dest_addr.nl_family = AF_NETLINK;
-  dest_addr.nl_pid = 0;   /* For Linux Kernel */
-  dest_addr.nl_groups = 0; /* unicast */
+int main(int argc, char **argv)
+{
+  struct nlmsghdr *nlh;
+  int rc;
 
-  nlh = (struct nlmsghdr *)malloc(NLMSG_SPACE(MAX_PAYLOAD));
+  if (argc != 2 && !(argc == 4 && !strcmp(argv[1], "--flood"))) {
+    printf("usage: %s <message>\n"
+           "       %s --dump\n"
+           "       %s --flood <count> <message>\n", argv[0], argv[0], argv[0]);
+    return 1;
+  }
 
-  /* Fill the netlink message header */
-  nlh->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
-  nlh->nlmsg_pid = getpid();  /* self pid */
-  nlh->nlmsg_flags = 0;
+  printf("Process id of the process: %d\n", getpid());  
+
+  rc = nl_client_open(&nl, NETLINK_TEST);
+  if (rc < 0) {
+    printf("socket: %s\n", strerror(-rc));
+    return 1;
+  }
 
-  /* Fill in the netlink message payload */
-  strcpy(NLMSG_DATA(nlh), argv[1]);
+  if (!strcmp(argv[1], "--dump")) {
+    rc = dump_history(&nl);
+    nl_client_close(&nl);
+    return rc;
+  }
 
-  memset(&iov, 0, sizeof(iov));
-  iov.iov_base = (void *)nlh;
-  iov.iov_len = nlh->nlmsg_len;
+  if (!strcmp(argv[1], "--flood")) {
+    rc = flood(&nl, strtoul(argv[2], NULL, 0), argv[3]);
+    nl_client_close(&nl);
+    return rc;
+  }
 
-  memset(&msg, 0, sizeof(msg));
-  msg.msg_name = (void *)&dest_addr;
-  msg.msg_namelen = sizeof(dest_addr);
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
+  /* echo request, the payload is built in place */
+  nlh = nl_client_msg(&nl, 0, 0, MAX_PAYLOAD);
+  strncpy(NLMSG_DATA(nlh), argv[1], MAX_PAYLOAD - 1);
 
   printf("Send to kernel: %s\n", argv[1]);
 
-  rc = sendmsg(sock_fd, &msg, 0);
+  rc = nl_client_send(&nl);
   if (rc < 0) {
-    printf("sendmsg(): %s\n", strerror(errno));
-    close(sock_fd);
+    printf("sendmsg(): %s\n", strerror(-rc));
+    nl_client_close(&nl);
     return 1;
   }
 
   /* Read message from kernel */
-  memset(nlh, 0, NLMSG_SPACE(MAX_PAYLOAD));
-
-  rc = recvmsg(sock_fd, &msg, 0);
+  rc = nl_client_recv(&nl);
   if (rc < 0) {
-    printf("sendmsg(): %s\n", strerror(errno));
-    close(sock_fd);
+    printf("recvmsg(): %s\n", strerror(-rc));
+    nl_client_close(&nl);
     return 1;
   }
 
-  printf("Received from kernel: %s\n", NLMSG_DATA(nlh));
+  nl_client_for_each_msg(&nl, nlh, rc)
+    printf("Received from kernel: %.*s\n", (int)NLMSG_PAYLOAD(nlh, 0),
+           (char *)NLMSG_DATA(nlh));
 
   /* Close Netlink Socket */
-  close(sock_fd);
+  nl_client_close(&nl);
 
   return 0;
 }
@@ -4,7 +4,8 @@
 #include <linux/module.h>
 #include <linux/netlink.h>
 #include <linux/skbuff.h>
-#include <linux/pid_namespace.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
 
 #define NETLINK_TEST 17
 
@@ -22,29 +23,132 @@ struct ns_data {
  */
 static unsigned int net_id;
 
+/*
+ * A reply starts with the cookie of the namespace whose socket sent
+ * it (the SO_NETNS_COOKIE of that namespace), followed by the echoed
+ * message, not NUL terminated.
+ */
+struct netlink_test_reply {
+  __u64 ns_cookie;
+  char msg[];
+};
+
+/*
+ * Per-CPU cache of reply skbs, allocated ahead of time by a work item so
+ * that the echo path takes its reply skb without going to the slab
+ * allocator. The cached skbs have room for NL_REPLY_CACHE_PAYLOAD bytes,
+ * the common message; longer replies fall back to nlmsg_new(). They are
+ * kept small on purpose: netlink_unicast() trims an skb that is more than
+ * half empty by reallocating its head, which would bring the allocation
+ * back.
+ */
+#define NL_REPLY_CACHE_PAYLOAD  128
+#define NL_REPLY_CACHE_SIZE     32  /* skbs per CPU */
+#define NL_REPLY_CACHE_LOW      8   /* refill below this */
+
+struct nl_reply_cache {
+    struct sk_buff_head skbs;
+    struct work_struct refill;
+    int cpu;
+};
+
+static DEFINE_PER_CPU(struct nl_reply_cache, nl_reply_cache);
+
+static void nl_reply_cache_refill(struct work_struct *work)
+{
+    struct nl_reply_cache *cache =
+        container_of(work, struct nl_reply_cache, refill);
+    struct sk_buff *skb;
+
+    while (skb_queue_len_lockless(&cache->skbs) < NL_REPLY_CACHE_SIZE) {
+        skb = nlmsg_new(NL_REPLY_CACHE_PAYLOAD, GFP_KERNEL);
+        if (!skb)
+            break;
+        skb_queue_tail(&cache->skbs, skb);
+    }
+}
+
+/*
+ * Reply skb for a message of 'payload' bytes. The cache of the current
+ * CPU is used; being migrated right after picking it is harmless, the
+ * queue has its own lock.
+ */
+static struct sk_buff *nl_reply_alloc(int payload)
+{
+    struct nl_reply_cache *cache = raw_cpu_ptr(&nl_reply_cache);
+    struct sk_buff *skb;
+
+    if (payload > NL_REPLY_CACHE_PAYLOAD)
+        return nlmsg_new(payload, GFP_KERNEL);
+
+    skb = skb_dequeue(&cache->skbs);
+    if (skb_queue_len_lockless(&cache->skbs) < NL_REPLY_CACHE_LOW)
+        queue_work_on(cache->cpu, system_wq, &cache->refill);
+    if (!skb)
+        skb = nlmsg_new(payload, GFP_KERNEL);
+    return skb;
+}
+
+static void nl_reply_cache_init(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct nl_reply_cache *cache = per_cpu_ptr(&nl_reply_cache, cpu);
+
+        skb_queue_head_init(&cache->skbs);
+        INIT_WORK(&cache->refill, nl_reply_cache_refill);
+        cache->cpu = cpu;
+        nl_reply_cache_refill(&cache->refill);
+    }
+}
+
+/* Called once nothing can take a reply skb anymore */
+static void nl_reply_cache_destroy(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct nl_reply_cache *cache = per_cpu_ptr(&nl_reply_cache, cpu);
+
+        cancel_work_sync(&cache->refill);
+        skb_queue_purge(&cache->skbs);
+    }
+}
+
+/*
+ * The skb is charged to the socket that received it, our socket of the
+ * sender's namespace, so sock_net(skb->sk) is that namespace. No lookup
+ * of the sending process and no reference to take: the cost of a
+ * message does not depend on how many namespaces (or processes) exist.
+ */
 static void netlink_test_recv_msg(struct sk_buff *skb)
 {
+    struct net *net = sock_net(skb->sk);
+    struct netlink_test_reply *reply;
     struct sk_buff *skb_out;
     struct nlmsghdr *nlh;
     int msg_size;
     char *msg;
-    int pid;
+    u32 portid;
     int res;
 
     nlh = (struct nlmsghdr *)skb->data;
+    /* the header and its length come from the sender */
+    if (!nlmsg_ok(nlh, skb->len)) {
+      printk_ratelimited(KERN_INFO "netlink_test: Dropping malformed message of %u bytes\n",
+                         skb->len);
+      return;
+    }
     msg = (char *)nlmsg_data(nlh);
-    msg_size = strlen(msg);
-
-    printk(KERN_INFO "netlink_test: Received %s\n", msg);
+    msg_size = strnlen(msg, nlmsg_len(nlh));
 
-    // pid of the sending (user space) process
-    pid = nlh->nlmsg_pid;
+    // netlink port of the sending socket, unique in its namespace
+    portid = NETLINK_CB(skb).portid;
 
-    // get namespace of the sending process
-    struct net *net = get_net_ns_by_pid(pid);
-
-    printk(KERN_INFO "netlink_test: Received from pid %d, namespace %p, net_id: %d: %s\n",
-           pid, net, net_id, msg);
+    // per message output only with dynamic debug enabled
+    pr_debug("netlink_test: Received from port %u, namespace %p, net_id: %d: %.*s\n",
+             portid, net, net_id, msg_size, msg);
 
     // get our data for this network namespace
     struct ns_data *data = net_generic(net, net_id);
@@ -54,20 +158,21 @@ static void netlink_test_recv_msg(struct sk_buff *skb)
     }
 
     // create reply
-    skb_out = nlmsg_new(msg_size, 0);
+    skb_out = nl_reply_alloc(sizeof(struct netlink_test_reply) + msg_size);
     if (!skb_out) {
       printk(KERN_ERR "netlink_test: Failed to allocate new skb\n");
       return;
     }
 
-    // put message into response
-    nlh = nlmsg_put(skb_out, 0, 0, NLMSG_DONE, msg_size, 0);
+    // put the namespace and the message into response
+    nlh = nlmsg_put(skb_out, 0, 0, NLMSG_DONE,
+                    sizeof(struct netlink_test_reply) + msg_size, 0);
     NETLINK_CB(skb_out).dst_group = 0; /* not in mcast group */
-    strncpy(nlmsg_data(nlh), msg, msg_size);
-
-    printk(KERN_INFO "netlink_test: Send %s\n", msg);
+    reply = nlmsg_data(nlh);
+    reply->ns_cookie = net->net_cookie;
+    memcpy(reply->msg, msg, msg_size);
 
-    res = nlmsg_unicast(data->sk, skb_out, pid);
+    res = nlmsg_unicast(data->sk, skb_out, portid);
     if (res < 0)
       printk(KERN_INFO "netlink_test: Error while sending skb to user\n");
 }
@@ -117,6 +222,7 @@ static int __init netlink_test_init(void)
 {
   printk(KERN_INFO "netlink_test: Init module\n");
 
+  nl_reply_cache_init();
   register_pernet_subsys(&net_ops);
 
   return 0;
@@ -127,6 +233,7 @@ static void __exit netlink_test_exit(void)
   printk(KERN_INFO "netlink_test: Exit module\n");
 
   unregister_pernet_subsys(&net_ops);
+  nl_reply_cache_destroy();
 }
 
 module_init(netlink_test_init);
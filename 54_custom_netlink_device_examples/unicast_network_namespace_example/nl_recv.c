@@ -3,13 +3,59 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #define NETLINK_TEST 17
 
 #include <sys/socket.h>
 #include <linux/netlink.h>
 
+#ifndef SO_NETNS_COOKIE
+#define SO_NETNS_COOKIE 71
+#endif
+
 #define MAX_PAYLOAD 1024  /* maximum payload size*/
 
+/* see netlink_test.c */
+struct netlink_test_reply {
+  __u64 ns_cookie;
+  char msg[];
+};
+
+/*
+ * Check that a reply comes from the socket of our own namespace and
+ * echoes 'text'. Returns 0 when it does.
+ */
+static int check_reply(struct nlmsghdr *nlh, int len, __u64 cookie,
+                       const char *text)
+{
+  struct netlink_test_reply *reply = NLMSG_DATA(nlh);
+  int msg_len;
+
+  if (!NLMSG_OK(nlh, len) || NLMSG_PAYLOAD(nlh, 0) < sizeof(*reply)) {
+    printf("short reply\n");
+    return 1;
+  }
+  if (reply->ns_cookie != cookie) {
+    printf("answered by namespace %llu, not by ours (%llu)\n",
+           (unsigned long long)reply->ns_cookie, (unsigned long long)cookie);
+    return 1;
+  }
+  msg_len = NLMSG_PAYLOAD(nlh, 0) - sizeof(*reply);
+  if (msg_len != (int)strlen(text) || memcmp(reply->msg, text, msg_len)) {
+    printf("wrong echo: %.*s\n", msg_len, reply->msg);
+    return 1;
+  }
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-k] <message> [count]\n"
+         "  count  time 'count' round trips instead of printing the reply\n"
+         "  -k     stay in the background with the socket open once answered\n",
+         name);
+}
 
 int main(int argc, char **argv)
 {
@@ -18,11 +64,34 @@ int main(int argc, char **argv)
   struct nlmsghdr *nlh;
   struct msghdr msg;
   struct iovec iov;
+  struct timespec start, end;
+  socklen_t cookie_len;
+  __u64 cookie;
+  int keep = 0;
+  char *text;
   int sock_fd;
+  int count;
+  int opt;
   int rc;
+  int i;
+
+  while ((opt = getopt(argc, argv, "k")) != -1) {
+    if (opt != 'k') {
+      usage(argv[0]);
+      return 1;
+    }
+    keep = 1;
+  }
+  if (argc - optind != 1 && argc - optind != 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  text = argv[optind];
 
-  if (argc != 2) {
-    printf("usage: %s <message>\n", argv[0]);
+  /* with a count, time 'count' round trips instead of printing them */
+  count = argc - optind == 2 ? atoi(argv[optind + 1]) : 1;
+  if (count < 1) {
+    printf("count must be at least 1\n");
     return 1;
   }
 
@@ -32,6 +101,14 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  /* the namespace we are in, to check who answers */
+  cookie_len = sizeof(cookie);
+  if (getsockopt(sock_fd, SOL_SOCKET, SO_NETNS_COOKIE, &cookie, &cookie_len) < 0) {
+    printf("getsockopt(SO_NETNS_COOKIE): %s\n", strerror(errno));
+    close(sock_fd);
+    return 1;
+  }
+
   memset(&src_addr, 0, sizeof(src_addr));
   src_addr.nl_family = AF_NETLINK;
   src_addr.nl_pid = getpid();  /* self pid */
@@ -44,18 +121,14 @@ int main(int argc, char **argv)
   dest_addr.nl_groups = 0; /* unicast */
 
   nlh = (struct nlmsghdr *)malloc(NLMSG_SPACE(MAX_PAYLOAD));
-
-  /* Fill the netlink message header */
-  nlh->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
-  nlh->nlmsg_pid = getpid();  /* self pid */
-  nlh->nlmsg_flags = 0;
+  memset(nlh, 0, NLMSG_SPACE(MAX_PAYLOAD));
 
   /* Fill in the netlink message payload */
-  strcpy(NLMSG_DATA(nlh), argv[1]);
+  strncpy(NLMSG_DATA(nlh), text, MAX_PAYLOAD - 1);
 
   memset(&iov, 0, sizeof(iov));
   iov.iov_base = (void *)nlh;
-  iov.iov_len = nlh->nlmsg_len;
+  iov.iov_len = NLMSG_SPACE(MAX_PAYLOAD);
 
   memset(&msg, 0, sizeof(msg));
   msg.msg_name = (void *)&dest_addr;
@@ -63,27 +136,63 @@ int main(int argc, char **argv)
   msg.msg_iov = &iov;
   msg.msg_iovlen = 1;
 
-  printf("Send to kernel: %s\n", argv[1]);
-
-  rc = sendmsg(sock_fd, &msg, 0);
-  if (rc < 0) {
-    printf("sendmsg: %s\n", strerror(errno));
-    close(sock_fd);
-    return 1;
+  if (count == 1)
+    printf("Send to kernel: %s\n", text);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++) {
+    /* the reply is read into the request buffer, restore the request */
+    nlh->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
+    nlh->nlmsg_type = 0;
+    nlh->nlmsg_flags = 0;
+    nlh->nlmsg_pid = getpid();
+    strncpy(NLMSG_DATA(nlh), text, MAX_PAYLOAD - 1);
+
+    rc = sendmsg(sock_fd, &msg, 0);
+    if (rc < 0) {
+      printf("sendmsg: %s\n", strerror(errno));
+      close(sock_fd);
+      return 1;
+    }
+
+    /* Read message from kernel */
+    rc = recvmsg(sock_fd, &msg, 0);
+    if (rc < 0) {
+      printf("recvmsg: %s\n", strerror(errno));
+      close(sock_fd);
+      return 1;
+    }
+    if (check_reply(nlh, rc, cookie, text)) {
+      close(sock_fd);
+      return 1;
+    }
   }
-
-  /* Read message from kernel */
-  memset(nlh, 0, NLMSG_SPACE(MAX_PAYLOAD));
-
-  rc = recvmsg(sock_fd, &msg, 0);
-  if (rc < 0) {
-    printf("sendmsg: %s\n", strerror(errno));
-    close(sock_fd);
-    return 1;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (count == 1)
+    printf("Received from kernel: %.*s (namespace %llu)\n",
+           (int)(NLMSG_PAYLOAD(nlh, 0) - sizeof(struct netlink_test_reply)),
+           ((struct netlink_test_reply *)NLMSG_DATA(nlh))->msg,
+           (unsigned long long)cookie);
+  else
+    printf("%d messages, %.2f us per round trip\n", count,
+           ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+           1e3 / count);
+
+  if (keep) {
+    /* answered: let the caller go on, keep the socket open until killed */
+    fflush(stdout);
+    if (fork() > 0)
+      return 0;
+    setsid();
+    i = open("/dev/null", O_RDWR);
+    dup2(i, 0);
+    dup2(i, 1);
+    dup2(i, 2);
+    while (1)
+      pause();
   }
 
-  printf("Received from kernel: %s\n", NLMSG_DATA(nlh));
-
   /* Close Netlink Socket */
   close(sock_fd);
 
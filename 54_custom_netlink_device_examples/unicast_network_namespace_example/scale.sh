@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Per message cost of netlink_test as the number of network namespaces
+# grows: creates up to 1000 namespaces (nltest1, nltest2, ...), each
+# with an nl_recv client that stays connected, and times round trips in
+# the newest namespace at 1, 10, 100 and 1000 namespaces while all the
+# clients are alive.
+#
+# Every reply carries the cookie of the namespace that answered it, and
+# nl_recv fails unless that is its own namespace, so a client counts as
+# ok only when its namespace's socket answered it.
+#
+#   ./scale.sh [namespaces] [round trips]
+#
+
+PATH=$PATH:/usr/sbin
+
+NAMESPACES=${1:-1000}
+MESSAGES=${2:-100000}
+
+rmmod netlink_test 2>/dev/null
+insmod ./netlink_test.ko || exit 1
+
+created=0
+cleanup()
+{
+  i=1
+  while [ $i -le $created ]; do
+    # the kept clients hold the namespace, stop them first
+    ip netns pids nltest$i | xargs -r kill
+    ip netns del nltest$i
+    i=$((i + 1))
+  done
+}
+trap cleanup EXIT
+
+printf "%10s %10s %s\n" namespaces clients "round trips"
+ok=0
+for step in 1 10 100 1000; do
+  [ $step -gt $NAMESPACES ] && step=$NAMESPACES
+
+  while [ $created -lt $step ]; do
+    created=$((created + 1))
+    ip netns add nltest$created || exit 1
+    # one client per namespace, checked and then kept alive
+    ip netns exec nltest$created ./nl_recv -k "nltest$created" >/dev/null &&
+      ok=$((ok + 1))
+  done
+
+  # clients still connected while timing
+  alive=0
+  i=1
+  while [ $i -le $created ]; do
+    [ -n "$(ip netns pids nltest$i)" ] && alive=$((alive + 1))
+    i=$((i + 1))
+  done
+  [ $alive -lt $ok ] && ok=$alive
+
+  printf "%10d %10d %s\n" $created $ok \
+    "$(ip netns exec nltest$created ./nl_recv probe $MESSAGES)"
+
+  [ $step -eq $NAMESPACES ] && break
+done